@@ -1,6 +1,6 @@
 // dfc.c
 // Minimal DFC client for PA4 assignment (put/list/get).
-// Build: gcc -Wall -Wextra -o dfc dfc.c dfc_maps.c -lssl -lcrypto
+// Build: gcc -Wall -Wextra -o dfc dfc.c dfc_maps.c dfc_manifest.c dfc_rs.c dfc_ring.c dfc_cache.c dfs_codec.c -lssl -lcrypto -lz -lm -pthread
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,30 +9,122 @@
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <limits.h>
 #include <errno.h>
 #include <openssl/md5.h>
+#include <openssl/evp.h>
 #include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include "dfs_proto.h"
+#include "dfs_delta.h"
+#include "dfs_codec.h"
+#include "dfc_maps.h"
+#include "dfc_manifest.h"
+#include "dfc_rs.h"
+#include "dfc_ring.h"
+#include "dfc_cache.h"
 
 #define MAX_SERVERS 128
+#define POOL_MAX 8          // idle sockets kept per server
+#define MAX_INFLIGHT 64
+#define RBUF 16384          // per-session receive buffer
 #define BUF 8192
 #define CONNECT_TIMEOUT_SEC 1
+#define SUSPECT_CONNECT_MS 200  // connect timeout for a server that failed recently
+#define HEALTH_RETRY_SEC 60     // how long a failure keeps a server suspect
+#define HEALTH_SAMPLES 16       // recent latencies kept per server
+#define HEDGE_DEFAULT_MS 50     // hedge delay until a server has a few samples
+#define HEDGE_MIN_MS 2
 #define READ_TIMEOUT_SEC 2
+#define PUSH_TIMEOUT_SEC 300    // a server-to-server copy answers only once the piece is across
+#define RING_COPIES 2           // servers keeping each piece under "ring on"
+#define DELTA_MIN_PIECE (64 << 10)  // smaller pieces are just sent
+#define COMPRESS_MIN_PIECE 4096
+#define ENTROPY_MAX 7.5         // bits per byte above which a piece is taken to be compressed already
+#define ENTROPY_RUNS 16         // sampled runs of ENTROPY_RUN bytes
+#define ENTROPY_RUN 4096
+#define CACHE_DEFAULT_LIMIT (1ULL << 30)   // "cache <dir>" without a size
+
+/* what earlier runs learned about a server, kept in the health file:
+   request latency (EWMA and recent samples, microseconds) and when it last
+   failed or answered */
+typedef struct {
+    double rtt_us;
+    long long last_fail, last_ok;   // unix seconds, 0 if never
+    unsigned samples[HEALTH_SAMPLES];
+    int nsamples, next;
+} health_t;
+
+// one session with a server: socket plus buffered reader
+typedef struct {
+    int fd;
+    int proto;          // 1 text lines, 2 binary frames (dfs_proto.h)
+    unsigned codecs;    // compressed replies the server agreed to send (dfs_codec.h)
+    uint32_t next_id;
+    size_t rpos, rlen;
+    unsigned char rbuf[RBUF];
+} conn_t;
 
 typedef struct {
     char name[128]; // e.g., dfs1
     char host[128];
     int port;
+    conn_t *idle[POOL_MAX]; // pooled keep-alive sessions
+    int nidle;
+    int down;       // connect failed during this run; skip from now on
+    int nopipe;     // server drops pipelined commands; send one at a time
+    int proto;      // protocol agreed on the first session, 0 until known
+    int weight;     // share of the ring ("server <name> <host:port> [weight]")
+    int batch;      // MPUT/MGET: 1 spoken, -1 not, 0 not asked yet
+    health_t h;
 } server_t;
 
 static server_t servers[MAX_SERVERS];
 static int nservers = 0;
+static int max_inflight = 8;    // concurrent transfers ("inflight <n>" in dfc.conf)
+static size_t buffer_budget = 8 << 20;  // bytes of transfer buffers ("buffer <n>[K|M|G]")
+static int max_proto = DFS_PROTO_VERSION; // "protocol 1" keeps sessions on text lines
+static int use_manifest = 0;    // "manifest on": put writes <file>.m, get reads it first
+static int ec_k = 0, ec_m = 0;  // "ec <k> <m>": put stores k data + m parity shards instead of copies
+static int use_dedup = 0;       // "dedup on": ask servers for each body by hash before sending it
+static int use_chain = 0;       // "chain on": each piece is uploaded once and forwarded server to server
+static int use_delta = 0;       // "delta on": put sends only what changed in pieces the servers already hold
+static int put_codec = -1;      // "compress <codec> [level]|off": put compresses pieces that look compressible
+static int put_level = -1;
+static size_t stripe_unit = 0;  // "stripe <n>[K|M|G]|off": put deals n-byte stripes over every server
+static int use_ring = 0;        // "ring on": pieces go where the consistent-hash ring says, not by rotation
+static ring_t *ring;
+static char health_path[512] = ".dfc_health"; // "health <path>|off"
+static int hedge_pct = 90;      // "hedge <percentile>|off": when a read is duplicated
+static pthread_mutex_t pool_mu = PTHREAD_MUTEX_INITIALIZER;    // guards pools and health
 
 static void trimnl(char *s) {
     size_t L = strlen(s);
     while (L && (s[L-1]=='\n' || s[L-1]=='\r')) { s[--L]=0; }
 }
 
+// "64K", "8M", "1G" or plain bytes; (size_t)-1 if unparsable, as in dfs.c
+static size_t parse_size(const char *v) {
+    char *end;
+    unsigned long long n = strtoull(v, &end, 10);
+    if (end == v) return (size_t)-1;
+    switch (*end) {
+    case 'k': case 'K': n <<= 10; break;
+    case 'm': case 'M': n <<= 20; break;
+    case 'g': case 'G': n <<= 30; break;
+    case 0: break;
+    default: return (size_t)-1;
+    }
+    return (size_t)n;
+}
+
 static int parse_conf(const char *path) {
     FILE *f = fopen(path, "r");
     if (!f) return -1;
@@ -42,6 +134,73 @@ static int parse_conf(const char *path) {
         if (strlen(line)==0) continue;
         // expecting: server dfs1 127.0.0.1:10001
         char token[64], name[128], hostport[256];
+        int v;
+        if (sscanf(line, "inflight %d", &v) == 1) {
+            if (v >= 1 && v <= MAX_INFLIGHT) max_inflight = v;
+            continue;
+        }
+        if (sscanf(line, "protocol %d", &v) == 1) {
+            if (v >= 1 && v <= DFS_PROTO_VERSION) max_proto = v;
+            continue;
+        }
+        if (sscanf(line, "health %511s", health_path) == 1) {
+            if (strcmp(health_path, "off") == 0) health_path[0] = 0;
+            continue;
+        }
+        if (sscanf(line, "hedge %63s", token) == 1) {
+            v = strcmp(token, "off") == 0 ? 0 : atoi(token);
+            if (v >= 0 && v < 100) hedge_pct = v;
+            continue;
+        }
+        if (sscanf(line, "dedup %63s", token) == 1) {
+            use_dedup = strcmp(token, "on") == 0;
+            continue;
+        }
+        if (sscanf(line, "delta %63s", token) == 1) {
+            use_delta = strcmp(token, "on") == 0;
+            continue;
+        }
+        if (sscanf(line, "compress %63s", token) == 1) {
+            put_level = sscanf(line, "compress %*s %d", &v) == 1 ? v : -1;
+            put_codec = codec_find(token);  // "off" is no codec
+            continue;
+        }
+        if (sscanf(line, "chain %63s", token) == 1) {
+            use_chain = strcmp(token, "on") == 0;
+            continue;
+        }
+        if (sscanf(line, "ring %63s", token) == 1) {
+            use_ring = strcmp(token, "on") == 0;
+            continue;
+        }
+        if (sscanf(line, "manifest %63s", token) == 1) {
+            use_manifest = strcmp(token, "on") == 0;
+            continue;
+        }
+        if (sscanf(line, "ec %63s", token) == 1) {
+            int k, m;
+            // erasure-coded files are only findable through their manifest
+            if (sscanf(line, "ec %d %d", &k, &m) == 2 && k >= 1 && m >= 1 && k + m <= RS_MAX_SHARDS) {
+                ec_k = k; ec_m = m; use_manifest = 1;
+            } else if (strcmp(token, "off") == 0) ec_k = ec_m = 0;
+            continue;
+        }
+        if (sscanf(line, "stripe %63s", token) == 1) {
+            size_t u = parse_size(token);
+            if (strcmp(token, "off") == 0) stripe_unit = 0;
+            else if (u != (size_t)-1 && u >= 4096) stripe_unit = u;
+            continue;
+        }
+        if (sscanf(line, "cache %255s", hostport) == 1) {
+            size_t lim = sscanf(line, "cache %*s %63s", token) == 1 ? parse_size(token) : CACHE_DEFAULT_LIMIT;
+            if (strcmp(hostport, "off") != 0 && lim && lim != (size_t)-1) pcache_init(hostport, lim);
+            continue;
+        }
+        if (sscanf(line, "buffer %63s", token) == 1) {
+            size_t b = parse_size(token);
+            if (b && b != (size_t)-1) buffer_budget = b;
+            continue;
+        }
         if (sscanf(line, "%63s %127s %255s", token, name, hostport) == 3) {
             if (strcmp(token, "server") != 0) continue;
             char *colon = strchr(hostport, ':');
@@ -50,11 +209,19 @@ static int parse_conf(const char *path) {
             strncpy(servers[nservers].name, name, sizeof(servers[nservers].name)-1);
             strncpy(servers[nservers].host, hostport, sizeof(servers[nservers].host)-1);
             servers[nservers].port = atoi(colon+1);
+            if (sscanf(line, "%*s %*s %*s %d", &v) != 1 || v < 1 || v > RING_MAX_WEIGHT) v = 1;
+            servers[nservers].weight = v;
             nservers++;
             if (nservers >= MAX_SERVERS) break;
         }
     }
     fclose(f);
+    // two shards on one server would be lost together, beyond what m parity shards cover
+    if (ec_k && ec_k + ec_m > nservers) {
+        fprintf(stderr, "ec %d %d needs %d servers, %s lists %d: storing files replicated\n",
+                ec_k, ec_m, ec_k + ec_m, path, nservers);
+        ec_k = ec_m = 0;
+    }
     return nservers;
 }
 
@@ -67,7 +234,7 @@ static int set_sock_timeout(int sock, int sec) {
     return 0;
 }
 
-static int connect_to(const char *host, int port) {
+static int connect_to(const char *host, int port, int timeout_ms) {
     struct addrinfo hints, *res, *rp;
     char portstr[16];
     snprintf(portstr, sizeof(portstr), "%d", port);
@@ -92,7 +259,7 @@ static int connect_to(const char *host, int port) {
                 fd_set wf;
                 FD_ZERO(&wf);
                 FD_SET(s, &wf);
-                struct timeval tv; tv.tv_sec = CONNECT_TIMEOUT_SEC; tv.tv_usec = 0;
+                struct timeval tv; tv.tv_sec = timeout_ms / 1000; tv.tv_usec = timeout_ms % 1000 * 1000;
                 rc = select(s+1, NULL, &wf, NULL, &tv);
                 if (rc > 0 && FD_ISSET(s, &wf)) {
                     int err = 0; socklen_t len = sizeof(err);
@@ -110,6 +277,9 @@ static int connect_to(const char *host, int port) {
     }
     freeaddrinfo(res);
     if (s < 0) return -1;
+    // requests are a header write then the body; don't hold the body for an ACK
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
     return s;
 }
 
@@ -117,29 +287,381 @@ static int write_all(int fd, const void *buf, size_t len) {
     const char *p = buf;
     size_t left = len;
     while (left) {
-        ssize_t w = send(fd, p, left, 0);
+        ssize_t w = send(fd, p, left, MSG_NOSIGNAL);
         if (w <= 0) return -1;
         left -= w; p += w;
     }
     return 0;
 }
 
-static int read_line(int fd, char *buf, size_t max) {
+static conn_t *conn_new(int fd) {
+    conn_t *c = malloc(sizeof(*c));
+    if (!c) { close(fd); return NULL; }
+    c->fd = fd;
+    c->proto = 1;
+    c->next_id = 1;
+    c->rpos = c->rlen = 0;
+    return c;
+}
+
+static void conn_close(conn_t *c) {
+    close(c->fd);
+    free(c);
+}
+
+// up to n bytes, from the buffer first; <= 0 on EOF or error
+static ssize_t conn_read(conn_t *c, void *buf, size_t n) {
+    if (c->rpos < c->rlen) {
+        size_t k = c->rlen - c->rpos < n ? c->rlen - c->rpos : n;
+        memcpy(buf, c->rbuf + c->rpos, k);
+        c->rpos += k;
+        return k;
+    }
+    // large reads bypass the buffer
+    if (n >= sizeof(c->rbuf)) return recv(c->fd, buf, n, 0);
+    ssize_t r = recv(c->fd, c->rbuf, sizeof(c->rbuf), 0);
+    if (r <= 0) return r;
+    c->rpos = 0;
+    c->rlen = r;
+    return conn_read(c, buf, n);
+}
+
+static int conn_read_exact(conn_t *c, void *buf, size_t n) {
+    unsigned char *p = buf;
+    while (n) {
+        ssize_t r = conn_read(c, p, n);
+        if (r <= 0) return -1;
+        p += r; n -= r;
+    }
+    return 0;
+}
+
+static int read_line(conn_t *c, char *buf, size_t max) {
     size_t i = 0;
     while (i + 1 < max) {
-        char c;
-        ssize_t r = recv(fd, &c, 1, 0);
-        if (r <= 0) {
-            if (i==0) return -1;
-            break;
+        if (c->rpos == c->rlen) {
+            ssize_t r = recv(c->fd, c->rbuf, sizeof(c->rbuf), 0);
+            if (r <= 0) {
+                if (i==0) return -1;
+                break;
+            }
+            c->rpos = 0;
+            c->rlen = r;
         }
-        buf[i++] = c;
-        if (c == '\n') break;
+        char ch = c->rbuf[c->rpos++];
+        buf[i++] = ch;
+        if (ch == '\n') break;
     }
     buf[i] = 0;
     return (int)i;
 }
 
+/* Requests and replies in either protocol.
+   send_request writes "PUT <name> <len>[ args]", "GET <name>[ args]",
+   "HAVE <hash>[ args]", "PUSH <name> <args>", "DEL <name>", "STAT <name>",
+   "MPUT <len>", "MGET <len>" or "LIST[ args]"
+   on text sessions and a frame on binary ones, and returns the request id.
+   read_reply parses "OK|ERR[ info]" or a reply frame; len is the body that
+   follows (a text LIST has no status line and is read separately). */
+
+typedef struct {
+    int ok;
+    uint32_t reqid;
+    char info[256];
+    uint64_t len;
+} reply_t;
+
+static int send_request(conn_t *c, int op, const char *name, const char *args, uint64_t paylen, uint32_t *reqid) {
+    char hdr[1024];
+    size_t n;
+    name = name ? name : "";
+    args = args ? args : "";
+    *reqid = c->next_id++;
+    if (c->proto >= 2) {
+        size_t nl = strlen(name), al = strlen(args);
+        if (DFS_HDR_LEN + nl + al > sizeof(hdr)) return -1;
+        dfs_hdr h = { op, 0, *reqid, nl, al, paylen };
+        dfs_hdr_pack((unsigned char *)hdr, &h);
+        memcpy(hdr + DFS_HDR_LEN, name, nl);
+        memcpy(hdr + DFS_HDR_LEN + nl, args, al);
+        n = DFS_HDR_LEN + nl + al;
+    } else {
+        const char *sep = *args ? " " : "";
+        if (op == OP_PUT) n = snprintf(hdr, sizeof(hdr), "PUT %s %llu%s%s\n", name, (unsigned long long)paylen, sep, args);
+        else if (op == OP_PATCH) n = snprintf(hdr, sizeof(hdr), "PATCH %s %llu%s%s\n", name, (unsigned long long)paylen, sep, args);
+        else if (op == OP_SIGS) n = snprintf(hdr, sizeof(hdr), "SIGS %s%s%s\n", name, sep, args);
+        else if (op == OP_GET) n = snprintf(hdr, sizeof(hdr), "GET %s%s%s\n", name, sep, args);
+        else if (op == OP_HAVE) n = snprintf(hdr, sizeof(hdr), "HAVE %s%s%s\n", name, sep, args);
+        else if (op == OP_PUSH) n = snprintf(hdr, sizeof(hdr), "PUSH %s%s%s\n", name, sep, args);
+        else if (op == OP_DEL) n = snprintf(hdr, sizeof(hdr), "DEL %s%s%s\n", name, sep, args);
+        else if (op == OP_STAT) n = snprintf(hdr, sizeof(hdr), "STAT %s%s%s\n", name, sep, args);
+        else if (op == OP_MPUT) n = snprintf(hdr, sizeof(hdr), "MPUT %llu\n", (unsigned long long)paylen);
+        else if (op == OP_MGET) n = snprintf(hdr, sizeof(hdr), "MGET %llu\n", (unsigned long long)paylen);
+        else n = snprintf(hdr, sizeof(hdr), "LIST%s%s\n", sep, args);
+        if (n >= sizeof(hdr)) return -1;
+    }
+    return write_all(c->fd, hdr, n);
+}
+
+static int read_reply(conn_t *c, reply_t *r) {
+    r->info[0] = 0;
+    r->len = 0;
+    r->reqid = 0;
+    if (c->proto >= 2) {
+        unsigned char b[DFS_HDR_LEN];
+        dfs_hdr h;
+        if (conn_read_exact(c, b, sizeof(b)) < 0 || dfs_hdr_unpack(b, &h) < 0) return -1;
+        if (h.opcode != OP_REPLY || h.namelen || h.arglen >= sizeof(r->info)) return -1;
+        if (conn_read_exact(c, r->info, h.arglen) < 0) return -1;
+        r->info[h.arglen] = 0;
+        r->ok = !(h.flags & DFS_F_ERR);
+        r->reqid = h.reqid;
+        r->len = h.paylen;
+        return 0;
+    }
+    char line[300];
+    if (read_line(c, line, sizeof(line)) <= 0) return -1;
+    trimnl(line);
+    r->ok = strncmp(line, "OK", 2) == 0;
+    const char *sp = strchr(line, ' ');
+    if (sp) snprintf(r->info, sizeof(r->info), "%s", sp + 1);
+    return 0;
+}
+
+/* Health cache: latencies and failures survive between runs in the health
+   file (one line per server: name, EWMA, last failure, last success,
+   samples). A server that failed within HEALTH_RETRY_SEC gets a short connect
+   timeout and is asked last; reads go to the fastest holder first and are
+   hedged to the next one after that server's hedge_pct latency percentile. */
+
+static void health_load() {
+    FILE *f = health_path[0] ? fopen(health_path, "r") : NULL;
+    if (!f) return;
+    char line[1024], name[128];
+    while (fgets(line, sizeof(line), f)) {
+        health_t h = {0};
+        int n;
+        if (sscanf(line, "%127s %lf %lld %lld%n", name, &h.rtt_us, &h.last_fail, &h.last_ok, &n) != 4) continue;
+        const char *p = line + n;
+        unsigned v;
+        while (h.nsamples < HEALTH_SAMPLES && sscanf(p, " %u%n", &v, &n) == 1) {
+            h.samples[h.nsamples++] = v;
+            p += n;
+        }
+        h.next = h.nsamples % HEALTH_SAMPLES;
+        for (int i=0;i<nservers;i++) if (strcmp(servers[i].name, name) == 0) servers[i].h = h;
+    }
+    fclose(f);
+}
+
+// written to a temporary name and renamed, so concurrent runs never see half a file
+static void health_save() {
+    if (!health_path[0]) return;
+    char tmp[600];
+    snprintf(tmp, sizeof(tmp), "%s.%d", health_path, (int)getpid());
+    FILE *f = fopen(tmp, "w");
+    if (!f) return;
+    pthread_mutex_lock(&pool_mu);
+    for (int i=0;i<nservers;i++) {
+        health_t *h = &servers[i].h;
+        fprintf(f, "%s %.0f %lld %lld", servers[i].name, h->rtt_us, h->last_fail, h->last_ok);
+        for (int k=0;k<h->nsamples;k++) fprintf(f, " %u", h->samples[(h->next + HEALTH_SAMPLES - h->nsamples + k) % HEALTH_SAMPLES]);
+        fputc('\n', f);
+    }
+    pthread_mutex_unlock(&pool_mu);
+    if (fclose(f) != 0 || rename(tmp, health_path) != 0) unlink(tmp);
+}
+
+static void health_sample(int idx, double us) {
+    health_t *h = &servers[idx].h;
+    pthread_mutex_lock(&pool_mu);
+    h->rtt_us = h->rtt_us > 0 ? h->rtt_us * 0.8 + us * 0.2 : us;
+    h->samples[h->next] = us > 4e9 ? 4000000000u : (unsigned)us;
+    h->next = (h->next + 1) % HEALTH_SAMPLES;
+    if (h->nsamples < HEALTH_SAMPLES) h->nsamples++;
+    h->last_ok = time(NULL);
+    pthread_mutex_unlock(&pool_mu);
+}
+
+// connected but did not answer
+static void health_failed(int idx) {
+    pthread_mutex_lock(&pool_mu);
+    servers[idx].h.last_fail = time(NULL);
+    pthread_mutex_unlock(&pool_mu);
+}
+
+static int server_suspect(int idx) {
+    pthread_mutex_lock(&pool_mu);
+    health_t *h = &servers[idx].h;
+    int v = h->last_fail && h->last_fail >= h->last_ok && time(NULL) - h->last_fail < HEALTH_RETRY_SEC;
+    pthread_mutex_unlock(&pool_mu);
+    return v;
+}
+
+// expected cost of asking a server: suspects last, unmeasured ones first
+static double server_cost(int idx) {
+    if (server_suspect(idx)) return 1e18;
+    pthread_mutex_lock(&pool_mu);
+    double v = servers[idx].h.rtt_us;
+    pthread_mutex_unlock(&pool_mu);
+    return v;
+}
+
+// stable sort of order[from..to) by expected cost
+static void sort_by_cost(int *order, int from, int to) {
+    double cost[MAX_SERVERS];
+    for (int i=from;i<to;i++) cost[i] = server_cost(order[i]);
+    for (int i=from+1;i<to;i++) {
+        int o = order[i];
+        double c = cost[i];
+        int j = i;
+        for (; j > from && cost[j-1] > c; j--) { order[j] = order[j-1]; cost[j] = cost[j-1]; }
+        order[j] = o;
+        cost[j] = c;
+    }
+}
+
+// how long to wait on a server before hedging, in microseconds
+static double hedge_delay_us(int idx) {
+    health_t h;
+    pthread_mutex_lock(&pool_mu);
+    h = servers[idx].h;
+    pthread_mutex_unlock(&pool_mu);
+    if (h.nsamples < 4) return HEDGE_DEFAULT_MS * 1000.0;
+    unsigned v[HEALTH_SAMPLES];
+    memcpy(v, h.samples, sizeof(v));
+    for (int i=1;i<h.nsamples;i++) {
+        unsigned x = v[i];
+        int j = i;
+        for (; j > 0 && v[j-1] > x; j--) v[j] = v[j-1];
+        v[j] = x;
+    }
+    double d = v[(h.nsamples - 1) * hedge_pct / 100];
+    return d < HEDGE_MIN_MS * 1000.0 ? HEDGE_MIN_MS * 1000.0 : d;
+}
+
+/* Connection pool: servers keep sessions open, so idle sessions are reused by
+   later commands of this run. Concurrent transfers to one server each check out
+   their own session. A server that fails to connect is marked down so later
+   commands do not pay the connect timeout again. An idle session the server
+   has closed since is dropped at checkout rather than tried.
+   A fresh session offers the binary protocol; a server that refuses it (older
+   servers answer ERR and may close) is remembered and spoken to in text. */
+
+// every codec this client can read is offered
+static int negotiate(conn_t *c) {
+    char req[256], names[200];
+    codec_names((1u << dfs_ncodecs) - 1, names, sizeof(names));
+    snprintf(req, sizeof(req), "PROTO %d CODECS %s\n", max_proto, names);
+    reply_t r;
+    if (write_all(c->fd, req, strlen(req)) < 0 || read_reply(c, &r) < 0 || !r.ok) return -1;
+    c->proto = atoi(r.info) >= 2 ? 2 : 1;
+    const char *cs = strstr(r.info, "CODECS ");
+    c->codecs = cs ? codec_mask(cs + 7) : 0;
+    return 0;
+}
+
+static conn_t *pool_get(int idx, int *reused) {
+    server_t *sv = &servers[idx];
+    *reused = 0;
+    conn_t *c;
+    for (;;) {
+        pthread_mutex_lock(&pool_mu);
+        int down = sv->down;
+        c = (!down && sv->nidle) ? sv->idle[--sv->nidle] : NULL;
+        pthread_mutex_unlock(&pool_mu);
+        if (!c) break;
+        // skip sessions the server has hung up on meanwhile (a one-shot server always does)
+        char b;
+        ssize_t r = recv(c->fd, &b, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { *reused = 1; return c; }
+        conn_close(c);
+    }
+    pthread_mutex_lock(&pool_mu);
+    int down = sv->down;
+    pthread_mutex_unlock(&pool_mu);
+    if (down) return NULL;
+    for (;;) {
+        int s = connect_to(sv->host, sv->port, server_suspect(idx) ? SUSPECT_CONNECT_MS : CONNECT_TIMEOUT_SEC * 1000);
+        if (s < 0) {
+            pthread_mutex_lock(&pool_mu);
+            sv->down = 1;
+            sv->h.last_fail = time(NULL);
+            pthread_mutex_unlock(&pool_mu);
+            return NULL;
+        }
+        if (!(c = conn_new(s))) return NULL;
+        pthread_mutex_lock(&pool_mu);
+        int proto = sv->proto;
+        pthread_mutex_unlock(&pool_mu);
+        if (max_proto < 2 || proto == 1) return c;
+        int rc = negotiate(c);
+        pthread_mutex_lock(&pool_mu);
+        sv->proto = rc == 0 ? c->proto : 1;
+        pthread_mutex_unlock(&pool_mu);
+        if (rc == 0) return c;
+        conn_close(c);  // then reconnect speaking text
+    }
+}
+
+static void pool_put(int idx, conn_t *c) {
+    server_t *sv = &servers[idx];
+    pthread_mutex_lock(&pool_mu);
+    if (sv->nidle < POOL_MAX) { sv->idle[sv->nidle++] = c; c = NULL; }
+    pthread_mutex_unlock(&pool_mu);
+    if (c) conn_close(c);
+}
+
+static void pool_close_all() {
+    pthread_mutex_lock(&pool_mu);
+    for (int i=0;i<nservers;i++) {
+        while (servers[i].nidle) conn_close(servers[i].idle[--servers[i].nidle]);
+    }
+    pthread_mutex_unlock(&pool_mu);
+}
+
+static int server_nopipe(int idx) {
+    pthread_mutex_lock(&pool_mu);
+    int v = servers[idx].nopipe;
+    pthread_mutex_unlock(&pool_mu);
+    return v;
+}
+
+static void server_set_nopipe(int idx) {
+    pthread_mutex_lock(&pool_mu);
+    servers[idx].nopipe = 1;
+    pthread_mutex_unlock(&pool_mu);
+}
+
+/* Parallel transfer engine: runs njobs calls of fn on up to max_inflight
+   threads (the caller is one of them). Jobs are handed out in index order. */
+
+typedef struct {
+    void (*fn)(int job, void *ctx);
+    void *ctx;
+    int njobs;
+    int next;
+} par_t;
+
+static void *par_worker(void *arg) {
+    par_t *p = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) < p->njobs) p->fn(i, p->ctx);
+    return NULL;
+}
+
+static void run_parallel(int njobs, void (*fn)(int job, void *ctx), void *ctx) {
+    par_t p = { fn, ctx, njobs, 0 };
+    int nt = njobs < max_inflight ? njobs : max_inflight;
+    pthread_t th[MAX_INFLIGHT];
+    int started = 0;
+    for (int i = 1; i < nt; i++) {
+        if (pthread_create(&th[started], NULL, par_worker, &p) == 0) started++;
+    }
+    par_worker(&p);
+    for (int i = 0; i < started; i++) pthread_join(th[i], NULL);
+}
+
 static unsigned long md5_mod(const char *name, int mod) {
     unsigned char digest[MD5_DIGEST_LENGTH];
     MD5((unsigned char*)name, strlen(name), digest);
@@ -155,284 +677,2730 @@ static int ensure_file_chunk(const char *fname, int idx, char **outdata, size_t
     return 0;
 }
 
-/* split file into 4 chunks in memory
-   chunk sizes may differ by at most 1
-   returns number of chunks (4) and fills pointers (caller should free them) */
-static int split_file(const char *path, unsigned char **pieces, size_t *plen) {
-    struct stat st;
-    if (stat(path, &st) != 0) return -1;
-    size_t total = st.st_size;
-    FILE *f = fopen(path, "rb");
-    if (!f) return -1;
+/* split a file of total bytes into 4 pieces (offset and length of each)
+   chunk sizes may differ by at most 1, larger ones first */
+static void split_layout(size_t total, size_t *off, size_t *plen) {
     size_t base = total / 4;
     size_t rem = total % 4;
+    size_t o = 0;
     for (int i = 0; i < 4; ++i) {
-        size_t sz = base + (i < (int)rem ? 1 : 0);
-        plen[i] = sz;
-        pieces[i] = malloc(sz ? sz : 1);
-        if (sz) {
-            if (fread(pieces[i], 1, sz, f) != sz) { fclose(f); return -1; }
-        }
+        plen[i] = base + (i < (int)rem ? 1 : 0);
+        off[i] = o;
+        o += plen[i];
     }
-    fclose(f);
-    return 4;
 }
 
-static void free_split(unsigned char **pieces) {
-    for (int i=0;i<4;i++) {
-        if (pieces[i]) free(pieces[i]);
+// per-transfer window: the buffer budget shared by every in-flight transfer
+static size_t window_size() {
+    size_t w = buffer_budget / (size_t)max_inflight;
+    return w < 4096 ? 4096 : w;
+}
+
+// streams len bytes of file fd starting at off to socket s, without loading the file
+static int send_range(int s, int fd, off_t off, size_t len) {
+    while (len) {
+        ssize_t w = sendfile(s, fd, &off, len);
+        if (w > 0) { len -= w; continue; }
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && (errno == EINVAL || errno == ENOSYS)) break;  // e.g. a pipe: copy below
+        return -1;
+    }
+    if (!len) return 0;
+    size_t wsz = window_size();
+    unsigned char *win = malloc(wsz);
+    if (!win) return -1;
+    int rc = 0;
+    while (len && rc == 0) {
+        ssize_t r = pread(fd, win, len < wsz ? len : wsz, off);
+        if (r <= 0 || write_all(s, win, r) < 0) rc = -1;
+        else { len -= r; off += r; }
     }
+    free(win);
+    return rc;
 }
 
-/* Low-level server commands:
-   PUT <chunkname> <len>\n<data>
+/* Low-level server commands (one persistent session per server, pipelined):
+   PUT <chunkname> <len>\n<data> -> "OK\n" or "ERR\n"
    LIST\n  -> returns lines of "chunkname\n" then "END\n"
    GET <chunkname>\n -> returns "OK <len>\n" and data or "ERR\n"
-*/
+   If a session drops mid-batch (idle pooled socket closed by the server, or a
+   server that serves one command per connection) the unanswered commands are
+   re-sent on a fresh socket. A fresh socket that answers nothing to a pipelined
+   batch marks the server nopipe (older servers reset the connection when they
+   close with commands unread); after that a fresh failure ends the batch. */
 
-static int server_put(int idx, const char *chunkname, const unsigned char *data, size_t len) {
-    int s = connect_to(servers[idx].host, servers[idx].port);
-    if (s < 0) return -1;
-    char hdr[512];
-    snprintf(hdr, sizeof(hdr), "PUT %s %zu\n", chunkname, len);
-    if (write_all(s, hdr, strlen(hdr)) < 0) { close(s); return -1; }
-    if (len) {
-        if (write_all(s, data, len) < 0) { close(s); return -1; }
-    }
-    // read optional reply line
-    char line[256];
-    int rc = read_line(s, line, sizeof(line));
-    (void)rc;
-    close(s);
+static int pread_full(int fd, void *buf, size_t n, off_t off) {
+    while (n) {
+        ssize_t r = pread(fd, buf, n, off);
+        if (r <= 0) return -1;
+        buf = (char *)buf + r; n -= r; off += r;
+    }
     return 0;
 }
 
-static int server_list_fetch(int idx, char ***out_lines, int *out_count) {
-    *out_lines = NULL; *out_count = 0;
-    int s = connect_to(servers[idx].host, servers[idx].port);
-    if (s < 0) return -1;
-    if (write_all(s, "LIST\n", 5) < 0) { close(s); return -1; }
-    char buf[1024];
-    while (1) {
-        int r = read_line(s, buf, sizeof(buf));
-        if (r <= 0) break;
-        trimnl(buf);
-        if (strcmp(buf, "END")==0) break;
-        // store line
-        *out_lines = realloc(*out_lines, sizeof(char*) * (*out_count + 1));
-        (*out_lines)[*out_count] = strdup(buf);
-        (*out_count)++;
+static int pwrite_full(int fd, const void *buf, size_t n, off_t off) {
+    while (n) {
+        ssize_t w = pwrite(fd, buf, n, off);
+        if (w <= 0) return -1;
+        buf = (const char *)buf + w; n -= w; off += w;
     }
-    close(s);
     return 0;
 }
 
-static int server_get_chunk(int idx, const char *chunkname, unsigned char **outbuf, size_t *outlen) {
-    *outbuf = NULL; *outlen = 0;
-    int s = connect_to(servers[idx].host, servers[idx].port);
-    if (s < 0) return -1;
-    char hdr[512];
-    snprintf(hdr, sizeof(hdr), "GET %s\n", chunkname);
-    if (write_all(s, hdr, strlen(hdr)) < 0) { close(s); return -1; }
-    // expect "OK <len>\n" or "ERR\n"
-    char line[256];
-    int r = read_line(s, line, sizeof(line));
-    if (r <= 0) { close(s); return -1; }
-    trimnl(line);
-    if (strncmp(line, "OK ", 3) == 0) {
-        size_t len = (size_t)strtoull(line+3, NULL, 10);
-        unsigned char *buf = malloc(len ? len : 1);
-        size_t got = 0;
-        while (got < len) {
-            ssize_t rr = recv(s, buf + got, len - got, 0);
-            if (rr <= 0) { free(buf); close(s); return -1; }
-            got += rr;
-        }
-        *outbuf = buf;
-        *outlen = len;
-        close(s);
-        return 0;
+// digest (MD5, SHA-256) of len bytes of fd at off, read a window at a time
+static int digest_range(const EVP_MD *type, int fd, off_t off, size_t len, unsigned char *digest) {
+    size_t wsz = window_size();
+    unsigned char *win = malloc(wsz);
+    EVP_MD_CTX *md = EVP_MD_CTX_new();
+    int rc = win && md && EVP_DigestInit_ex(md, type, NULL) ? 0 : -1;
+    while (len && rc == 0) {
+        ssize_t r = pread(fd, win, len < wsz ? len : wsz, off);
+        if (r <= 0) rc = -1;
+        else { EVP_DigestUpdate(md, win, r); len -= r; off += r; }
     }
-    close(s);
-    return -1;
+    if (rc == 0) EVP_DigestFinal_ex(md, digest, NULL);
+    EVP_MD_CTX_free(md);
+    free(win);
+    return rc;
 }
 
-static void cmd_list() {
-    if (nservers <= 0) { fprintf(stderr, "No servers\n"); return; }
-    // fetch lists from each server
-    // store presence map: filename -> pieces present (bitmask)
-    typedef struct fileinfo { char name[256]; int mask; struct fileinfo *next; } fileinfo;
-    fileinfo *head = NULL;
-    for (int i=0;i<nservers;i++) {
-        char **lines = NULL; int cnt = 0;
-        if (server_list_fetch(i, &lines, &cnt) != 0) continue;
-        for (int j=0;j<cnt;j++) {
-            char *ln = lines[j];
-            // expecting chunk names like "<filename>.p1"
-            char *dot = strrchr(ln, '.');
-            if (!dot) { free(ln); continue; }
-            if (dot[1] != 'p') { free(ln); continue; }
-            int pidx = atoi(dot+2); // p1..p4
-            if (pidx < 1 || pidx > 100) { free(ln); continue; }
-            // extract filename
-            size_t fnlen = dot - ln;
-            char fname[256]; if (fnlen >= sizeof(fname)) fnlen = sizeof(fname)-1;
-            strncpy(fname, ln, fnlen); fname[fnlen]=0;
-            // find/insert fileinfo
-            fileinfo *f = head;
-            while (f && strcmp(f->name, fname) != 0) f = f->next;
-            if (!f) {
-                f = malloc(sizeof(*f));
-                f->mask = 0;
-                strncpy(f->name, fname, sizeof(f->name)-1); f->name[sizeof(f->name)-1]=0;
-                f->next = head; head = f;
-            }
-            if (pidx >=1 && pidx <= 32) f->mask |= (1 << (pidx-1));
-            free(ln);
+/* sends n PUTs back to back, then collects the n replies; returns how many were stored.
+   body i is lens[i] bytes of file fd at offs[i], or of mem[i] when mem and
+   mem[i] are set; args[i], if given, follows the length. Frame replies are
+   matched to their PUT by request id; text replies arrive in order. */
+static int server_put_batch(int idx, int n, char **names, int fd, size_t *offs, size_t *lens, const char **mem,
+                            const char **args) {
+    int done = 0, ok = 0;
+    while (done < n) {
+        int reused;
+        conn_t *c = pool_get(idx, &reused);
+        if (!c) break;
+        int start = done, end = server_nopipe(idx) ? done + 1 : n, err = 0;
+        uint32_t first = c->next_id;
+        for (int i = done; i < end && !err; i++) {
+            uint32_t id;
+            if (send_request(c, OP_PUT, names[i], args ? args[i] : NULL, lens[i], &id) < 0) err = 1;
+            else if (mem && mem[i]) { if (write_all(c->fd, mem[i], lens[i]) < 0) err = 1; }
+            else if (lens[i] && send_range(c->fd, fd, offs[i], lens[i]) < 0) err = 1;
+        }
+        // a one-shot server may close before reading everything; its replies still count
+        for (err = 0; done < end; done++) {
+            reply_t r;
+            if (read_reply(c, &r) < 0) { err = 1; break; }
+            if (c->proto >= 2 && (r.reqid < first || r.reqid - first >= (uint32_t)(end - start))) { err = 1; break; }
+            if (r.ok) ok++;
+        }
+        if (!err) { pool_put(idx, c); continue; }
+        conn_close(c);
+        if (!reused && done == start) {
+            if (end - start > 1) { server_set_nopipe(idx); continue; }
+            break;
         }
-        free(lines);
     }
-    // print list lines
-    for (fileinfo *f=head; f; f=f->next) {
-        // check if all pieces 1..4 are present
-        int ok = 1;
-        for (int p=1;p<=4;p++) {
-            if (!(f->mask & (1 << (p-1)))) { ok = 0; break; }
+    return done ? ok : -1;
+}
+
+// SHA-256 of len bytes of fd at off, as the hex a HAVE names; "" if it cannot be read
+static void sha256_hex(int fd, off_t off, size_t len, char *hex) {
+    unsigned char d[EVP_MAX_MD_SIZE];
+    hex[0] = 0;
+    if (digest_range(EVP_sha256(), fd, off, len, d) < 0) return;
+    for (int b=0;b<32;b++) sprintf(hex + 2 * b, "%02x", d[b]);
+}
+
+/* "dedup on": asks the server, in one pipelined batch, whether it already
+   holds each file body (by SHA-256; dfs -d), naming the chunk so that a yes
+   also stores it. Servers without a content store answer no to everything.
+   sha[i] is body i's digest in hex (from sha256_hex, hashed once however
+   many servers are asked); bodies without one are not asked about. have[i]
+   is set for the bodies it holds; returns how many. */
+static int server_have_batch(int idx, int n, char **names, char **sha, int *have) {
+    int nhave = 0, reused;
+    memset(have, 0, n * sizeof(int));
+    conn_t *c = pool_get(idx, &reused);
+    if (c) {
+        int sent = 0, err = 0;
+        for (int i=0;i<n && !err;i++) {
+            uint32_t id;
+            if (!sha[i] || !sha[i][0]) continue;
+            if (send_request(c, OP_HAVE, sha[i], names[i], 0, &id) < 0) err = 1;
+            else sent++;
         }
-        if (ok) {
-            printf("%s\n", f->name);
-        } else {
-            printf("%s [incomplete]\n", f->name);
+        // answers come back in order
+        for (int i=0;i<n && sent && !err;i++) {
+            reply_t r;
+            if (!sha[i] || !sha[i][0]) continue;
+            if (read_reply(c, &r) < 0 || r.len) { err = 1; break; }
+            sent--;
+            if (r.ok) { have[i] = 1; nhave++; }
         }
+        if (err) conn_close(c);
+        else pool_put(idx, c);
     }
-    // free
-    while (head) { fileinfo *n=head->next; free(head); head=n; }
+    return nhave;
 }
 
-static void cmd_put(int argc, char **argv) {
-    if (argc < 2) { fprintf(stderr, "Usage: dfc put <filename>\n"); return; }
-    const char *path = argv[1];
-    // split file
-    unsigned char *pieces[4] = {NULL,NULL,NULL,NULL};
-    size_t plen[4] = {0};
-    if (split_file(path, pieces, plen) != 4) {
-        printf("%s put failed\n", argv[1]);
-        return;
+// server_put_batch that first drops the bodies the server already holds (sha as for server_have_batch)
+static int server_put_dedup(int idx, int n, char **names, char **sha, int fd, size_t *offs, size_t *lens,
+                            const char **mem, const char **args) {
+    int *have = calloc(n, sizeof(int)), nhave = 0, m = 0;
+    if (have) nhave = server_have_batch(idx, n, names, sha, have);
+    // compact the rest in place and send them
+    for (int i=0;i<n;i++) {
+        if (have && have[i]) continue;
+        names[m] = names[i]; offs[m] = offs[i]; lens[m] = lens[i];
+        if (mem) mem[m] = mem[i];
+        if (args) args[m] = args[i];
+        m++;
     }
-    // compute rotation x = md5(filename) % y
-    char *basefname = strrchr((char*)path,'/');
-    basefname = basefname ? basefname+1 : (char*)path;
-    unsigned long x = md5_mod(basefname, nservers);
-    // for each server j (index idx 0..nservers-1), compute pieces to send
-    for (int j=0;j<nservers;j++) {
-        int server_index = j;
-        int jnum = j+1;
-        int pA = ((jnum - (int)x - 1) % nservers + nservers) % nservers + 1;
-        int pB = (pA % nservers) + 1;
-        // we only support 4 pieces per file; if nservers != 4 allow packaging modulo 4 mapping
-        // map p indices into 1..4 pieces
-        int pieceA = ((pA-1) % 4) + 1;
-        int pieceB = ((pB-1) % 4) + 1;
-        // build chunk names: "<basename>.p<k>"
-        char chunkA[512], chunkB[512];
-        snprintf(chunkA, sizeof(chunkA), "%s.p%d", basefname, pieceA);
-        snprintf(chunkB, sizeof(chunkB), "%s.p%d", basefname, pieceB);
-        // send each chunk
-        // piece arrays are 0-based
-        if (pieces[pieceA-1] && plen[pieceA-1]>0) {
-            server_put(server_index, chunkA, pieces[pieceA-1], plen[pieceA-1]);
-        } else {
-            server_put(server_index, chunkA, pieces[pieceA-1], plen[pieceA-1]);
+    free(have);
+    int stored = m ? server_put_batch(idx, m, names, fd, offs, lens, mem, args) : 0;
+    return stored < 0 ? (nhave ? nhave : -1) : stored + nhave;
+}
+
+#define LIST_PAGE 4096     // names asked for per LIST request
+
+/* one LIST request; the resume name of a truncated listing ("END <name>" or
+   the reply info of a frame) is left in cursor, "" when the listing is
+   complete. returns names delivered, -1 on failure */
+static int list_page(conn_t *c, const char *args, void (*fn)(void *arg, char *name), void *arg,
+                     char *cursor, size_t cursz) {
+    uint32_t id;
+    cursor[0] = 0;
+    if (send_request(c, OP_LIST, NULL, args, 0, &id) < 0) return -1;
+    // text: lines until "END"; frames: lines filling the reply payload
+    uint64_t left = 0;
+    int done = 0, count = 0;
+    if (c->proto >= 2) {
+        reply_t r;
+        if (read_reply(c, &r) < 0 || !r.ok || r.reqid != id) return -1;
+        snprintf(cursor, cursz, "%s", r.info);
+        left = r.len;
+        done = left == 0;
+    }
+    char buf[1024];
+    while (!done) {
+        int r = read_line(c, buf, sizeof(buf));
+        if (r <= 0) break;
+        if (c->proto >= 2) {
+            if ((uint64_t)r > left) break;
+            left -= r;
+            done = left == 0;
         }
-        if (pieces[pieceB-1] && plen[pieceB-1]>0) {
-            server_put(server_index, chunkB, pieces[pieceB-1], plen[pieceB-1]);
-        } else {
-            server_put(server_index, chunkB, pieces[pieceB-1], plen[pieceB-1]);
+        trimnl(buf);
+        if (c->proto < 2 && strncmp(buf, "END", 3) == 0 && (buf[3] == 0 || buf[3] == ' ')) {
+            if (buf[3]) snprintf(cursor, cursz, "%s", buf + 4);
+            done = 1;
+            break;
         }
+        fn(arg, buf);
+        count++;
     }
-    free_split((unsigned char**)pieces);
-    // success (we'll be permissive)
-    // Optionally print nothing. The grader expects no specific "success" text.
+    return done ? count : -1;
 }
 
-static void cmd_get(int argc, char **argv) {
-    if (argc < 2) { fprintf(stderr, "Usage: dfc get <filename>\n"); return; }
-    const char *fname = argv[1];
-    // determine which pieces are available from which server
-    // pieces 1..4; for each piece, find first server that has "<fname>.p<k>"
-    int have[5] = {0}; // index of server+1 that has it, 0 if none
-    for (int k=1;k<=4;k++) {
-        char chunk[512];
-        snprintf(chunk, sizeof(chunk), "%s.p%d", fname, k);
-        for (int i=0;i<nservers;i++) {
-            unsigned char *buf = NULL; size_t len = 0;
-            if (server_get_chunk(i, chunk, &buf, &len) == 0) {
-                // store into temp area (we'll write later)
-                // write to .dfc_temp_pN
-                char tmpn[512];
-                snprintf(tmpn, sizeof(tmpn), "%s.p%d.tmp", fname, k);
-                FILE *tf = fopen(tmpn, "wb");
-                if (tf) {
-                    if (len) fwrite(buf,1,len,tf);
-                    fclose(tf);
-                    have[k] = 1;
-                }
-                free(buf);
-                break;
+/* streams a server's listing of names starting with prefix (NULL for all):
+   fn(arg, name) is called once per chunk name (with sizes, "<name> <size>")
+   as lines arrive, a page of LIST_PAGE names at a time. Older servers ignore
+   the paging words and send everything at once, so fn may also see names
+   outside the prefix.
+   returns the number of names delivered, -1 if unreachable */
+static int server_list_fetch(int idx, const char *prefix, int sizes, void (*fn)(void *arg, char *name), void *arg) {
+    char cursor[512] = "", args[1200];
+    int total = 0;
+    for (;;) {
+        int n = snprintf(args, sizeof(args), "LIMIT %d%s", LIST_PAGE, sizes ? " SIZES" : "");
+        if (prefix) n += snprintf(args + n, sizeof(args) - n, " PREFIX %s", prefix);
+        if (cursor[0]) snprintf(args + n, sizeof(args) - n, " AFTER %s", cursor);
+        int got = -1;
+        for (int attempt = 0; attempt < 2 && got < 0; attempt++) {
+            int reused;
+            conn_t *c = pool_get(idx, &reused);
+            if (!c) break;
+            got = list_page(c, args, fn, arg, cursor, sizeof(cursor));
+            if (got >= 0) { pool_put(idx, c); break; }
+            conn_close(c);
+            // a stale pooled session fails before any line arrives; retry on a fresh one
+            if (!reused) break;
+        }
+        if (got < 0) return total ? total : -1;
+        total += got;
+        if (!cursor[0]) return total;
+    }
+}
+
+/* GET one chunk and stream its body to a sink: begin(arg, len) is called once
+   "OK <len>" arrives and may refuse the body; data(arg, buf, n) receives it in
+   window-sized pieces. returns 0 when the whole body was delivered, 1 if the
+   server does not have the chunk, -1 on failure (including a refused body).
+   attach, if set, is told the session fd in use (-1 once done) so another
+   thread can cut it off; it returns nonzero once the request has been cut
+   off, and the fetch gives up. */
+typedef struct {
+    int (*begin)(void *arg, size_t len);
+    int (*data)(void *arg, const unsigned char *buf, size_t n);
+    void *arg;
+    int (*attach)(void *arg, int fd);
+} sink_t;
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+typedef struct {
+    sink_t *sink;
+    unsigned long long n;   // bytes handed on
+} counted_sink;
+
+static int counted_data(void *arg, const unsigned char *buf, size_t n) {
+    counted_sink *cs = arg;
+    cs->n += n;
+    return cs->sink->data(cs->sink->arg, buf, n) < 0 ? -1 : 0;
+}
+
+/* any request answered with a body (GET, SIGS), streamed into sink; the
+   reply line is left in *rep if given */
+static int server_fetch(int idx, int op, const char *name, const char *args, sink_t *sink, reply_t *rep) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int reused;
+        conn_t *c = pool_get(idx, &reused);
+        if (!c) return -1;
+        if (sink->attach && sink->attach(sink->arg, c->fd)) { pool_put(idx, c); return -1; }
+        uint32_t id;
+        reply_t r;
+        double t0 = now_us();
+        // expect "OK <len>\n" or "ERR\n"
+        if (send_request(c, op, name, args, 0, &id) < 0 || read_reply(c, &r) < 0 ||
+            (c->proto >= 2 && r.reqid != id)) {
+            int cut = sink->attach && sink->attach(sink->arg, -1);
+            conn_close(c);
+            if (reused) continue;
+            if (!cut) health_failed(idx);
+            return -1;
+        }
+        if (op == OP_GET) health_sample(idx, now_us() - t0);    // a SIGS reply waits on the disk
+        int rc = -1;
+        if (rep) *rep = r;
+        size_t len = c->proto >= 2 ? r.len : (size_t)strtoull(r.info, NULL, 10);
+        // a compressed body ("<len> <codec> <raw size>") is decompressed on its way to the sink
+        char cname[32];
+        unsigned long long raw = 0;
+        int codec = sscanf(r.info, "%*s %31s %llu", cname, &raw) == 2 ? codec_find(cname) : -1;
+        codec_stream *st = codec >= 0 ? dfs_codecs[codec].dec_new() : NULL;
+        counted_sink cs = { sink, 0 };
+        // a refused body is still on the wire, so the session cannot be reused
+        if (!r.ok) rc = 1;
+        else if ((codec < 0 || st) && sink->begin(sink->arg, codec >= 0 ? raw : len) == 0) {
+            size_t wsz = window_size();
+            unsigned char *win = malloc(len < wsz ? (len ? len : 1) : wsz);
+            size_t have = 0;
+            while (win && have < len) {
+                size_t want = len - have < wsz ? len - have : wsz;
+                ssize_t rr = conn_read(c, win, want);
+                if (rr <= 0) break;
+                if (st ? dfs_codecs[codec].dec_update(st, win, rr, counted_data, &cs) < 0 : sink->data(sink->arg, win, rr) < 0) break;
+                have += rr;
             }
+            free(win);
+            if (win && have == len) rc = 0;
         }
+        if (st && (dfs_codecs[codec].dec_end(st) < 0 || cs.n != raw) && rc == 0) rc = -1;
+        if (sink->attach) sink->attach(sink->arg, -1);
+        if (rc >= 0) pool_put(idx, c);
+        else conn_close(c);
+        return rc;
     }
-    // check all pieces present
-    int ok = 1;
-    for (int k=1;k<=4;k++) if (!have[k]) ok = 0;
-    if (!ok) {
-        printf("%s is incomplete\n", fname);
-        // cleanup any temp files created
-        for (int k=1;k<=4;k++) {
-            char tmpn[512]; snprintf(tmpn,sizeof(tmpn), "%s.p%d.tmp", fname, k);
-            remove(tmpn);
+    return -1;
+}
+
+static int server_get_stream(int idx, const char *name, sink_t *sink) {
+    return server_fetch(idx, OP_GET, name, NULL, sink, NULL);
+}
+
+/* a request answered by a bare "OK" or "ERR" (PUSH, DEL, STAT), given up to
+   timeout seconds; returns 0 OK, 1 ERR, -1 if the server could not be asked.
+   The reply line is left in *rep if given */
+static int server_command(int idx, int op, const char *name, const char *args, int timeout, reply_t *rep) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int reused;
+        conn_t *c = pool_get(idx, &reused);
+        if (!c) return -1;
+        uint32_t id;
+        reply_t r;
+        set_sock_timeout(c->fd, timeout);
+        int rc = send_request(c, op, name, args, 0, &id) < 0 || read_reply(c, &r) < 0 ||
+                 (c->proto >= 2 && r.reqid != id) || r.len ? -1 : 0;
+        set_sock_timeout(c->fd, READ_TIMEOUT_SEC);
+        if (rc < 0) {
+            conn_close(c);
+            if (reused) continue;
+            health_failed(idx);
+            return -1;
         }
-        return;
+        pool_put(idx, c);
+        if (rep) *rep = r;
+        return r.ok ? 0 : 1;
+    }
+    return -1;
+}
+
+/* Batches (MPUT, MGET; dfs_proto.h): one request carries the records of many
+   small chunks. Whether a server takes them is asked once per run, with an
+   empty MPUT: older servers answer ERR (a text session must not be sent a
+   payload it would read as commands). */
+
+/* one MPUT or MGET of len payload bytes; the reply body is left in *body
+   (malloc'd, *blen bytes). returns 0 OK, 1 ERR, -1 if the server could not be asked */
+static int server_batch(int idx, int op, const void *pay, size_t len, unsigned char **body, size_t *blen) {
+    *body = NULL;
+    *blen = 0;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int reused;
+        conn_t *c = pool_get(idx, &reused);
+        if (!c) return -1;
+        uint32_t id;
+        reply_t r;
+        if (send_request(c, op, NULL, NULL, len, &id) < 0 || (len && write_all(c->fd, pay, len) < 0) ||
+            read_reply(c, &r) < 0 || (c->proto >= 2 && r.reqid != id)) {
+            conn_close(c);
+            if (reused) continue;
+            health_failed(idx);
+            return -1;
+        }
+        if (!r.ok) {
+            if (r.len) conn_close(c);
+            else pool_put(idx, c);
+            return 1;
+        }
+        uint64_t n = c->proto >= 2 ? r.len : strtoull(r.info, NULL, 10);
+        // records the server had to leave out still take a few bytes each
+        unsigned char *b = n <= 2 * DFS_BATCH_MAX ? malloc(n ? n : 1) : NULL;
+        if (!b || conn_read_exact(c, b, n) < 0) {
+            free(b);
+            conn_close(c);
+            return -1;
+        }
+        pool_put(idx, c);
+        *body = b;
+        *blen = n;
+        return 0;
+    }
+    return -1;
+}
+
+// whether the server takes MPUT and MGET
+static int server_batches(int idx) {
+    pthread_mutex_lock(&pool_mu);
+    int v = servers[idx].batch;
+    pthread_mutex_unlock(&pool_mu);
+    if (v) return v > 0;
+    unsigned char *body;
+    size_t blen;
+    int rc = server_batch(idx, OP_MPUT, NULL, 0, &body, &blen);
+    free(body);
+    pthread_mutex_lock(&pool_mu);
+    servers[idx].batch = rc == 0 ? 1 : -1;
+    pthread_mutex_unlock(&pool_mu);
+    return rc == 0;
+}
+
+/* stores n chunks (bodies in memory) on a server in one MPUT, or as pipelined
+   PUTs if it does not take batches; stored[i] is set for each chunk the
+   server kept. returns how many */
+static int server_mput(int idx, int n, char **names, const char **mem, size_t *lens, char *stored) {
+    memset(stored, 0, n);
+    if (!server_batches(idx)) {
+        size_t *offs = calloc(n, sizeof(size_t));
+        int ok = offs ? server_put_batch(idx, n, names, -1, offs, lens, mem, NULL) : -1;
+        free(offs);
+        // without a reply per chunk, a batch that lost any is taken as lost
+        if (ok == n) memset(stored, 1, n);
+        return ok == n ? n : 0;
+    }
+    size_t len = 0;
+    for (int i=0;i<n;i++) len += DFS_MPUT_REC_LEN(strlen(names[i]), lens[i]);
+    unsigned char *pay = malloc(len ? len : 1), *p = pay, *body;
+    size_t blen;
+    if (!pay) return 0;
+    for (int i=0;i<n;i++) {
+        size_t nl = strlen(names[i]);
+        dfs_put16(p, nl);
+        memcpy(p + 2, names[i], nl);
+        dfs_put64(p + 2 + nl, lens[i]);
+        memcpy(p + DFS_MPUT_REC_LEN(nl, 0), mem[i], lens[i]);
+        p += DFS_MPUT_REC_LEN(nl, lens[i]);
+    }
+    int got = 0;
+    if (server_batch(idx, OP_MPUT, pay, len, &body, &blen) == 0 && blen == (size_t)n) {
+        for (int i=0;i<n;i++) {
+            stored[i] = body[i] == 1;
+            got += stored[i];
+        }
+    }
+    free(body);
+    free(pay);
+    return got;
+}
+
+// a body collected in memory, up to max bytes
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t max;
+} mem_sink;
+
+static int mem_begin(void *arg, size_t len) {
+    mem_sink *m = arg;
+    if (len > m->max) return -1;
+    char *p = realloc(m->buf, len ? len : 1);
+    if (!p) return -1;
+    m->buf = p;
+    m->len = 0;
+    return 0;
+}
+
+static int mem_data(void *arg, const unsigned char *buf, size_t n) {
+    mem_sink *m = arg;
+    if (m->len + n > m->max) return -1;
+    memcpy(m->buf + m->len, buf, n);
+    m->len += n;
+    return 0;
+}
+
+/* Hedged read: GET from a, and if it has not answered after a's hedge delay
+   (or fails first), also from b. The first to start a body wins and gets the
+   caller's sink; the other is cut off. The race lives on the heap because a
+   loser still stuck connecting is not waited for. */
+typedef struct {
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    int refs;
+    sink_t *inner;      // caller's sink, only touched by the winner
+    char chunk[512];
+    int idx[2];
+    int fd[2];          // session each arm is using, -1 if none
+    int finished[2];
+    int rc[2];
+    int winner;         // arm delivering the body, -1 until one begins
+} hedge_t;
+
+typedef struct {
+    hedge_t *h;
+    int i;
+} hedge_arm;
+
+static void hedge_unref(hedge_t *h) {
+    pthread_mutex_lock(&h->mu);
+    int last = --h->refs == 0;
+    pthread_mutex_unlock(&h->mu);
+    if (last) free(h);
+}
+
+static int arm_begin(void *arg, size_t len) {
+    hedge_arm *a = arg;
+    hedge_t *h = a->h;
+    pthread_mutex_lock(&h->mu);
+    if (h->winner < 0) {
+        h->winner = a->i;
+        if (h->fd[1 - a->i] >= 0) shutdown(h->fd[1 - a->i], SHUT_RDWR);
+        pthread_cond_broadcast(&h->cv);
+    }
+    int mine = h->winner == a->i;
+    pthread_mutex_unlock(&h->mu);
+    return mine ? h->inner->begin(h->inner->arg, len) : -1;
+}
+
+static int arm_data(void *arg, const unsigned char *buf, size_t n) {
+    hedge_arm *a = arg;
+    return a->h->inner->data(a->h->inner->arg, buf, n);
+}
+
+static int arm_attach(void *arg, int fd) {
+    hedge_arm *a = arg;
+    hedge_t *h = a->h;
+    pthread_mutex_lock(&h->mu);
+    int lost = h->winner >= 0 && h->winner != a->i;
+    if (!lost || fd < 0) h->fd[a->i] = fd;
+    pthread_mutex_unlock(&h->mu);
+    return lost;
+}
+
+static void *arm_main(void *arg) {
+    hedge_arm *a = arg;
+    hedge_t *h = a->h;
+    sink_t sink = { arm_begin, arm_data, a, arm_attach };
+    int rc = server_get_stream(h->idx[a->i], h->chunk, &sink);
+    pthread_mutex_lock(&h->mu);
+    h->rc[a->i] = rc;
+    h->finished[a->i] = 1;
+    pthread_cond_broadcast(&h->cv);
+    pthread_mutex_unlock(&h->mu);
+    hedge_unref(h);
+    return NULL;
+}
+
+static int arm_start(hedge_t *h, hedge_arm *arms, int i) {
+    pthread_t t;
+    h->refs++;
+    arms[i] = (hedge_arm){ h, i };
+    if (pthread_create(&t, NULL, arm_main, &arms[i]) != 0) {
+        h->refs--;
+        return -1;
+    }
+    pthread_detach(t);
+    return 0;
+}
+
+/* same result as server_get_stream. *won is the arm (0 a, 1 b) that started
+   a body, -1 if both were asked and neither had one */
+static int hedged_get(int a, int b, const char *chunk, sink_t *sink, int *won) {
+    *won = 0;
+    if (b < 0 || hedge_pct == 0) return server_get_stream(a, chunk, sink);
+    hedge_t *h = calloc(1, sizeof(*h) + 2 * sizeof(hedge_arm));
+    if (!h) return server_get_stream(a, chunk, sink);
+    hedge_arm *arms = (hedge_arm *)(h + 1);
+    pthread_mutex_init(&h->mu, NULL);
+    pthread_cond_init(&h->cv, NULL);
+    h->refs = 1;
+    h->inner = sink;
+    snprintf(h->chunk, sizeof(h->chunk), "%s", chunk);
+    h->idx[0] = a; h->idx[1] = b;
+    h->fd[0] = h->fd[1] = -1;
+    h->winner = -1;
+    double t0 = now_us();
+    pthread_mutex_lock(&h->mu);
+    if (arm_start(h, arms, 0) < 0) {
+        pthread_mutex_unlock(&h->mu);
+        hedge_unref(h);
+        return server_get_stream(a, chunk, sink);
+    }
+    // give a its hedge delay, unless it answers or fails sooner
+    struct timespec dl;
+    clock_gettime(CLOCK_REALTIME, &dl);
+    double wait = hedge_delay_us(a);
+    dl.tv_sec += (time_t)(wait / 1e6);
+    dl.tv_nsec += (long)((wait - (long long)(wait / 1e6) * 1e6) * 1e3);
+    if (dl.tv_nsec >= 1000000000L) { dl.tv_sec++; dl.tv_nsec -= 1000000000L; }
+    while (h->winner < 0 && !h->finished[0]) {
+        if (pthread_cond_timedwait(&h->cv, &h->mu, &dl) != 0) break;
     }
-    // reconstruct: concat p1..p4 into fname
-    FILE *out = fopen(fname, "wb");
-    if (!out) {
-        printf("%s is incomplete\n", fname);
-        for (int k=1;k<=4;k++) {
-            char tmpn[512]; snprintf(tmpn,sizeof(tmpn), "%s.p%d.tmp", fname, k);
-            remove(tmpn);
+    int started_b = 0;
+    if (h->winner < 0) started_b = arm_start(h, arms, 1) == 0;
+    // wait for the winner to finish, or for every arm if nobody wins
+    for (;;) {
+        if (h->winner >= 0 && h->finished[h->winner]) break;
+        if (h->winner < 0 && h->finished[0] && (!started_b || h->finished[1])) break;
+        pthread_cond_wait(&h->cv, &h->mu);
+    }
+    int rc;
+    *won = h->winner >= 0 ? h->winner : started_b ? -1 : 0;
+    if (h->winner >= 0) rc = h->rc[h->winner];
+    else rc = h->rc[0] < 0 || (started_b && h->rc[1] < 0) ? -1 : 1;
+    int slow_a = h->winner == 1 && !h->finished[0];
+    pthread_mutex_unlock(&h->mu);
+    // a was outrun: count the time it had taken so far against it
+    if (slow_a) health_sample(a, now_us() - t0);
+    hedge_unref(h);
+    return rc;
+}
+
+/* Striped files: stripe i (0-based) of n is the chunk "<file>.n<n>u<unit>s<i>"
+   holding the file bytes from i * unit, so any one stripe name tells get and
+   list the whole layout. */
+static void stripe_name(char *buf, size_t len, const char *fname, int n, size_t unit, int i) {
+    snprintf(buf, len, "%s.n%du%zus%d", fname, n, unit, i);
+}
+
+// s: what follows "<file>." in a chunk name; 0 if it names a stripe
+static int parse_stripe(const char *s, int *n, size_t *unit, int *i) {
+    int used = 0;
+    if (sscanf(s, "n%du%zus%d%n", n, unit, i, &used) != 3 || s[used]) return -1;
+    return *n >= 1 && *unit > 0 && *i >= 0 && *i < *n ? 0 : -1;
+}
+
+// what the listings show of one file
+typedef struct {
+    unsigned mask;      // replicated pieces seen (bit k-1 for piece k)
+    unsigned shards;    // erasure-coded shards seen (bit i-1 for shard i)
+    int ec_k;           // data shards needed, from the shard names
+    int nstripes, nseen;    // striped: stripe count, and distinct stripes seen
+    unsigned char *seen;    // bit per stripe (malloc'd)
+} list_entry;
+
+// file name -> pieces seen on any server
+static void list_add(void *arg, char *ln) {
+    fmap_t *files = arg;
+    // expecting chunk names like "<filename>.p1", or "<filename>.k4m2s1" for shards
+    char *dot = strrchr(ln, '.');
+    if (!dot) return;
+    int k, m, i, n = 0;
+    size_t unit;
+    if (dot[1] == 'n' && parse_stripe(dot+1, &k, &unit, &i) == 0) {
+        list_entry *e = fmap_get(files, ln, dot - ln);
+        if (!e) return;
+        if (!e->seen && (e->seen = calloc((k + 7) / 8, 1))) e->nstripes = k;
+        // both copies of a stripe show up; count it once
+        if (e->seen && k == e->nstripes && !(e->seen[i / 8] & (1 << (i % 8)))) {
+            e->seen[i / 8] |= 1 << (i % 8);
+            e->nseen++;
         }
         return;
     }
+    if (dot[1] == 'k' && sscanf(dot+1, "k%dm%ds%d%n", &k, &m, &i, &n) == 3 && !dot[1+n]) {
+        if (k < 1 || i < 1 || i > k + m || k + m > RS_MAX_SHARDS) return;
+        list_entry *e = fmap_get(files, ln, dot - ln);
+        if (e) { e->shards |= 1u << (i-1); e->ec_k = k; }
+        return;
+    }
+    if (dot[1] != 'p') return;
+    int pidx = atoi(dot+2); // p1..p4
+    if (pidx < 1 || pidx > 32) return;
+    list_entry *e = fmap_get(files, ln, dot - ln);
+    if (e) e->mask |= 1u << (pidx-1);
+}
+
+// "dfc list [file]": every file, or only the named one
+static void cmd_list(int argc, char **argv) {
+    if (nservers <= 0) { fprintf(stderr, "No servers\n"); return; }
+    const char *only = argc > 1 ? argv[1] : NULL;
+    char prefix[512];
+    if (only) snprintf(prefix, sizeof(prefix), "%s.", only);
+    // fetch lists from each server, folding every line into the map as it arrives
+    fmap_t *files = fmap_new(sizeof(list_entry));
+    if (!files) return;
+    for (int i=0;i<nservers;i++) server_list_fetch(i, only ? prefix : NULL, 0, list_add, files);
+    // print list lines
+    void *it = NULL;
+    const char *name;
+    list_entry *e;
+    while ((e = fmap_next(files, &it, &name))) {
+        free(e->seen);
+        if (only && strcmp(name, only) != 0) continue;
+        // check if all pieces 1..4 are present, any k shards, or every stripe
+        if ((e->mask & 0xf) == 0xf || (e->ec_k && __builtin_popcount(e->shards) >= e->ec_k) ||
+            (e->nstripes && e->nseen == e->nstripes)) {
+            printf("%s\n", name);
+        } else {
+            printf("%s [incomplete]\n", name);
+        }
+    }
+    fmap_free(files);
+}
+
+// chunk name of piece k: "<file>.p<k>", or "<file>.k<K>m<M>s<k>" for a shard of a k+m code
+static void piece_name(char *buf, size_t n, const char *fname, int k_data, int m_parity, int k) {
+    if (k_data) snprintf(buf, n, "%s.k%dm%ds%d", fname, k_data, m_parity, k);
+    else snprintf(buf, n, "%s.p%d", fname, k);
+}
+
+/* Placement used by cmd_put: with rotation x = md5(filename) % nservers,
+   server j (0-based) stores pieces pA and pB, folded into 1..4. */
+static void put_pieces(unsigned long x, int j, int *pieceA, int *pieceB) {
+    int jnum = j+1;
+    int pA = ((jnum - (int)x - 1) % nservers + nservers) % nservers + 1;
+    int pB = (pA % nservers) + 1;
+    // we only support 4 pieces per file; if nservers != 4 allow packaging modulo 4 mapping
+    // map p indices into 1..4 pieces
+    *pieceA = ((pA-1) % 4) + 1;
+    *pieceB = ((pB-1) % 4) + 1;
+}
+
+/* With "ring on" piece k is kept by the RING_COPIES servers that own
+   "<file>.p<k>" on the ring (dfc_ring.h). Pieces of one file land
+   independently, and a change to the server list moves only the pieces whose
+   owners changed. */
+static int ring_holders(const char *fname, int k, int *out) {
+    char chunk[512];
+    piece_name(chunk, sizeof(chunk), fname, 0, 0, k);
+    return ring_lookup(ring, chunk, out, RING_COPIES);
+}
+
+// the pieces put sends server j, in upload order; returns how many
+static int server_pieces(const char *fname, unsigned long x, int j, int *ks) {
+    if (!ring) {
+        put_pieces(x, j, &ks[0], &ks[1]);
+        return 2;
+    }
+    int n = 0;
     for (int k=1;k<=4;k++) {
-        char tmpn[512]; snprintf(tmpn,sizeof(tmpn), "%s.p%d.tmp", fname, k);
-        FILE *tf = fopen(tmpn, "rb");
-        if (!tf) { fclose(out); printf("%s is incomplete\n", fname); return; }
-        char buf[8192];
-        size_t r;
-        while ((r = fread(buf,1,sizeof(buf),tf)) > 0) fwrite(buf,1,r,out);
-        fclose(tf);
-        remove(tmpn);
+        int h[RING_COPIES], nh = ring_holders(fname, k, h);
+        for (int i=0;i<nh;i++) if (h[i] == j) ks[n++] = k;
     }
-    fclose(out);
+    return n;
 }
 
-int main(int argc, char **argv) {
-    // read dfc.conf in cwd
-    parse_conf("dfc.conf");
+/* servers to ask for piece k: those placement put it on (*nplaced of them,
+   the ring's first owner first), then the rest (the file may have been stored
+   under a different server list or placement) */
+static int piece_candidates(const char *fname, unsigned long x, int k, int *order, int *nplaced) {
+    int n = 0;
+    char placed[MAX_SERVERS] = {0};
+    if (ring) {
+        n = ring_holders(fname, k, order);
+        for (int i=0;i<n;i++) placed[order[i]] = 1;
+    } else {
+        for (int j=0;j<nservers;j++) {
+            int a, b;
+            put_pieces(x, j, &a, &b);
+            if (a == k || b == k) { order[n++] = j; placed[j] = 1; }
+        }
+    }
+    *nplaced = n;
+    for (int j=0;j<nservers;j++) if (!placed[j]) order[n++] = j;
+    return n;
+}
+
+// maps bytes [off, off + len) of fd; they start *skew bytes into the (page-aligned) map
+static unsigned char *map_range(int fd, size_t off, size_t len, size_t *skew) {
+    *skew = off % sysconf(_SC_PAGESIZE);
+    unsigned char *map = mmap(NULL, len + *skew, PROT_READ, MAP_PRIVATE, fd, off - *skew);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+/* Delta put ("delta on", dfs_delta.h): before sending a piece, fetch the
+   block signatures of the copy the server already has and send only a PATCH
+   of copies and literals against it. Blocks grow with the piece so that the
+   signatures stay about sqrt(12 * len) bytes. Anything that goes wrong
+   (no old copy, an old server, a patch not much smaller than the piece)
+   falls back to a plain PUT. */
+
+static size_t delta_block(size_t len) {
+    size_t b = 2048;
+    while (b < (1 << 20) && (double)b * b < 12.0 * len) b <<= 1;
+    return b;
+}
+
+typedef struct {
+    unsigned char *buf;
+    size_t len, cap, max;
+    size_t lit;         // start of the pending literal run in the new data
+    size_t copy_at;     // offset in buf of the last copy instruction, or -1
+} delta_out;
+
+static int delta_put(delta_out *o, const void *p, size_t n) {
+    if (o->len + n > o->max) return -1;
+    if (o->len + n > o->cap) {
+        size_t cap = o->cap ? o->cap : 4096;
+        while (cap < o->len + n) cap *= 2;
+        unsigned char *b = realloc(o->buf, cap);
+        if (!b) return -1;
+        o->buf = b; o->cap = cap;
+    }
+    memcpy(o->buf + o->len, p, n);
+    o->len += n;
+    return 0;
+}
+
+// flushes the literal run data[lit, end)
+static int delta_literal(delta_out *o, const unsigned char *data, size_t end) {
+    if (end == o->lit) return 0;
+    unsigned char h[9] = { DELTA_DATA };
+    dfs_put64(h + 1, end - o->lit);
+    if (delta_put(o, h, sizeof(h)) < 0 || delta_put(o, data + o->lit, end - o->lit) < 0) return -1;
+    o->lit = end;
+    o->copy_at = (size_t)-1;
+    return 0;
+}
+
+// a copy of old bytes [from, from + n), merged into the previous copy when it continues it
+static int delta_copy(delta_out *o, uint64_t from, uint64_t n) {
+    if (o->copy_at != (size_t)-1) {
+        unsigned char *c = o->buf + o->copy_at;
+        if (dfs_get64(c + 1) + dfs_get64(c + 9) == from) {
+            dfs_put64(c + 9, dfs_get64(c + 9) + n);
+            return 0;
+        }
+    }
+    unsigned char h[17] = { DELTA_COPY };
+    dfs_put64(h + 1, from);
+    dfs_put64(h + 9, n);
+    o->copy_at = o->len;
+    return delta_put(o, h, sizeof(h));
+}
+
+/* the instructions that rebuild data[0, len) from the old copy whose nsigs
+   signatures of bs-byte blocks are in sigs; NULL if they would not be under
+   half of len */
+static unsigned char *delta_encode(const unsigned char *data, size_t len, const unsigned char *sigs, size_t nsigs,
+                                   size_t bs, size_t *plen) {
+    size_t hsize = 1;
+    while (hsize < 2 * nsigs) hsize <<= 1;
+    int *head = malloc(hsize * sizeof(int)), *next = malloc(nsigs * sizeof(int));
+    EVP_MD_CTX *md = EVP_MD_CTX_new();
+    delta_out o = { NULL, 0, 0, len / 2, 0, (size_t)-1 };
+    int err = !head || !next || !md;
+    if (!err) {
+        memset(head, -1, hsize * sizeof(int));
+        // chained in reverse so a lookup meets the lowest block first
+        for (size_t i = nsigs; i-- > 0;) {
+            size_t h = dfs_get32(sigs + i * DELTA_SIG_LEN) & (hsize - 1);
+            next[i] = head[h];
+            head[h] = (int)i;
+        }
+    }
+    size_t pos = 0;
+    uint32_t weak = len >= bs ? delta_weak(data, bs) : 0;
+    while (!err && pos + bs <= len) {
+        unsigned char d[EVP_MAX_MD_SIZE];
+        int strong = 0, match = -1;
+        uint64_t want = o.copy_at != (size_t)-1 ? dfs_get64(o.buf + o.copy_at + 1) + dfs_get64(o.buf + o.copy_at + 9) : 0;
+        for (int i = head[weak & (hsize - 1)]; i >= 0; i = next[i]) {
+            const unsigned char *sig = sigs + (size_t)i * DELTA_SIG_LEN;
+            if (dfs_get32(sig) != weak) continue;
+            if (!strong) {
+                if (!EVP_DigestInit_ex(md, EVP_md5(), NULL) || !EVP_DigestUpdate(md, data + pos, bs) ||
+                    !EVP_DigestFinal_ex(md, d, NULL)) { err = 1; break; }
+                strong = 1;
+            }
+            if (memcmp(sig + 4, d, DELTA_STRONG_LEN) != 0) continue;
+            match = i;
+            if ((uint64_t)i * bs == want) break;    // continues the last copy
+        }
+        if (err) break;
+        if (match >= 0) {
+            if (delta_literal(&o, data, pos) < 0 || delta_copy(&o, (uint64_t)match * bs, bs) < 0) { err = 1; break; }
+            pos += bs;
+            o.lit = pos;
+            if (pos + bs <= len) weak = delta_weak(data + pos, bs);
+            continue;
+        }
+        if (pos + bs < len) weak = delta_roll(weak, data[pos], data[pos + bs], bs);
+        pos++;
+        // a literal run that alone breaks the budget ends the search early
+        if (pos - o.lit > o.max) err = 1;
+    }
+    if (!err && delta_literal(&o, data, len) < 0) err = 1;
+    free(head);
+    free(next);
+    EVP_MD_CTX_free(md);
+    if (err) { free(o.buf); return NULL; }
+    *plen = o.len;
+    return o.buf;
+}
+
+// sends a PATCH; 0 if the server rebuilt the chunk
+static int server_patch(int idx, const char *name, const char *args, const unsigned char *body, size_t len) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int reused;
+        conn_t *c = pool_get(idx, &reused);
+        if (!c) return -1;
+        uint32_t id;
+        reply_t r;
+        if (send_request(c, OP_PATCH, name, args, len, &id) < 0 || write_all(c->fd, body, len) < 0 ||
+            read_reply(c, &r) < 0 || r.len) {
+            conn_close(c);
+            if (reused) continue;
+            return -1;
+        }
+        pool_put(idx, c);
+        return r.ok ? 0 : -1;
+    }
+    return -1;
+}
+
+// stores bytes [off, off + len) of fd as chunk name on server idx by patching its old copy; 0 on success
+static int try_delta(int idx, const char *name, int fd, size_t off, size_t len) {
+    if (len < DELTA_MIN_PIECE) return -1;
+    size_t bs = delta_block(len);
+    char args[128];
+    snprintf(args, sizeof(args), "%zu", bs);
+    mem_sink ms = { NULL, 0, DELTA_MAX };
+    sink_t sink = { mem_begin, mem_data, &ms, NULL };
+    if (server_fetch(idx, OP_SIGS, name, args, &sink, NULL) != 0 || !ms.len || ms.len % DELTA_SIG_LEN) {
+        free(ms.buf);
+        return -1;
+    }
+    size_t skew;
+    unsigned char *map = map_range(fd, off, len, &skew);
+    int rc = -1;
+    if (map) {
+        const unsigned char *data = map + skew;
+        unsigned char d[EVP_MAX_MD_SIZE];
+        size_t plen;
+        unsigned char *patch = EVP_Digest(data, len, d, NULL, EVP_md5(), NULL) ?
+            delta_encode(data, len, (unsigned char *)ms.buf, ms.len / DELTA_SIG_LEN, bs, &plen) : NULL;
+        if (patch) {
+            int n = snprintf(args, sizeof(args), "%zu ", len);
+            for (int i = 0; i < 16; i++) n += snprintf(args + n, sizeof(args) - n, "%02x", d[i]);
+            rc = server_patch(idx, name, args, patch, plen);
+            free(patch);
+        }
+        munmap(map, len + skew);
+    }
+    free(ms.buf);
+    return rc;
+}
+
+typedef struct {
+    const char *basefname;
+    unsigned long x;
+    int fd;         // source file, read by every job at its own offsets
+    size_t off[4];
+    size_t plen[4];
+    manifest_t *man;        // with "manifest on": sent to every server after its pieces
+    const char *mtext;
+    size_t mlen;
+    int md5_failed;
+    unsigned char *ztext[4];    // with "compress": piece k compressed, or NULL to send it raw
+    size_t zlen[4];
+    char zargs[4][64];          // its "CODEC <codec> <raw size>"
+    const unsigned char *data;  // batched put: the whole file, read in (fd is -1)
+    char sha[4][65];            // with "dedup on": piece k's SHA-256 in hex, for every server's HAVE
+} put_ctx;
+
+/* Compressed put ("compress <codec>", dfs_codec.h): each piece is compressed
+   once, before any server is contacted, and goes to both its servers as is.
+   A piece whose byte entropy says it is compressed already (JPEG, PNG,
+   archives) is not tried, and one that does not shrink by a tenth is sent
+   raw. */
+
+// bits per byte over ENTROPY_RUNS runs spread across the n bytes
+static double sample_entropy(const unsigned char *p, size_t n) {
+    size_t count[256] = {0}, total = 0, step = n / ENTROPY_RUNS;
+    for (int i=0;i<ENTROPY_RUNS;i++) {
+        size_t at = i * step, m = n - at < ENTROPY_RUN ? n - at : ENTROPY_RUN;
+        for (size_t b=0;b<m;b++) count[p[at + b]]++;
+        total += m;
+    }
+    double h = 0;
+    for (int i=0;i<256;i++) {
+        if (!count[i]) continue;
+        double q = (double)count[i] / total;
+        h -= q * log2(q);
+    }
+    return h;
+}
+
+static void compress_job(int k, void *arg) {
+    put_ctx *p = arg;
+    size_t len = p->plen[k], skew;
+    if (len < COMPRESS_MIN_PIECE) return;
+    unsigned char *map = map_range(p->fd, p->off[k], len, &skew);
+    if (!map) return;
+    const unsigned char *data = map + skew;
+    if (sample_entropy(data, len) <= ENTROPY_MAX) {
+        p->ztext[k] = dfs_codecs[put_codec].compress(data, len, put_level, len - len / 10, &p->zlen[k]);
+        snprintf(p->zargs[k], sizeof(p->zargs[k]), "CODEC %s %zu", dfs_codecs[put_codec].name, len);
+    }
+    munmap(map, len + skew);
+}
+
+// one job per server: all of its chunks, pipelined on one session
+static void put_job(int j, void *arg) {
+    put_ctx *p = arg;
+    int ks[4], nk = server_pieces(p->basefname, p->x, j, ks);
+    // chunk names "<basename>.p<k>", then the manifest "<basename>.m"
+    char chunks[5][512];
+    char *names[5];
+    size_t offs[5], lens[5];
+    const char *mem[5], *args[5];
+    char *sha[5];
+    int piece[5];   // piece arrays are 0-based
+    for (int i=0;i<nk;i++) {
+        snprintf(chunks[i], sizeof(chunks[i]), "%s.p%d", p->basefname, ks[i]);
+        piece[i] = ks[i] - 1;
+        offs[i] = p->off[piece[i]];
+        lens[i] = p->plen[piece[i]];
+        mem[i] = NULL;
+    }
+    snprintf(chunks[nk], sizeof(chunks[nk]), "%s.m", p->basefname);
+    offs[nk] = 0; lens[nk] = p->mlen; mem[nk] = p->mtext; piece[nk] = -1;
+    for (int i=0;i<=nk;i++) { names[i] = chunks[i]; args[i] = NULL; }
+    int n = 0;
+    for (int i=0;i<=nk;i++) {
+        if (i == nk ? !p->mtext : use_delta && try_delta(j, names[i], p->fd, offs[i], lens[i]) == 0) continue;
+        names[n] = names[i]; offs[n] = offs[i]; lens[n] = lens[i]; mem[n] = mem[i];
+        sha[n] = i < nk ? p->sha[piece[i]] : NULL;
+        if (i < nk && p->ztext[piece[i]]) {
+            mem[n] = (const char *)p->ztext[piece[i]];
+            lens[n] = p->zlen[piece[i]];
+            args[n] = p->zargs[piece[i]];
+            sha[n] = NULL;      // memory bodies are not asked about
+        }
+        n++;
+    }
+    if (!n) return;
+    if (use_dedup) server_put_dedup(j, n, names, sha, p->fd, offs, lens, mem, args);
+    else server_put_batch(j, n, names, p->fd, offs, lens, mem, args);
+}
+
+/* Chained put ("chain on"): piece k is uploaded once, to a server that has
+   it as its A piece (its first owner on the ring), with "FORWARD
+   host:port,..." naming the other servers placement gives it to. That server
+   streams it down the chain and answers OK once every copy is stored, so the
+   client sends each byte once instead of twice. Servers reach each other at
+   the addresses in dfc.conf. A chain that fails is redone by sending the
+   piece to each of its servers directly. */
+static void chain_job(int job, void *arg) {
+    put_ctx *p = arg;
+    int k = job + 1, order[MAX_SERVERS], nh, head = 0;
+    piece_candidates(p->basefname, p->x, k, order, &nh);
+    if (!nh) return;
+    // heading the chains of their A pieces spreads the uploads over every server
+    for (int i=0;i<nh && !ring;i++) {
+        int a, b;
+        put_pieces(p->x, order[i], &a, &b);
+        if (a == k) { head = i; break; }
+    }
+    // a compressed piece names its codec ahead of the chain
+    const char *zargs = p->ztext[k-1] ? p->zargs[k-1] : NULL;
+    char fwd[1024];
+    size_t n = snprintf(fwd, sizeof(fwd), "%s%sFORWARD", zargs ? zargs : "", zargs ? " " : ""), n0 = n;
+    for (int i=0;i<nh && n < sizeof(fwd);i++) {
+        if (i == head) continue;
+        n += snprintf(fwd + n, sizeof(fwd) - n, "%c%s:%d", n > n0 ? ',' : ' ', servers[order[i]].host, servers[order[i]].port);
+    }
+    char chunk[512];
+    piece_name(chunk, sizeof(chunk), p->basefname, 0, 0, k);
+    char *names[1] = { chunk };
+    size_t off = p->off[k-1], len = p->plen[k-1];
+    const char *mem[1] = { (const char *)p->ztext[k-1] };
+    // nothing to send if every server already holds this body
+    int missing = !use_dedup || mem[0];
+    char *sha[1] = { p->sha[k-1] };
+    for (int i=0;i<nh && !missing;i++) {
+        int have;
+        if (server_have_batch(order[i], 1, names, sha, &have) < 1) missing = 1;
+    }
+    if (!missing) return;
+    int chained = nh > 1 && n < sizeof(fwd);
+    const char *args[1] = { chained ? fwd : zargs };
+    if (mem[0]) len = p->zlen[k-1];
+    if (server_put_batch(order[head], 1, names, p->fd, &off, &len, mem, args) == 1 &&
+        (chained || nh == 1)) return;
+    // a broken chain does not say which copies made it: send every one directly
+    args[0] = zargs;
+    for (int i=0;i<nh;i++) server_put_batch(order[i], 1, names, p->fd, &off, &len, mem, args);
+}
+
+// "dedup on": what each server is asked about, one job per piece
+static void sha_job(int k, void *arg) {
+    put_ctx *p = arg;
+    if (!p->ztext[k]) sha256_hex(p->fd, p->off[k], p->plen[k], p->sha[k]);
+}
+
+// checksums for the manifest, one job per piece
+static void md5_job(int k, void *arg) {
+    put_ctx *p = arg;
+    mpiece_t *mp = &p->man->piece[k];
+    if (p->data) {
+        if (!EVP_Digest(p->data + mp->off, mp->len, mp->md5, NULL, EVP_md5(), NULL)) p->md5_failed = 1;
+    } else if (digest_range(EVP_md5(), p->fd, mp->off, mp->len, mp->md5) < 0) {
+        p->md5_failed = 1;
+    }
+}
+
+/* fills in sizes, checksums and the servers placement sends each piece to;
+   returns the text form (malloc'd) or NULL */
+static char *build_manifest(put_ctx *p, size_t total, size_t *mlen) {
+    manifest_t *m = p->man;
+    memset(m, 0, sizeof(*m));
+    m->size = total;
+    m->npieces = 4;
+    for (int k = 0; k < 4; k++) {
+        m->piece[k].off = p->off[k];
+        m->piece[k].len = p->plen[k];
+    }
+    for (int j = 0; j < nservers; j++) {
+        int ks[4], nk = server_pieces(p->basefname, p->x, j, ks);
+        for (int i = 0; i < nk; i++) {
+            mpiece_t *mp = &m->piece[ks[i]-1];
+            if (mp->nholders < MANIFEST_MAX_HOLDERS) {
+                snprintf(mp->holders[mp->nholders++], sizeof(mp->holders[0]), "%s", servers[j].name);
+            }
+        }
+    }
+    // a file in memory is small; threads would cost more than they save
+    if (p->data) for (int k = 0; k < 4; k++) md5_job(k, p);
+    else run_parallel(4, md5_job, p);
+    if (p->md5_failed) return NULL;
+    char *text = malloc(MANIFEST_MAX_BYTES);
+    if (text && !(*mlen = manifest_format(m, text, MANIFEST_MAX_BYTES))) { free(text); text = NULL; }
+    return text;
+}
+
+/* Erasure-coded put ("ec <k> <m>"): the file is cut into k data shards of
+   L = ceil(size / k) bytes (the last ones short), and m parity shards of L
+   bytes are computed over the zero-padded data. Shard i (0-based) goes to
+   server (x + i) % nservers, so k + m must not exceed the servers (dfc.conf
+   falls back to replication otherwise) and losing any m of them loses at
+   most m shards. Parity is encoded a window at a time into an unlinked temp
+   file, then every shard is sent concurrently; the manifest, which get needs
+   to find the shards, is stored on every server last. */
+typedef struct {
+    const char *basefname;
+    unsigned long x;
+    int fd, tmp;    // source file; parity shard j is at j * L in tmp
+    manifest_t *man;
+    int failed;
+} ec_put_ctx;
+
+static int ec_encode(ec_put_ctx *p) {
+    manifest_t *man = p->man;
+    int k = man->ec_k, m = man->ec_m;
+    // one window in all, however many shards share it
+    size_t w = window_size() / (k + m), L = man->shard_len;
+    unsigned char *buf = malloc((k + m) * w);
+    unsigned char *sh[RS_MAX_SHARDS];
+    EVP_MD_CTX *md[RS_MAX_SHARDS] = {0};
+    rs_code *rs = rs_new(k, m);
+    int rc = buf && rs ? 0 : -1;
+    for (int i = 0; i < k + m && rc == 0; i++) sh[i] = buf + i * w;
+    for (int j = 0; j < m && rc == 0; j++) {
+        if (!(md[j] = EVP_MD_CTX_new()) || !EVP_DigestInit_ex(md[j], EVP_md5(), NULL)) rc = -1;
+    }
+    for (size_t t = 0; t < L && rc == 0; t += w) {
+        size_t n = L - t < w ? L - t : w;
+        for (int i = 0; i < k && rc == 0; i++) {
+            const mpiece_t *mp = &man->piece[i];
+            size_t have = mp->len > t ? (mp->len - t < n ? mp->len - t : n) : 0;
+            if (have && pread_full(p->fd, sh[i], have, mp->off + t) < 0) rc = -1;
+            memset(sh[i] + have, 0, n - have);
+        }
+        if (rc) break;
+        rs_encode(rs, (const unsigned char *const *)sh, sh + k, n);
+        for (int j = 0; j < m && rc == 0; j++) {
+            EVP_DigestUpdate(md[j], sh[k + j], n);
+            if (pwrite_full(p->tmp, sh[k + j], n, (off_t)(j * L + t)) < 0) rc = -1;
+        }
+    }
+    for (int j = 0; j < m; j++) {
+        if (rc == 0 && !EVP_DigestFinal_ex(md[j], man->piece[k + j].md5, NULL)) rc = -1;
+        EVP_MD_CTX_free(md[j]);
+    }
+    rs_free(rs);
+    free(buf);
+    return rc;
+}
+
+// one job per shard: data shards are checksummed and sent from the file, parity from the temp file
+static void ec_put_job(int i, void *arg) {
+    ec_put_ctx *p = arg;
+    manifest_t *man = p->man;
+    mpiece_t *mp = &man->piece[i];
+    int data = i < man->ec_k;
+    char chunk[512];
+    piece_name(chunk, sizeof(chunk), p->basefname, man->ec_k, man->ec_m, i + 1);
+    char *names[1] = { chunk };
+    size_t off = data ? mp->off : (size_t)(i - man->ec_k) * man->shard_len, len = mp->len;
+    if (data && digest_range(EVP_md5(), p->fd, off, len, mp->md5) < 0) { p->failed = 1; return; }
+    if (server_put_batch((int)((p->x + i) % nservers), 1, names, data ? p->fd : p->tmp, &off, &len, NULL, NULL) != 1) p->failed = 1;
+}
+
+typedef struct {
+    const char *basefname;
+    const char *text;
+    size_t len;
+} mput_ctx;
+
+static void manifest_put_job(int j, void *arg) {
+    mput_ctx *mp = arg;
+    char chunk[512];
+    snprintf(chunk, sizeof(chunk), "%s.m", mp->basefname);
+    char *names[1] = { chunk };
+    size_t off = 0, len = mp->len;
+    const char *mem[1] = { mp->text };
+    server_put_batch(j, 1, names, -1, &off, &len, mem, NULL);
+}
+
+static int ec_put(const char *basefname, int fd, size_t total) {
+    manifest_t *man = calloc(1, sizeof(*man));
+    FILE *tf = tmpfile();
+    if (!man || !tf) { free(man); if (tf) fclose(tf); return -1; }
+    ec_put_ctx p = { basefname, md5_mod(basefname, nservers), fd, fileno(tf), man, 0 };
+    man->size = total;
+    man->ec_k = ec_k;
+    man->ec_m = ec_m;
+    man->shard_len = (total + ec_k - 1) / ec_k;
+    man->npieces = ec_k + ec_m;
+    for (int i = 0; i < man->npieces; i++) {
+        mpiece_t *mp = &man->piece[i];
+        if (i < ec_k) {
+            mp->off = i * man->shard_len;
+            mp->len = mp->off < total ? (total - mp->off < man->shard_len ? total - mp->off : man->shard_len) : 0;
+        } else {
+            mp->len = man->shard_len;
+        }
+        mp->nholders = 1;
+        snprintf(mp->holders[0], sizeof(mp->holders[0]), "%s", servers[(p.x + i) % nservers].name);
+    }
+    int rc = ec_encode(&p);
+    if (rc == 0) run_parallel(man->npieces, ec_put_job, &p);
+    if (rc == 0 && p.failed) rc = -1;
+    char *text = rc == 0 ? malloc(MANIFEST_MAX_BYTES) : NULL;
+    mput_ctx mc = { basefname, text, text ? manifest_format(man, text, MANIFEST_MAX_BYTES) : 0 };
+    if (mc.len) run_parallel(nservers, manifest_put_job, &mc);
+    else rc = -1;
+    free(text);
+    fclose(tf);
+    free(man);
+    return rc;
+}
+
+/* Striped put ("stripe <unit>"): n = ceil(size / unit) stripes (one, empty,
+   for an empty file), stripe i stored on servers (x + i) % nservers and the
+   one after it. Every server takes an even share however many there are, and
+   each stripe survives one server being down. One job per server pipelines
+   its stripes on one session, STRIPE_BATCH at a time. */
+#define STRIPE_BATCH 64
+
+typedef struct {
+    const char *basefname;
+    unsigned long x;
+    int fd;
+    size_t size, unit;
+    int n;
+    char (*sha)[65];    // with "dedup on": stripe i's SHA-256 in hex, for both its servers' HAVE
+} stripe_ctx;
+
+// server j holds stripe i
+static int stripe_on(unsigned long x, int i, int j) {
+    int a = (int)((x + i) % nservers);
+    return j == a || j == (a + 1) % nservers;
+}
+
+static void stripe_sha_job(int i, void *arg) {
+    stripe_ctx *s = arg;
+    size_t off = (size_t)i * s->unit;
+    sha256_hex(s->fd, off, s->size - off < s->unit ? s->size - off : s->unit, s->sha[i]);
+}
+
+static void stripe_put_job(int j, void *arg) {
+    stripe_ctx *s = arg;
+    char (*chunks)[512] = malloc(STRIPE_BATCH * sizeof(*chunks));
+    char *names[STRIPE_BATCH], *sha[STRIPE_BATCH];
+    size_t offs[STRIPE_BATCH], lens[STRIPE_BATCH];
+    int b = 0;
+    if (!chunks) return;
+    for (int i = 0; i <= s->n; i++) {
+        if (i < s->n && stripe_on(s->x, i, j)) {
+            stripe_name(chunks[b], sizeof(chunks[b]), s->basefname, s->n, s->unit, i);
+            names[b] = chunks[b];
+            offs[b] = (size_t)i * s->unit;
+            lens[b] = s->size - offs[b] < s->unit ? s->size - offs[b] : s->unit;
+            sha[b] = s->sha ? s->sha[i] : NULL;
+            b++;
+        }
+        if (b == STRIPE_BATCH || (i == s->n && b)) {
+            if (use_dedup) server_put_dedup(j, b, names, sha, s->fd, offs, lens, NULL, NULL);
+            else server_put_batch(j, b, names, s->fd, offs, lens, NULL, NULL);
+            b = 0;
+        }
+    }
+    free(chunks);
+}
+
+// stores the file at path as name, the way dfc.conf says; -1 if it cannot be read
+static int put_file(const char *path, const char *basefname) {
+    // pieces are streamed from the file, never held in memory
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    if (ec_k) {
+        int rc = ec_put(basefname, fd, st.st_size);
+        close(fd);
+        return rc;
+    }
+    if (stripe_unit) {
+        stripe_ctx s = { basefname, md5_mod(basefname, nservers), fd, st.st_size, stripe_unit,
+                         st.st_size ? (int)((st.st_size + stripe_unit - 1) / stripe_unit) : 1, NULL };
+        if (use_dedup && (s.sha = calloc(s.n, sizeof(*s.sha)))) run_parallel(s.n, stripe_sha_job, &s);
+        run_parallel(nservers, stripe_put_job, &s);
+        free(s.sha);
+        close(fd);
+        return 0;
+    }
+    // compute rotation x = md5(filename) % y
+    put_ctx p = { basefname, md5_mod(basefname, nservers), fd, {0}, {0}, NULL, NULL, 0, 0, {NULL}, {0}, {""}, NULL, {""} };
+    split_layout(st.st_size, p.off, p.plen);
+    if (put_codec >= 0) run_parallel(4, compress_job, &p);
+    if (use_dedup) run_parallel(4, sha_job, &p);
+    manifest_t man;
+    char *mtext = NULL;
+    if (use_manifest) {
+        p.man = &man;
+        p.mtext = mtext = build_manifest(&p, st.st_size, &p.mlen);
+    }
+    if (use_chain) {
+        // one chain per piece; the manifest, if any, follows on its own
+        run_parallel(4, chain_job, &p);
+        mput_ctx mc = { basefname, mtext, p.mlen };
+        if (mtext) run_parallel(nservers, manifest_put_job, &mc);
+    } else {
+        // every server's upload runs concurrently
+        run_parallel(nservers, put_job, &p);
+    }
+    free(mtext);
+    for (int k=0;k<4;k++) free(p.ztext[k]);
+    close(fd);
+    // success (we'll be permissive)
+    return 0;
+}
+
+/* Many files at once ("dfc put <path>...", directories included). Files
+   found inside a directory keep their path under the directory's name:
+   "dfc put /data/photos" stores photos/2024/a.jpg as "photos%2F2024%2Fa.jpg",
+   as chunk names cannot hold '/'. Other files are stored by base name, as
+   with a single put. */
+
+#define BATCH_FILES 256     // files per batch, however small
+
+typedef struct {
+    char *path;     // local file
+    char *name;     // stored as
+    size_t size;
+    int failed;
+} bfile;
+
+typedef struct {
+    bfile *v;
+    size_t n, cap;
+} bfiles;
+
+// "a/b" -> "a%2Fb"; -1 if it does not fit
+static int encode_name(char *buf, size_t n, const char *path) {
+    size_t o = 0;
+    for (; *path && o + 4 <= n; path++) {
+        if (*path == '/') { memcpy(buf + o, "%2F", 3); o += 3; }
+        else buf[o++] = *path;
+    }
+    buf[o < n ? o : n - 1] = 0;
+    return *path ? -1 : 0;
+}
+
+static void decode_name(char *buf, size_t n, const char *name) {
+    size_t o = 0;
+    for (; *name && o + 1 < n; name++) {
+        if (strncmp(name, "%2F", 3) == 0) { buf[o++] = '/'; name += 2; }
+        else buf[o++] = *name;
+    }
+    buf[o] = 0;
+}
+
+static void bfiles_add(bfiles *fl, const char *path, const char *rel, size_t size, int failed) {
+    char name[512];
+    // room for the ".p<k>" suffix
+    if (encode_name(name, sizeof(name) - 8, rel) < 0) failed = 1;
+    if (fl->n == fl->cap) {
+        bfile *v = realloc(fl->v, (fl->cap = fl->cap ? fl->cap * 2 : 256) * sizeof(*v));
+        if (!v) { fl->cap = fl->n; return; }
+        fl->v = v;
+    }
+    bfile *f = &fl->v[fl->n];
+    if (!(f->path = strdup(path)) || !(f->name = strdup(name))) { free(f->path); return; }
+    f->size = size;
+    f->failed = failed;
+    fl->n++;
+}
+
+// every regular file under dir, named rel/...; symlinks and special files are left out
+static void walk_dir(bfiles *fl, const char *dir, const char *rel) {
+    DIR *d = opendir(dir);
+    if (!d) { bfiles_add(fl, dir, rel, 0, 1); return; }
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        char path[PATH_MAX], name[PATH_MAX];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        snprintf(name, sizeof(name), "%s%s%s", rel, rel[0] ? "/" : "", de->d_name);
+        if (lstat(path, &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) walk_dir(fl, path, name);
+        else if (S_ISREG(st.st_mode)) bfiles_add(fl, path, name, st.st_size, 0);
+    }
+    closedir(d);
+}
+
+static void collect_path(bfiles *fl, const char *path) {
+    struct stat st;
+    char real[PATH_MAX];
+    if (stat(path, &st) != 0) { bfiles_add(fl, path, "", 0, 1); return; }
+    if (!S_ISDIR(st.st_mode)) {
+        const char *base = strrchr(path, '/');
+        bfiles_add(fl, path, base ? base + 1 : path, st.st_size, !S_ISREG(st.st_mode));
+        return;
+    }
+    // "dfc put ." is named after the directory it is
+    const char *base = realpath(path, real) ? strrchr(real, '/') + 1 : "";
+    walk_dir(fl, path, base);
+}
+
+// biggest file (and batch) sent as one: a window, within what a server takes per request
+static size_t batch_limit() {
+    size_t w = window_size();
+    return w < DFS_BATCH_MAX / 2 ? w : DFS_BATCH_MAX / 2;
+}
+
+/* Small files go in batches of up to a window's worth of bytes or
+   BATCH_FILES files, "inflight" batches at a time. A batch is read into
+   memory whole and each server gets one MPUT with every piece (and manifest)
+   placement gives it, so a server sees one request per batch rather than
+   two or three per file. A file fails if some piece reached none of its
+   servers. */
+typedef struct {
+    bfile **f;      // the files batched; batch b is f[first[b]..first[b+1])
+    size_t *first;
+} bput_ctx;
+
+static void bput_job(int b, void *arg) {
+    bput_ctx *bp = arg;
+    bfile **f = bp->f + bp->first[b];
+    int n = (int)(bp->first[b+1] - bp->first[b]), max = 5 * n;
+    size_t total = 0;
+    for (int i=0;i<n;i++) total += f[i]->size;
+    unsigned char *data = malloc(total ? total : 1);
+    put_ctx *pc = calloc(n, sizeof(*pc));
+    manifest_t *man = use_manifest ? calloc(n, sizeof(*man)) : NULL;
+    // per server: up to four pieces and a manifest per file
+    char (*chunks)[512] = malloc(max * sizeof(*chunks)), **names = malloc(max * sizeof(char *)), *stored = malloc(max);
+    const char **mem = malloc(max * sizeof(char *));
+    size_t *lens = malloc(max * sizeof(size_t));
+    int *owner = malloc(max * sizeof(int)), *piece = malloc(max * sizeof(int));
+    unsigned *want = calloc(n, sizeof(unsigned)), *got = calloc(n, sizeof(unsigned));
+    if (!data || !pc || (use_manifest && !man) || !chunks || !names || !stored || !mem || !lens || !owner ||
+        !piece || !want || !got) {
+        for (int i=0;i<n;i++) f[i]->failed = 1;
+        n = 0;
+    }
+    size_t at = 0;
+    for (int i=0;i<n;i++) {
+        int fd = open(f[i]->path, O_RDONLY);
+        if (fd < 0 || pread_full(fd, data + at, f[i]->size, 0) < 0) f[i]->failed = 1;
+        if (fd >= 0) close(fd);
+        put_ctx *p = &pc[i];
+        p->basefname = f[i]->name;
+        p->x = md5_mod(f[i]->name, nservers);
+        p->fd = -1;
+        p->data = data + at;
+        split_layout(f[i]->size, p->off, p->plen);
+        if (man && !f[i]->failed) {
+            p->man = &man[i];
+            if (!(p->mtext = build_manifest(p, f[i]->size, &p->mlen))) f[i]->failed = 1;
+        }
+        at += f[i]->size;
+    }
+    for (int j=0;j<nservers && n;j++) {
+        int m = 0;
+        for (int i=0;i<n;i++) {
+            if (f[i]->failed) continue;
+            int ks[4], nk = server_pieces(f[i]->name, pc[i].x, j, ks);
+            for (int t=0;t<=nk;t++) {
+                if (t == nk && !pc[i].mtext) break;
+                if (t < nk) {
+                    snprintf(chunks[m], sizeof(chunks[m]), "%s.p%d", f[i]->name, ks[t]);
+                    mem[m] = (const char *)pc[i].data + pc[i].off[ks[t]-1];
+                    lens[m] = pc[i].plen[ks[t]-1];
+                    piece[m] = ks[t];
+                    want[i] |= 1u << (ks[t]-1);
+                } else {
+                    snprintf(chunks[m], sizeof(chunks[m]), "%s.m", f[i]->name);
+                    mem[m] = pc[i].mtext;
+                    lens[m] = pc[i].mlen;
+                    piece[m] = 0;
+                }
+                names[m] = chunks[m];
+                owner[m++] = i;
+            }
+        }
+        if (!m) continue;
+        server_mput(j, m, names, mem, lens, stored);
+        for (int t=0;t<m;t++) if (stored[t] && piece[t]) got[owner[t]] |= 1u << (piece[t]-1);
+    }
+    for (int i=0;i<n;i++) {
+        if (!f[i]->failed && (got[i] & want[i]) != want[i]) f[i]->failed = 1;
+        free((char *)pc[i].mtext);
+    }
+    free(data); free(pc); free(man); free(chunks); free(names); free(stored);
+    free(mem); free(lens); free(owner); free(piece); free(want); free(got);
+}
+
+static void put_many(int npaths, char **paths) {
+    bfiles fl = { NULL, 0, 0 };
+    for (int i=0;i<npaths;i++) collect_path(&fl, paths[i]);
+    // the batch path sends pieces as they are, two copies each, from memory, without asking who has them
+    int batched = !ec_k && !stripe_unit && !use_chain && !use_delta && !use_dedup && put_codec < 0;
+    size_t limit = batch_limit(), nb = 0, bytes = 0;
+    bput_ctx bp = { calloc(fl.n + 1, sizeof(bfile *)), calloc(fl.n + 1, sizeof(size_t)) };
+    size_t nf = 0;
+    for (size_t i=0;i<fl.n && bp.f && bp.first;i++) {
+        bfile *f = &fl.v[i];
+        if (f->failed || !batched || f->size > limit) continue;
+        if (nf == bp.first[nb] || bytes + f->size > limit || nf - bp.first[nb] == BATCH_FILES) {
+            if (nf > bp.first[nb]) bp.first[++nb] = nf;
+            bytes = 0;
+        }
+        bp.f[nf++] = f;
+        bytes += f->size;
+    }
+    if (nf > bp.first[nb]) bp.first[++nb] = nf;
+    // asked once up front rather than by whichever jobs get there first
+    for (int j=0;j<nservers && nb;j++) server_batches(j);
+    if (nb) run_parallel((int)nb, bput_job, &bp);
+    // the rest one at a time, each over every server at once
+    for (size_t i=0, b=0;i<fl.n;i++) {
+        bfile *f = &fl.v[i];
+        if (b < nf && bp.f[b] == f) { b++; continue; }
+        if (!f->failed && put_file(f->path, f->name) < 0) f->failed = 1;
+    }
+    for (size_t i=0;i<fl.n;i++) {
+        if (fl.v[i].failed) printf("%s put failed\n", fl.v[i].path);
+        free(fl.v[i].path);
+        free(fl.v[i].name);
+    }
+    free(bp.f);
+    free(bp.first);
+    free(fl.v);
+}
+
+static void cmd_put(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: dfc put <path>...\n"
+                        "  a file is stored by its basename, a directory's files as <dir>/<path within it>\n");
+        return;
+    }
+    if (nservers <= 0) { fprintf(stderr, "No servers\n"); return; }
+    struct stat st;
+    if (argc > 2 || (stat(argv[1], &st) == 0 && S_ISDIR(st.st_mode))) {
+        put_many(argc - 1, argv + 1);
+        return;
+    }
+    const char *path = argv[1];
+    char *basefname = strrchr((char*)path,'/');
+    basefname = basefname ? basefname+1 : (char*)path;
+    if (put_file(path, basefname) < 0) printf("%s put failed\n", argv[1]);
+}
+
+static int server_index(const char *name) {
+    for (int j=0;j<nservers;j++) if (strcmp(servers[j].name, name) == 0) return j;
+    return -1;
+}
+
+/* "dfc rebalance [--dry-run] [--rate <n>[K|M|G]]": after servers are added,
+   removed or reweighted, moves each piece that is not where placement now puts
+   it. The servers' listings say who holds what. A piece missing from servers
+   that should keep it is sent there by a current holder (PUSH, server to
+   server, one chain for all of them), and copies on servers that should not
+   keep it are dropped (DEL) once every rightful holder has one. Pieces move
+   concurrently, "inflight" at a time; --rate caps the bytes sent per second
+   across all of them. Shards and stripes stay where they are.
+   A manifest names the servers holding each piece, and get asks only those,
+   so once a file's pieces are in place its manifest is rewritten with the new
+   holders and stored again on every server, and only then are its old copies
+   dropped. If that fails, or some server could not be listed (and may keep a
+   stale manifest), the old copies stay. */
+
+typedef struct {
+    uint64_t size;
+    uint64_t have[(MAX_SERVERS + 63) / 64];     // servers listing the chunk
+} rb_entry;
+
+typedef struct {
+    fmap_t *chunks;
+    int idx;        // server whose listing is coming in
+} rb_list;
+
+typedef struct {
+    int manifest;           // <file>.m is listed
+    char ready[5];          // piece k: moved, every rightful holder has it
+    int rewritten;          // manifest holders rewritten, or no manifest
+} rb_file;
+
+typedef struct {
+    const char **names;     // misplaced pieces, one job each
+    rb_entry **ents;
+    rb_file **files;        // the file of each piece
+    const char **fnames;    // the files, one manifest job each
+    rb_file **fents;
+    fmap_t *chunks;
+    char unlisted[MAX_SERVERS];     // listing failed: contents unknown
+    int dry_run;
+    double rate;            // bytes per second, 0 for no cap
+    pthread_mutex_t mu;
+    double next_us;         // when the next copy may start
+    int copied, dropped, failed, manifests;
+    unsigned long long bytes;
+} rb_ctx;
+
+static int rb_has(const rb_entry *e, int j) {
+    return (int)(e->have[j / 64] >> (j % 64) & 1);
+}
+
+static void rb_add(void *arg, char *line) {
+    rb_list *l = arg;
+    char *sp = strchr(line, ' ');
+    if (sp) *sp = 0;
+    rb_entry *e = fmap_get(l->chunks, line, strlen(line));
+    if (!e) return;
+    if (sp) e->size = strtoull(sp + 1, NULL, 10);
+    e->have[l->idx / 64] |= 1ULL << (l->idx % 64);
+}
+
+// k if name is piece k of a replicated file ("<file>.p<k>", file copied out), else 0
+static int rb_piece(char *file, size_t n, const char *name) {
+    const char *dot = strrchr(name, '.');
+    if (!dot || dot == name || dot[1] != 'p' || (size_t)(dot - name) >= n) return 0;
+    char *end;
+    long k = strtol(dot + 2, &end, 10);
+    if (end == dot + 2 || *end || k < 1 || k > 4) return 0;
+    memcpy(file, name, dot - name);
+    file[dot - name] = 0;
+    return (int)k;
+}
+
+/* where piece name should be: want[j] set for its rightful holders; *nmiss
+   of them lack it (and can be reached), *nextra servers hold it and should
+   not. returns 0 if placement gives the piece to no server */
+static int rb_plan(rb_ctx *r, const char *name, const rb_entry *e, char *want, int *nmiss, int *nextra) {
+    char file[512];
+    int k = rb_piece(file, sizeof(file), name), order[MAX_SERVERS], nh;
+    if (!k) return 0;
+    piece_candidates(file, md5_mod(file, nservers), k, order, &nh);
+    memset(want, 0, MAX_SERVERS);
+    *nmiss = *nextra = 0;
+    for (int i=0;i<nh;i++) {
+        want[order[i]] = 1;
+        if (!rb_has(e, order[i]) && !r->unlisted[order[i]]) (*nmiss)++;
+    }
+    for (int j=0;j<nservers;j++) if (rb_has(e, j) && !want[j]) (*nextra)++;
+    return nh;
+}
+
+// holds a copy of n bytes back until the rate cap allows it
+static void rb_throttle(rb_ctx *r, uint64_t n) {
+    if (r->rate <= 0) return;
+    pthread_mutex_lock(&r->mu);
+    double now = now_us(), start = r->next_us > now ? r->next_us : now;
+    r->next_us = start + n * 1e6 / r->rate;
+    pthread_mutex_unlock(&r->mu);
+    if (start > now) {
+        struct timespec ts = { (time_t)((start - now) / 1e6), (long)fmod(start - now, 1e6) * 1000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void rebalance_job(int job, void *arg) {
+    rb_ctx *r = arg;
+    const char *name = r->names[job];
+    rb_entry *e = r->ents[job];
+    char want[MAX_SERVERS], to[1024] = "", who[1024] = "";
+    int nmiss, nextra;
+    rb_plan(r, name, e, want, &nmiss, &nextra);
+    // copies go only where they are missing; extras go only once every rightful holder has one
+    int complete = 1;
+    size_t n = 0, w = 0;
+    for (int j=0;j<nservers;j++) {
+        if (!want[j] || rb_has(e, j)) continue;
+        if (r->unlisted[j]) { complete = 0; continue; }
+        n += snprintf(to + n, n < sizeof(to) ? sizeof(to) - n : 0, "%s%s:%d", n ? "," : "", servers[j].host, servers[j].port);
+        w += snprintf(who + w, w < sizeof(who) ? sizeof(who) - w : 0, "%s%s", w ? "," : "", servers[j].name);
+    }
+    if (n >= sizeof(to)) {
+        complete = 0;
+        nmiss = 0;
+    }
+    if (nmiss) {
+        int src[MAX_SERVERS], ns = 0, placed = 0;
+        for (int j=0;j<nservers;j++) if (rb_has(e, j)) src[ns++] = j;
+        sort_by_cost(src, 0, ns);
+        if (r->dry_run) {
+            printf("%s: %s -> %s\n", name, servers[src[0]].name, who);
+            placed = 1;
+        } else {
+            rb_throttle(r, e->size * nmiss);
+            for (int i=0;i<ns && !placed;i++) placed = server_command(src[i], OP_PUSH, name, to, PUSH_TIMEOUT_SEC, NULL) == 0;
+        }
+        pthread_mutex_lock(&r->mu);
+        if (placed) { r->copied += nmiss; r->bytes += e->size * nmiss; }
+        else r->failed++;
+        pthread_mutex_unlock(&r->mu);
+        if (!placed) complete = 0;
+    }
+    char file[512];
+    if (complete) r->files[job]->ready[rb_piece(file, sizeof(file), name)] = 1;
+}
+
+static int fetch_manifest(const char *fname, unsigned long x, manifest_t *m);
+
+// rewrites a file's manifest so that each moved piece names its new holders
+static void rb_manifest_job(int job, void *arg) {
+    rb_ctx *r = arg;
+    const char *file = r->fnames[job];
+    rb_file *f = r->fents[job];
+    if (!f->manifest) { f->rewritten = 1; return; }
+    for (int j=0;j<nservers;j++) if (r->unlisted[j]) return;
+    char chunk[512];
+    snprintf(chunk, sizeof(chunk), "%s.m", file);
+    rb_entry *me = fmap_find(r->chunks, chunk, strlen(chunk));
+    unsigned long x = md5_mod(file, nservers);
+    manifest_t *m = calloc(1, sizeof(*m));
+    char *text = malloc(MANIFEST_MAX_BYTES);
+    size_t len = 0;
+    if (m && text && fetch_manifest(file, x, m) == 0 && !m->ec_k) {
+        for (int k=1;k<=m->npieces && k<=4;k++) {
+            if (!f->ready[k]) continue;
+            int order[MAX_SERVERS], nh;
+            piece_candidates(file, x, k, order, &nh);
+            mpiece_t *mp = &m->piece[k-1];
+            mp->nholders = 0;
+            for (int i=0;i<nh && i<MANIFEST_MAX_HOLDERS;i++) {
+                snprintf(mp->holders[mp->nholders++], sizeof(mp->holders[0]), "%s", servers[order[i]].name);
+            }
+        }
+        len = manifest_format(m, text, MANIFEST_MAX_BYTES);
+    }
+    int ok = len > 0;
+    if (ok && r->dry_run) printf("%s: rewrite holders\n", chunk);
+    // every server that had the old manifest must take the new one
+    for (int j=0;j<nservers && ok && !r->dry_run;j++) {
+        char *names[1] = { chunk };
+        size_t off = 0;
+        const char *mem[1] = { text };
+        if (server_put_batch(j, 1, names, -1, &off, &len, mem, NULL) != 1 && me && rb_has(me, j)) ok = 0;
+    }
+    free(m);
+    free(text);
+    pthread_mutex_lock(&r->mu);
+    if (ok) r->manifests++;
+    else r->failed++;
+    pthread_mutex_unlock(&r->mu);
+    f->rewritten = ok;
+}
+
+// drops the copies of a piece that are no longer wanted, once it is in place everywhere else
+static void rb_drop_job(int job, void *arg) {
+    rb_ctx *r = arg;
+    const char *name = r->names[job];
+    rb_entry *e = r->ents[job];
+    char file[512], want[MAX_SERVERS];
+    int nmiss, nextra, k = rb_piece(file, sizeof(file), name);
+    rb_plan(r, name, e, want, &nmiss, &nextra);
+    if (!r->files[job]->ready[k] || !r->files[job]->rewritten) return;
+    for (int j=0;j<nservers && nextra;j++) {
+        if (!rb_has(e, j) || want[j]) continue;
+        int ok = 1;
+        if (r->dry_run) printf("%s: drop from %s\n", name, servers[j].name);
+        else ok = server_command(j, OP_DEL, name, NULL, READ_TIMEOUT_SEC, NULL) == 0;
+        pthread_mutex_lock(&r->mu);
+        if (ok) r->dropped++;
+        else r->failed++;
+        pthread_mutex_unlock(&r->mu);
+    }
+}
+
+static void cmd_rebalance(int argc, char **argv) {
+    if (nservers <= 0) { fprintf(stderr, "No servers\n"); return; }
+    rb_ctx r;
+    memset(&r, 0, sizeof(r));
+    for (int i=1;i<argc;i++) {
+        size_t rate;
+        if (strcmp(argv[i], "--dry-run") == 0) r.dry_run = 1;
+        else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc && (rate = parse_size(argv[++i])) && rate != (size_t)-1) r.rate = rate;
+        else { fprintf(stderr, "Usage: dfc rebalance [--dry-run] [--rate <bytes per second>[K|M|G]]\n"); return; }
+    }
+    fmap_t *chunks = fmap_new(sizeof(rb_entry));
+    if (!chunks) return;
+    for (int i=0;i<nservers;i++) {
+        rb_list l = { chunks, i };
+        if (server_list_fetch(i, NULL, 1, rb_add, &l) >= 0) continue;
+        r.unlisted[i] = 1;
+        fprintf(stderr, "%s is unreachable: nothing moves to or from it\n", servers[i].name);
+    }
+    size_t total = fmap_count(chunks), cap = total ? total : 1;
+    fmap_t *files = fmap_new(sizeof(rb_file));
+    r.chunks = chunks;
+    r.names = malloc(cap * sizeof(*r.names));
+    r.ents = malloc(cap * sizeof(*r.ents));
+    r.files = malloc(cap * sizeof(*r.files));
+    r.fnames = malloc(cap * sizeof(*r.fnames));
+    r.fents = malloc(cap * sizeof(*r.fents));
+    int njobs = 0, npieces = 0, nfiles = 0;
+    void *it = NULL;
+    const char *name;
+    rb_entry *e;
+    while (files && r.names && r.ents && r.files && r.fnames && r.fents && (e = fmap_next(chunks, &it, &name))) {
+        char want[MAX_SERVERS], file[520];
+        int nmiss, nextra;
+        if (!rb_plan(&r, name, e, want, &nmiss, &nextra)) continue;
+        npieces++;
+        if (!nmiss && !nextra) continue;
+        rb_piece(file, sizeof(file), name);
+        size_t flen = strlen(file);
+        rb_file *f = fmap_get(files, file, flen);
+        if (!f) break;
+        strcpy(file + flen, ".m");
+        f->manifest = fmap_find(chunks, file, flen + 2) != NULL;
+        r.names[njobs] = name; r.ents[njobs] = e; r.files[njobs++] = f;
+    }
+    it = NULL;
+    rb_file *f;
+    while (files && r.fnames && r.fents && (f = fmap_next(files, &it, &name))) { r.fnames[nfiles] = name; r.fents[nfiles++] = f; }
+    pthread_mutex_init(&r.mu, NULL);
+    double t0 = now_us();
+    run_parallel(njobs, rebalance_job, &r);
+    run_parallel(nfiles, rb_manifest_job, &r);
+    run_parallel(njobs, rb_drop_job, &r);
+    if (r.dry_run) printf("rebalance: %d of %d pieces misplaced\n", njobs, npieces);
+    else printf("rebalance: %d of %d pieces misplaced; %d copies sent (%llu bytes), %d manifests rewritten, "
+                "%d removed, %d failed in %.1f s\n", njobs, npieces, r.copied, r.bytes, r.manifests, r.dropped,
+                r.failed, (now_us() - t0) / 1e6);
+    pthread_mutex_destroy(&r.mu);
+    free(r.names);
+    free(r.ents);
+    free(r.files);
+    free(r.fnames);
+    free(r.fents);
+    fmap_free(files);
+    fmap_free(chunks);
+}
+
+/* reads <fname>.m from the first server that has a valid copy, starting at
+   the file's rotation; 0 on success */
+static int fetch_manifest(const char *fname, unsigned long x, manifest_t *m) {
+    char chunk[512];
+    snprintf(chunk, sizeof(chunk), "%s.m", fname);
+    mem_sink ms = { NULL, 0, MANIFEST_MAX_BYTES };
+    sink_t sink = { mem_begin, mem_data, &ms, NULL };
+    int rc = -1;
+    for (int i=0;i<nservers && rc < 0;i++) {
+        int j = (int)((x + i) % nservers);
+        if (server_get_stream(j, chunk, &sink) == 0) rc = manifest_parse(m, ms.buf, ms.len);
+    }
+    free(ms.buf);
+    return rc;
+}
+
+/* A piece's place in the output depends on the sizes of the pieces before it,
+   so a piece job waits until every lower piece has reported its size (jobs
+   start in piece order, so this cannot deadlock). A piece that no server can
+   supply fails every piece still waiting.
+   With a manifest every offset is known up front: nothing waits, each piece
+   goes only to the servers the manifest names and is checked against its MD5.
+   Shards of an erasure-coded file land at i * shard bytes, parity included
+   (past the end of the file, which is truncated once the data is rebuilt).
+   Stripes land at i * unit, and only their count is tracked. */
+typedef struct {
+    const char *fname;
+    unsigned long x;
+    int out;            // output file; each piece is pwrite()n at its offset
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    int state[MANIFEST_MAX_PIECES + 1];     // per piece: 0 pending, 1 size known, 2 written, -1 unavailable
+    size_t len[MANIFEST_MAX_PIECES + 1];
+    const manifest_t *man;  // NULL: probe by rotation
+    int nstripes;           // striped file: stripe count and unit
+    size_t unit;
+    size_t last_len;        // bytes in the last stripe
+    int failed;             // some stripe could not be fetched
+} get_ctx;
+
+typedef struct {
+    get_ctx *g;
+    int k;
+    off_t pos;          // next output offset for this piece
+    EVP_MD_CTX *md;     // running checksum (manifest gets)
+} piece_sink;
+
+static int piece_begin(void *arg, size_t len) {
+    piece_sink *ps = arg;
+    get_ctx *g = ps->g;
+    if (g->man) {
+        const mpiece_t *mp = &g->man->piece[ps->k-1];
+        if (len != mp->len) return -1;
+        ps->pos = (off_t)(g->man->ec_k ? (ps->k - 1) * g->man->shard_len : mp->off);
+        return EVP_DigestInit_ex(ps->md, EVP_md5(), NULL) ? 0 : -1;
+    }
+    if (g->nstripes) {
+        if (len > g->unit || (ps->k < g->nstripes && len != g->unit)) return -1;
+        if (ps->k == g->nstripes) g->last_len = len;
+        ps->pos = (off_t)(ps->k - 1) * g->unit;
+        return 0;
+    }
+    pthread_mutex_lock(&g->mu);
+    g->len[ps->k] = len;
+    g->state[ps->k] = 1;
+    pthread_cond_broadcast(&g->cv);
+    off_t off = 0;
+    int ok = 1;
+    for (int i=1;i<ps->k && ok;i++) {
+        while (g->state[i] == 0) pthread_cond_wait(&g->cv, &g->mu);
+        if (g->state[i] < 0) ok = 0;
+        off += g->len[i];
+    }
+    pthread_mutex_unlock(&g->mu);
+    ps->pos = off;
+    return ok ? 0 : -1;
+}
+
+static int piece_data(void *arg, const unsigned char *buf, size_t n) {
+    piece_sink *ps = arg;
+    if (ps->md) EVP_DigestUpdate(ps->md, buf, n);
+    if (pwrite_full(ps->g->out, buf, n, ps->pos) < 0) return -1;
+    ps->pos += n;
+    return 0;
+}
+
+static void piece_done(get_ctx *g, int k, int state) {
+    pthread_mutex_lock(&g->mu);
+    g->state[k] = state;
+    pthread_cond_broadcast(&g->cv);
+    pthread_mutex_unlock(&g->mu);
+}
+
+static int piece_failed(get_ctx *g, int k) {
+    pthread_mutex_lock(&g->mu);
+    int bad = 0;
+    for (int i=1;i<k;i++) if (g->state[i] < 0) bad = 1;
+    pthread_mutex_unlock(&g->mu);
+    return bad;
+}
+
+// a delivered piece is good unless the manifest's checksum says otherwise
+static int piece_ok(piece_sink *ps) {
+    if (!ps->g->man) return 1;
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    return EVP_DigestFinal_ex(ps->md, digest, NULL) && memcmp(digest, ps->g->man->piece[ps->k-1].md5, 16) == 0;
+}
+
+/* Piece cache (dfc_cache.h): what a piece should hash to comes from the
+   manifest, or else from a STAT to its holders, so a warm get moves no piece
+   bodies. A cached copy is checked against that MD5 on its way out; a
+   fetched piece is written through to a new entry, even when its holders
+   could not say yet (a server may answer a STAT before it has hashed the
+   chunk), so the next get finds it. */
+
+// the MD5 and size of chunk, from the manifest or the first of its nh holders to answer; 0 if known
+static int piece_digest(get_ctx *g, int k, const char *chunk, const int *order, int nh, unsigned char *md5, uint64_t *size) {
+    if (g->man) {
+        memcpy(md5, g->man->piece[k-1].md5, 16);
+        *size = g->man->piece[k-1].len;
+        return 0;
+    }
+    for (int c=0;c<nh;c++) {
+        reply_t r;
+        char hex[40];
+        unsigned long long sz;
+        if (server_command(order[c], OP_STAT, chunk, NULL, READ_TIMEOUT_SEC, &r) != 0) continue;
+        if (sscanf(r.info, "%llu %*s %39s", &sz, hex) != 2 || strlen(hex) != 32) continue;
+        int ok = 1;
+        for (int i=0;i<16 && ok;i++) {
+            unsigned v;
+            ok = sscanf(hex + 2 * i, "%2x", &v) == 1;
+            md5[i] = v;
+        }
+        if (!ok) continue;
+        *size = sz;
+        return 0;
+    }
+    return -1;
+}
+
+// hands the cached copy to sink; 0 if there was one and it is intact
+static int cache_deliver(const unsigned char *md5, uint64_t size, sink_t *sink) {
+    int fd = pcache_open(md5, size);
+    if (fd < 0) return -1;
+    size_t w = window_size();
+    unsigned char *buf = malloc(w), d[EVP_MAX_MD_SIZE];
+    EVP_MD_CTX *md = EVP_MD_CTX_new();
+    int ok = buf && md && EVP_DigestInit_ex(md, EVP_md5(), NULL) && sink->begin(sink->arg, size) == 0, bad = 0;
+    for (uint64_t off = 0; ok && off < size;) {
+        ssize_t r = pread(fd, buf, size - off < w ? size - off : w, (off_t)off);
+        if (r <= 0 || !EVP_DigestUpdate(md, buf, r)) { ok = 0; bad = 1; break; }
+        ok = sink->data(sink->arg, buf, r) == 0;
+        off += r;
+    }
+    if (ok && (!EVP_DigestFinal_ex(md, d, NULL) || memcmp(d, md5, 16) != 0)) ok = 0, bad = 1;
+    // a damaged copy goes; the fetch that follows starts the piece over
+    if (bad) pcache_drop(md5);
+    EVP_MD_CTX_free(md);
+    free(buf);
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+typedef struct {
+    sink_t *inner;
+    pcache_entry *e;    // NULL once writing it failed; the piece still goes through
+} tee_sink;
+
+static int tee_begin(void *arg, size_t len) {
+    tee_sink *t = arg;
+    if (t->e && pcache_reset(t->e) < 0) { pcache_abort(t->e); t->e = NULL; }
+    return t->inner->begin(t->inner->arg, len);
+}
+
+static int tee_data(void *arg, const unsigned char *buf, size_t n) {
+    tee_sink *t = arg;
+    if (t->e && pcache_write(t->e, buf, n) < 0) { pcache_abort(t->e); t->e = NULL; }
+    return t->inner->data(t->inner->arg, buf, n);
+}
+
+/* fetches piece k into the output: its holders first (with a manifest, only
+   the servers it names, so at most one fallback with two copies), then anyone
+   else; each group fastest first. Candidates are taken two at a time as a
+   hedged pair. returns 2 if written, -1 if no server could supply it. */
+static int fetch_piece(get_ctx *g, int k) {
+    char chunk[512];
+    if (g->nstripes) stripe_name(chunk, sizeof(chunk), g->fname, g->nstripes, g->unit, k - 1);
+    else piece_name(chunk, sizeof(chunk), g->fname, g->man ? g->man->ec_k : 0, g->man ? g->man->ec_m : 0, k);
+    piece_sink ps = { g, k, 0, NULL };
+    sink_t sink = { piece_begin, piece_data, &ps, NULL };
+    int order[MAX_SERVERS], n = 0, nh = 0;
+    if (g->man) {
+        const mpiece_t *mp = &g->man->piece[k-1];
+        for (int h=0;h<mp->nholders;h++) {
+            int idx = server_index(mp->holders[h]);
+            if (idx >= 0) order[n++] = idx;
+        }
+        nh = n;
+        if (!(ps.md = EVP_MD_CTX_new())) n = 0;
+    } else if (g->nstripes) {
+        for (int j=0;j<nservers;j++) if (stripe_on(g->x, k - 1, j)) order[n++] = j;
+        nh = n;
+        for (int j=0;j<nservers;j++) if (!stripe_on(g->x, k - 1, j)) order[n++] = j;
+    } else {
+        n = piece_candidates(g->fname, g->x, k, order, &nh);
+    }
+    sort_by_cost(order, 0, nh);
+    sort_by_cost(order, nh, n);
+    int state = -1;
+    unsigned char md5[16];
+    uint64_t size;
+    tee_sink tee = { &sink, NULL };
+    sink_t through = { tee_begin, tee_data, &tee, NULL }, *s = &sink;
+    if (pcache_enabled()) {
+        if (piece_digest(g, k, chunk, order, nh ? nh : n, md5, &size) == 0 && cache_deliver(md5, size, &sink) == 0 &&
+            piece_ok(&ps)) state = 2;
+        else if ((tee.e = pcache_create())) s = &through;
+    }
+    for (int c=0;c<n && state < 0;) {
+        if (c + 1 < n) {
+            int won;
+            if (hedged_get(order[c], order[c+1], chunk, s, &won) == 0 && piece_ok(&ps)) state = 2;
+            // the other one was cut off (or never asked): give it a turn of its own
+            else if (won >= 0 && server_get_stream(order[c + 1 - won], chunk, s) == 0 && piece_ok(&ps)) state = 2;
+            c += 2;
+        } else {
+            if (server_get_stream(order[c], chunk, s) == 0 && piece_ok(&ps)) state = 2;
+            c++;
+        }
+        if (state < 0 && !g->man && !g->nstripes && piece_failed(g, k)) break;
+    }
+    // kept under the MD5 of what arrived, whatever the STAT said
+    if (tee.e && state == 2) pcache_commit(tee.e);
+    else pcache_abort(tee.e);
+    EVP_MD_CTX_free(ps.md);
+    return state;
+}
+
+// one job per piece (per data shard of an erasure-coded file)
+static void get_job(int job, void *arg) {
+    get_ctx *g = arg;
+    piece_done(g, job + 1, fetch_piece(g, job + 1));
+}
+
+static void stripe_get_job(int job, void *arg) {
+    get_ctx *g = arg;
+    if (fetch_piece(g, job + 1) != 2) g->failed = 1;
+}
+
+typedef struct {
+    const char *fname;
+    size_t flen;
+    int n;
+    size_t unit;
+} stripe_probe;
+
+static void stripe_seen(void *arg, char *name) {
+    stripe_probe *sp = arg;
+    int n, i;
+    size_t unit;
+    if (!sp->n && strncmp(name, sp->fname, sp->flen) == 0 && name[sp->flen] == '.' &&
+        parse_stripe(name + sp->flen + 1, &n, &unit, &i) == 0) {
+        sp->n = n;
+        sp->unit = unit;
+    }
+}
+
+/* stripe layout of a file, from the listing of the server holding its first
+   stripe (or the ones after it); 0 if the file is striped */
+static int stripe_find(get_ctx *g) {
+    char prefix[512];
+    snprintf(prefix, sizeof(prefix), "%s.n", g->fname);
+    stripe_probe sp = { g->fname, strlen(g->fname), 0, 0 };
+    for (int i=0;i<nservers && !sp.n;i++) server_list_fetch((int)((g->x + i) % nservers), prefix, 0, stripe_seen, &sp);
+    g->nstripes = sp.n;
+    g->unit = sp.unit;
+    return sp.n ? 0 : -1;
+}
+
+/* rebuilds the data shards that could not be fetched: parity shards are
+   fetched one at a time until k shards are present, then the missing data is
+   decoded a window at a time. 0 once every data shard is in place */
+static int ec_decode(get_ctx *g) {
+    const manifest_t *m = g->man;
+    int k = m->ec_k, n = m->ec_k + m->ec_m, present[RS_MAX_SHARDS], missing = 0;
+    for (int i = 0; i < n; i++) {
+        present[i] = i < k && g->state[i+1] == 2;
+        if (i < k && !present[i]) missing++;
+    }
+    if (!missing) return 0;
+    for (int i = k; i < n && missing; i++) {
+        if (fetch_piece(g, i + 1) == 2) { present[i] = 1; missing--; }
+    }
+    if (missing) return -1;
+    size_t w = window_size(), L = m->shard_len;
+    unsigned char *buf = malloc(n * w);
+    unsigned char *sh[RS_MAX_SHARDS];
+    rs_code *rs = rs_new(k, m->ec_m);
+    int rc = buf && rs ? 0 : -1;
+    for (int i = 0; i < n && rc == 0; i++) sh[i] = buf + i * w;
+    for (size_t t = 0; t < L && rc == 0; t += w) {
+        size_t nb = L - t < w ? L - t : w;
+        // short data shards read as zero past their end, and are written back clipped
+        for (int i = 0; i < n && rc == 0; i++) {
+            if (!present[i]) continue;
+            size_t have = m->piece[i].len > t ? (m->piece[i].len - t < nb ? m->piece[i].len - t : nb) : 0;
+            if (have && pread_full(g->out, sh[i], have, (off_t)(i * L + t)) < 0) rc = -1;
+            memset(sh[i] + have, 0, nb - have);
+        }
+        if (rc || rs_reconstruct(rs, sh, present, nb) < 0) { rc = -1; break; }
+        for (int i = 0; i < k && rc == 0; i++) {
+            if (present[i]) continue;
+            size_t have = m->piece[i].len > t ? (m->piece[i].len - t < nb ? m->piece[i].len - t : nb) : 0;
+            if (have && pwrite_full(g->out, sh[i], have, (off_t)(i * L + t)) < 0) rc = -1;
+        }
+    }
+    rs_free(rs);
+    free(buf);
+    return rc;
+}
+
+// every piece, shard or stripe, fetched concurrently; 1 if the file is complete (total bytes)
+static int get_all(get_ctx *g, int npieces, size_t *total) {
+    if (g->nstripes) {
+        run_parallel(g->nstripes, stripe_get_job, g);
+        *total = (size_t)(g->nstripes - 1) * g->unit + g->last_len;
+        return !g->failed;
+    }
+    run_parallel(npieces, get_job, g);
+    int ok = 1;
+    *total = 0;
+    for (int k=1;k<=npieces;k++) {
+        if (g->state[k] != 2) ok = 0;
+        *total += g->len[k];
+    }
+    if (g->man && g->man->ec_k) ok = ec_decode(g) == 0;
+    return ok;
+}
+
+// rebuilds the whole of fname into out (at offset 0); 1 on success
+static int get_file(const char *fname, int out, size_t *total) {
+    get_ctx g = { fname, nservers > 0 ? md5_mod(fname, nservers) : 0, out,
+                  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, {0}, {0}, NULL, 0, 0, 0, 0 };
+    manifest_t man;
+    int npieces = 4;
+    if (use_manifest && fetch_manifest(fname, g.x, &man) == 0 && (man.npieces == 4 || man.ec_k)) {
+        g.man = &man;
+        npieces = man.ec_k ? man.ec_k : 4;
+        for (int k=1;k<=npieces;k++) { g.len[k] = man.piece[k-1].len; g.state[k] = 1; }
+    }
+    else if (stripe_unit) stripe_find(&g);
+    int ok = get_all(&g, npieces, total);
+    // not stored as pieces: maybe striped by a client with a "stripe" line
+    if (!ok && !g.man && !g.nstripes && stripe_find(&g) == 0) ok = get_all(&g, npieces, total);
+    return ok;
+}
+
+/* Range get ("dfc get <file> --range a-b"): bytes a through b of the file
+   (b left out: to the end) are written to stdout. The piece sizes come from
+   the manifest or from an empty ranged GET of each piece, which answers with
+   the piece's size; with them split_layout's base/rem layout places the
+   range, and only the parts of the pieces it overlaps are fetched, one job
+   per piece. Erasure-coded and striped files are rebuilt whole and cut. */
+typedef struct {
+    const char *fname;
+    unsigned long x;
+    size_t plen[4], poff[4];    // piece sizes and their offsets in the file
+    size_t from, to;            // the range, [from, to)
+    int out;                    // receives file byte from at out_base
+    off_t out_base;
+    int failed;
+} range_ctx;
+
+typedef struct {
+    int fd;
+    off_t pos;
+    size_t n;       // bytes written
+} pos_sink;
+
+static int pos_begin(void *arg, size_t len) {
+    (void)arg; (void)len;
+    return 0;
+}
+
+static int pos_data(void *arg, const unsigned char *buf, size_t n) {
+    pos_sink *ps = arg;
+    if (pwrite_full(ps->fd, buf, n, ps->pos) < 0) return -1;
+    ps->pos += n;
+    ps->n += n;
+    return 0;
+}
+
+/* GET <piece k> <off> <n> from the servers holding it, in rotation order,
+   into fd at pos; *size, if given, gets the piece's size. 0 on success */
+static int fetch_range(range_ctx *rc, int k, size_t off, size_t n, off_t pos, size_t *size) {
+    int order[MAX_SERVERS], nh;
+    char chunk[512], args[64];
+    piece_name(chunk, sizeof(chunk), rc->fname, 0, 0, k);
+    snprintf(args, sizeof(args), "%zu %zu", off, n);
+    piece_candidates(rc->fname, rc->x, k, order, &nh);
+    for (int i=0;i<nservers;i++) {
+        pos_sink ps = { rc->out, pos, 0 };
+        sink_t sink = { pos_begin, pos_data, &ps, NULL };
+        reply_t r;
+        const char *sz;
+        if (server_fetch(order[i], OP_GET, chunk, args, &sink, &r) != 0 || !(sz = strstr(r.info, "SIZE "))) continue;
+        if (size) *size = strtoull(sz + 5, NULL, 10);
+        if (ps.n == n) return 0;
+    }
+    return -1;
+}
+
+static void range_size_job(int k, void *arg) {
+    range_ctx *rc = arg;
+    if (fetch_range(rc, k + 1, 0, 0, 0, &rc->plen[k]) < 0) rc->failed = 1;
+}
+
+static void range_job(int k, void *arg) {
+    range_ctx *rc = arg;
+    size_t lo = rc->poff[k] > rc->from ? rc->poff[k] : rc->from;
+    size_t hi = rc->poff[k] + rc->plen[k] < rc->to ? rc->poff[k] + rc->plen[k] : rc->to;
+    if (lo >= hi) return;
+    if (fetch_range(rc, k + 1, lo - rc->poff[k], hi - lo, rc->out_base + (off_t)(lo - rc->from), NULL) < 0) rc->failed = 1;
+}
+
+// n bytes of from at off, written out to a pipe or terminal
+static int copy_out(int from, off_t off, size_t n, int to) {
+    char buf[65536];
+    while (n) {
+        ssize_t r = pread(from, buf, n < sizeof(buf) ? n : sizeof(buf), off);
+        if (r <= 0) return -1;
+        for (ssize_t w, done = 0; done < r; done += w) {
+            if ((w = write(to, buf + done, r - done)) <= 0) return -1;
+        }
+        off += r; n -= r;
+    }
+    return 0;
+}
+
+static void cmd_get_range(const char *fname, const char *spec) {
+    unsigned long long a, b = ULLONG_MAX;
+    int n;
+    if (sscanf(spec, "%llu-%n", &a, &n) != 1 || (spec[n] && (sscanf(spec + n, "%llu", &b) != 1 || b < a))) {
+        fprintf(stderr, "Usage: dfc get <filename> --range <first byte>-[<last byte>]\n");
+        return;
+    }
+    range_ctx rc = { fname, nservers > 0 ? md5_mod(fname, nservers) : 0, {0}, {0}, 0, 0, 1, 0, 0 };
+    manifest_t man;
+    int sized = 0, found = use_manifest && fetch_manifest(fname, rc.x, &man) == 0;
+    if (found) {
+        sized = man.npieces == 4 && !man.ec_k;
+        for (int k=0;k<4 && sized;k++) rc.plen[k] = man.piece[k].len;
+    } else if (!stripe_unit && nservers > 0) {
+        run_parallel(4, range_size_job, &rc);
+        sized = !rc.failed;
+    }
+    // stdout takes the bytes at their place unless it is a pipe (or appends): then they gather in a temp file
+    FILE *tmp = NULL;
+    rc.out_base = lseek(1, 0, SEEK_CUR);
+    if (rc.out_base < 0 || (fcntl(1, F_GETFL) & O_APPEND)) {
+        if (!(tmp = tmpfile())) { fprintf(stderr, "%s is incomplete\n", fname); return; }
+        rc.out = fileno(tmp);
+        rc.out_base = 0;
+    }
+    size_t total = 0;
+    int ok;
+    if (sized) {
+        for (int k=0;k<4;k++) {
+            rc.poff[k] = total;
+            total += rc.plen[k];
+        }
+    } else {
+        // rebuilt whole in a temp file, then cut
+        if (!tmp && !(tmp = tmpfile())) { fprintf(stderr, "%s is incomplete\n", fname); return; }
+        ok = get_file(fname, fileno(tmp), &total);
+        if (!ok) { fprintf(stderr, "%s is incomplete\n", fname); fclose(tmp); return; }
+    }
+    rc.from = a < total ? a : total;
+    rc.to = b < total ? b + 1 : total;
+    if (sized) {
+        run_parallel(4, range_job, &rc);
+        ok = !rc.failed;
+        if (ok && tmp) ok = copy_out(rc.out, 0, rc.to - rc.from, 1) == 0;
+        else if (ok) lseek(1, rc.out_base + (off_t)(rc.to - rc.from), SEEK_SET);
+    } else {
+        ok = copy_out(fileno(tmp), rc.from, rc.to - rc.from, 1) == 0;
+    }
+    if (tmp) fclose(tmp);
+    if (!ok) fprintf(stderr, "%s is incomplete\n", fname);
+}
+
+// fetches fname into path (by way of <path>.part); says so if it cannot
+static void get_one(const char *fname, const char *path) {
+    // pieces land at their final offsets in <path>.part, renamed once all are in
+    char part[PATH_MAX + 8];
+    snprintf(part, sizeof(part), "%s.part", path);
+    // read back too: erasure decoding works in place
+    int out = open(part, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) { printf("%s is incomplete\n", path); return; }
+    size_t total = 0;
+    int ok = get_file(fname, out, &total);
+    if (ok && ftruncate(out, total) != 0) ok = 0;
+    if (close(out) != 0) ok = 0;
+    if (!ok || rename(part, path) != 0) {
+        printf("%s is incomplete\n", path);
+        unlink(part);
+    }
+}
+
+/* Many files at once ("dfc get <file>...", or "dfc get -r <dir>..." for
+   everything put from a directory). One listing per server, with sizes,
+   says who holds which piece of every file asked for (under the directory's
+   prefix, or the longest one the names share). Files whose pieces fit in a
+   window are then batched as put batches them: each server gets one MGET
+   for the pieces (and manifests) of a batch it was picked for, every piece
+   going to the holder given the fewest bytes so far. A manifest, when there
+   is one, is checked against what arrived. Whatever a batch does not
+   complete, and files kept as shards or stripes, too big, or wanted through
+   the piece cache, take the single-file path. */
+
+typedef struct {
+    unsigned mask;          // pieces seen
+    int single;             // shards, stripes, or a listing without sizes: not for a batch
+    uint64_t size[4];       // as listed (stored, so maybe compressed)
+    unsigned char held[5][MAX_SERVERS / 8];     // servers listing piece k (held[4]: the manifest)
+} bget_entry;
+
+typedef struct {
+    fmap_t *files;
+    const char *prefix;
+    int j;              // server being listed
+} bget_list;
+
+static void bget_add(void *arg, char *ln) {
+    bget_list *l = arg;
+    // older servers list names only
+    char *sp = strrchr(ln, ' ');
+    if (sp) *sp = 0;
+    char *dot = strrchr(ln, '.');
+    // and send everything, prefix or not
+    if (!dot || strncmp(ln, l->prefix, strlen(l->prefix)) != 0) return;
+    int k = dot[1] == 'p' && dot[2] >= '1' && dot[2] <= '4' && !dot[3] ? dot[2] - '0' : 0;
+    int man = strcmp(dot, ".m") == 0, other = dot[1] == 'k' || dot[1] == 'n';
+    if (!k && !man && !other) return;
+    bget_entry *e = fmap_get(l->files, ln, dot - ln);
+    if (!e) return;
+    int slot = man ? 4 : k - 1;
+    if (other || !sp) e->single = 1;
+    if (!other) e->held[slot][l->j / 8] |= 1 << (l->j % 8);
+    if (k) {
+        e->mask |= 1u << (k-1);
+        if (sp) e->size[k-1] = strtoull(sp + 1, NULL, 10);
+    }
+}
+
+typedef struct {
+    char *name;         // stored as
+    char *path;         // written to
+    bget_entry *e;      // what the listings said, NULL if nothing
+    int done;
+} bget_item;
+
+typedef struct {
+    bget_item **f;      // the files batched; batch b is f[first[b]..first[b+1])
+    size_t *first;
+} bget_ctx;
+
+// the holder in set to ask for size more bytes: the least loaded so far; -1 if none takes MGET
+static int bget_pick(const unsigned char *set, uint64_t *load, uint64_t size) {
+    int best = -1;
+    double bc = 0;
+    for (int j=0;j<nservers;j++) {
+        if (!(set[j / 8] & 1 << (j % 8)) || !server_batches(j)) continue;
+        double c = (double)load[j] + (server_suspect(j) ? 1e18 : 0);
+        if (best < 0 || c < bc) { best = j; bc = c; }
+    }
+    if (best >= 0) load[best] += size;
+    return best;
+}
+
+// writes a file from its pieces (and checks them against its manifest, if one came); 0 on success
+static int bget_write(bget_item *it, unsigned char **pd, uint64_t *pl, const unsigned char *mtext, uint64_t mlen) {
+    manifest_t man;
+    if (mtext && manifest_parse(&man, (const char *)mtext, mlen) == 0) {
+        if (man.npieces != 4 || man.ec_k) return -1;
+        for (int k=0;k<4;k++) {
+            unsigned char d[EVP_MAX_MD_SIZE];
+            if (man.piece[k].len != pl[k] || !EVP_Digest(pd[k], pl[k], d, NULL, EVP_md5(), NULL) ||
+                memcmp(d, man.piece[k].md5, 16) != 0) return -1;
+        }
+    }
+    char part[PATH_MAX + 8];
+    snprintf(part, sizeof(part), "%s.part", it->path);
+    int out = open(part, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) return -1;
+    int rc = 0;
+    off_t off = 0;
+    for (int k=0;k<4 && rc == 0;k++) {
+        if (pwrite_full(out, pd[k], pl[k], off) < 0) rc = -1;
+        off += pl[k];
+    }
+    if (close(out) != 0) rc = -1;
+    if (rc == 0 && rename(part, it->path) != 0) rc = -1;
+    if (rc < 0) unlink(part);
+    return rc;
+}
+
+static void bget_job(int b, void *arg) {
+    bget_ctx *bg = arg;
+    bget_item **f = bg->f + bg->first[b];
+    int n = (int)(bg->first[b+1] - bg->first[b]);
+    uint64_t load[MAX_SERVERS] = {0};
+    // per file and slot (pieces, then the manifest): the server asked, then what it sent
+    int (*src)[5] = malloc(n * sizeof(*src));
+    unsigned char *(*pd)[5] = calloc(n, sizeof(*pd)), *body[MAX_SERVERS] = {0};
+    uint64_t (*pl)[5] = calloc(n, sizeof(*pl));
+    if (!src || !pd || !pl) n = 0;
+    for (int i=0;i<n;i++) {
+        bget_entry *e = f[i]->e;
+        for (int k=0;k<5;k++) src[i][k] = k < 4 || use_manifest ? bget_pick(e->held[k], load, k < 4 ? e->size[k] : 0) : -1;
+    }
+    for (int j=0;j<nservers && n;j++) {
+        // the names asked of server j, one per line
+        char *req = NULL;
+        size_t len = 0;
+        FILE *m = open_memstream(&req, &len);
+        if (!m) continue;
+        int asked = 0;
+        for (int i=0;i<n;i++) {
+            for (int k=0;k<5;k++) {
+                if (src[i][k] != j) continue;
+                if (k < 4) fprintf(m, "%s%s.p%d", asked++ ? "\n" : "", f[i]->name, k + 1);
+                else fprintf(m, "%s%s.m", asked++ ? "\n" : "", f[i]->name);
+            }
+        }
+        size_t blen;
+        if (fclose(m) != 0 || !asked || server_batch(j, OP_MGET, req, len, &body[j], &blen) != 0) {
+            free(req);
+            continue;
+        }
+        free(req);
+        // the records come back in the order asked
+        size_t at = 0;
+        for (int i=0;i<n;i++) {
+            for (int k=0;k<5;k++) {
+                if (src[i][k] != j) continue;
+                if (blen - at < DFS_MGET_REC_LEN(0)) { at = blen; continue; }
+                uint64_t rl = dfs_get64(body[j] + at + 1);
+                if (body[j][at] != 1 || rl > blen - at - DFS_MGET_REC_LEN(0)) {
+                    at = body[j][at] == 1 ? blen : at + DFS_MGET_REC_LEN(0);
+                    continue;
+                }
+                pd[i][k] = body[j] + at + DFS_MGET_REC_LEN(0);
+                pl[i][k] = rl;
+                at += DFS_MGET_REC_LEN(rl);
+            }
+        }
+    }
+    for (int i=0;i<n;i++) {
+        int k = 0;
+        while (k < 4 && pd[i][k]) k++;
+        f[i]->done = k == 4 && bget_write(f[i], pd[i], pl[i], pd[i][4], pl[i][4]) == 0;
+    }
+    for (int j=0;j<nservers;j++) free(body[j]);
+    free(src); free(pd); free(pl);
+}
+
+static void get_many(bget_item *items, size_t n) {
+    size_t limit = batch_limit(), nb = 0, bytes = 0, nf = 0;
+    bget_ctx bg = { calloc(n + 1, sizeof(bget_item *)), calloc(n + 1, sizeof(size_t)) };
+    for (size_t i=0;i<n && bg.f && bg.first && !pcache_enabled();i++) {
+        bget_entry *e = items[i].e;
+        if (!e || e->single || (e->mask & 0xf) != 0xf) continue;
+        uint64_t size = e->size[0] + e->size[1] + e->size[2] + e->size[3];
+        if (size > limit) continue;
+        if (nf == bg.first[nb] || bytes + size > limit || nf - bg.first[nb] == BATCH_FILES) {
+            if (nf > bg.first[nb]) bg.first[++nb] = nf;
+            bytes = 0;
+        }
+        bg.f[nf++] = &items[i];
+        bytes += size;
+    }
+    if (nf > bg.first[nb]) bg.first[++nb] = nf;
+    for (int j=0;j<nservers && nb;j++) server_batches(j);
+    if (nb) run_parallel((int)nb, bget_job, &bg);
+    for (size_t i=0;i<n;i++) if (!items[i].done) get_one(items[i].name, items[i].path);
+    free(bg.f);
+    free(bg.first);
+}
+
+// a path a listing may be written to: relative, and never climbing out
+static int safe_path(const char *p) {
+    if (p[0] == '/' || !p[0]) return 0;
+    for (const char *c = p; c; c = strchr(c, '/')) {
+        if (*c == '/') c++;
+        if (strncmp(c, "..", 2) == 0 && (c[2] == '/' || !c[2])) return 0;
+    }
+    return 1;
+}
+
+static void make_parents(const char *path) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *c = strchr(dir + 1, '/'); c; c = strchr(c + 1, '/')) {
+        *c = 0;
+        mkdir(dir, 0755);
+        *c = '/';
+    }
+}
+
+// every server's listing of names under prefix, with sizes, folded into files
+static void bget_list_all(fmap_t *files, const char *prefix) {
+    for (int j=0;j<nservers;j++) {
+        bget_list l = { files, prefix, j };
+        server_list_fetch(j, prefix[0] ? prefix : NULL, 1, bget_add, &l);
+    }
+}
+
+// "dfc get -r <dir>": every file put from inside dir
+static void get_tree(const char *dir) {
+    char prefix[512], name[512], path[PATH_MAX];
+    size_t L = strlen(dir);
+    while (L > 1 && dir[L-1] == '/') L--;
+    snprintf(path, sizeof(path), "%.*s/", (int)L, dir);
+    fmap_t *files = fmap_new(sizeof(bget_entry));
+    if (!files || encode_name(prefix, sizeof(prefix), path) < 0) { fmap_free(files); printf("%s is incomplete\n", dir); return; }
+    bget_list_all(files, prefix);
+    bget_item *items = calloc(fmap_count(files) + 1, sizeof(*items));
+    size_t n = 0;
+    void *it = NULL;
+    const char *key;
+    bget_entry *e;
+    while (items && (e = fmap_next(files, &it, &key))) {
+        decode_name(path, sizeof(path), key);
+        if (!safe_path(path)) { printf("%s is incomplete\n", key); continue; }
+        make_parents(path);
+        snprintf(name, sizeof(name), "%s", key);
+        items[n] = (bget_item){ strdup(name), strdup(path), e, 0 };
+        if (items[n].name && items[n].path) n++;
+    }
+    if (!n) printf("%s is incomplete\n", dir);
+    get_many(items, n);
+    for (size_t i=0;i<n;i++) { free(items[i].name); free(items[i].path); }
+    free(items);
+    fmap_free(files);
+}
+
+// lists the names of items not found yet under their longest common prefix, and looks them up again
+static void bget_find(fmap_t *map, bget_item *items, int n) {
+    size_t common = 0;
+    int first = -1;
+    for (int i=0;i<n;i++) {
+        if (items[i].e) continue;
+        if (first < 0) common = strlen(items[first = i].name);
+        while (common && strncmp(items[first].name, items[i].name, common) != 0) common--;
+    }
+    if (first < 0) return;
+    char prefix[512];
+    snprintf(prefix, sizeof(prefix), "%.*s", (int)common, items[first].name);
+    bget_list_all(map, prefix);
+    for (int i=0;i<n;i++) if (!items[i].e) items[i].e = fmap_find(map, items[i].name, strlen(items[i].name));
+}
+
+/* "dfc get <file>...": each written where named. A path is looked up as put
+   with its directory (the path with '/' encoded), and failing that as a file
+   put by itself, which is stored under its basename. */
+static void get_list(int n, char **files) {
+    char (*names)[512] = calloc(n, sizeof(*names));
+    bget_item *items = calloc(n, sizeof(*items));
+    fmap_t *map = fmap_new(sizeof(bget_entry));
+    if (!names || !items || !map) { free(names); free(items); fmap_free(map); return; }
+    for (int i=0;i<n;i++) {
+        encode_name(names[i], sizeof(names[i]), files[i]);
+        items[i] = (bget_item){ names[i], files[i], NULL, 0 };
+    }
+    bget_find(map, items, n);
+    int retry = 0;
+    for (int i=0;i<n;i++) {
+        const char *base = strrchr(files[i], '/');
+        if (items[i].e || !base) continue;
+        items[i].name = (char *)base + 1;
+        retry = 1;
+    }
+    if (retry) bget_find(map, items, n);
+    for (int i=0;i<n;i++) make_parents(files[i]);
+    get_many(items, n);
+    fmap_free(map);
+    free(items);
+    free(names);
+}
+
+static void cmd_get(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: dfc get <filename>... [--range a-b] | -r <dir>...\n"
+                        "  a path names a file put with its directory, or else one put by itself (by its basename)\n");
+        return;
+    }
+    const char *fname = argv[1];
+    if (argc >= 4 && strcmp(argv[2], "--range") == 0) { cmd_get_range(fname, argv[3]); return; }
+    if (strcmp(fname, "-r") == 0) {
+        for (int i=2;i<argc;i++) get_tree(argv[i]);
+    } else if (argc > 2 || strchr(fname, '/')) {
+        get_list(argc - 1, argv + 1);
+    } else {
+        get_one(fname, fname);
+    }
+}
+
+int main(int argc, char **argv) {
+    // a server closing a session mid-sendfile() fails that transfer, not the client
+    signal(SIGPIPE, SIG_IGN);
+    // read dfc.conf in cwd
+    parse_conf("dfc.conf");
+    health_load();
+    if (use_ring && nservers > 0) {
+        const char *names[MAX_SERVERS];
+        int weights[MAX_SERVERS];
+        for (int i=0;i<nservers;i++) { names[i] = servers[i].name; weights[i] = servers[i].weight; }
+        // falling back to the rotation would look in the wrong places
+        if (!(ring = ring_new(names, weights, nservers))) {
+            fprintf(stderr, "Cannot build the placement ring\n");
+            return 1;
+        }
+    }
     if (argc < 2) {
         fprintf(stderr, "Usage: dfc <command> [filename]\n");
         return 1;
     }
     if (strcmp(argv[1], "list") == 0) {
-        cmd_list();
+        cmd_list(argc-1, &argv[1]);
     } else if (strcmp(argv[1], "put") == 0) {
         cmd_put(argc-1, &argv[1]);
     } else if (strcmp(argv[1], "get") == 0) {
         cmd_get(argc-1, &argv[1]);
+    } else if (strcmp(argv[1], "rebalance") == 0) {
+        cmd_rebalance(argc-1, &argv[1]);
     } else {
         fprintf(stderr, "Unknown command\n");
         return 1;
     }
+    pool_close_all();
+    health_save();
+    pcache_trim();
     return 0;
 }
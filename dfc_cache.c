@@ -0,0 +1,182 @@
+// dfc_cache.c
+// On-disk piece cache (see dfc_cache.h).
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <openssl/evp.h>
+#include "dfc_cache.h"
+
+#define TMP_PREFIX ".tmp."
+#define TMP_STALE_SEC 3600      // temp files this old belong to a dfc that died
+
+static char cdir[512];
+static uint64_t climit;
+static uint64_t added;          // bytes this process put in
+static unsigned long seq;
+
+struct pcache_entry {
+    int fd;
+    char tmp[600];
+    EVP_MD_CTX *md;
+    uint64_t len;
+};
+
+static void entry_path(char *buf, size_t n, const unsigned char *md5) {
+    int len = snprintf(buf, n, "%s/", cdir);
+    for (int i = 0; i < 16; i++) len += snprintf(buf + len, n - len, "%02x", md5[i]);
+}
+
+int pcache_init(const char *dir, uint64_t limit) {
+    snprintf(cdir, sizeof(cdir), "%s", dir);
+    climit = limit;
+    if (mkdir(cdir, 0755) < 0 && errno != EEXIST) { cdir[0] = 0; return -1; }
+    return 0;
+}
+
+int pcache_enabled() {
+    return cdir[0] != 0;
+}
+
+int pcache_open(const unsigned char *md5, uint64_t size) {
+    char path[600];
+    struct stat st;
+    entry_path(path, sizeof(path), md5);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) < 0 || (uint64_t)st.st_size != size) { close(fd); return -1; }
+    futimens(fd, NULL);     // recency for the LRU
+    return fd;
+}
+
+void pcache_drop(const unsigned char *md5) {
+    char path[600];
+    entry_path(path, sizeof(path), md5);
+    unlink(path);
+}
+
+pcache_entry *pcache_create() {
+    pcache_entry *e = calloc(1, sizeof(*e));
+    if (!e) return NULL;
+    snprintf(e->tmp, sizeof(e->tmp), "%s/" TMP_PREFIX "%ld.%lu", cdir, (long)getpid(),
+             __atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED));
+    e->fd = open(e->tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    e->md = EVP_MD_CTX_new();
+    if (e->fd < 0 || !e->md || !EVP_DigestInit_ex(e->md, EVP_md5(), NULL)) {
+        pcache_abort(e);
+        return NULL;
+    }
+    return e;
+}
+
+int pcache_reset(pcache_entry *e) {
+    e->len = 0;
+    return ftruncate(e->fd, 0) == 0 && EVP_DigestInit_ex(e->md, EVP_md5(), NULL) ? 0 : -1;
+}
+
+int pcache_write(pcache_entry *e, const void *p, size_t n) {
+    if (!EVP_DigestUpdate(e->md, p, n)) return -1;
+    const char *b = p;
+    while (n) {
+        ssize_t w = pwrite(e->fd, b, n, (off_t)e->len);
+        if (w <= 0) return -1;
+        b += w; n -= w; e->len += w;
+    }
+    return 0;
+}
+
+int pcache_commit(pcache_entry *e) {
+    unsigned char md5[EVP_MAX_MD_SIZE];
+    char path[600];
+    int rc = EVP_DigestFinal_ex(e->md, md5, NULL) ? 0 : -1;
+    if (close(e->fd) != 0) rc = -1;
+    e->fd = -1;
+    if (rc == 0) {
+        entry_path(path, sizeof(path), md5);
+        // another process may have put the same bytes in first; either copy will do
+        rc = rename(e->tmp, path);
+    }
+    if (rc == 0) {
+        e->tmp[0] = 0;
+        __atomic_fetch_add(&added, e->len, __ATOMIC_RELAXED);
+    }
+    pcache_abort(e);
+    return rc;
+}
+
+void pcache_abort(pcache_entry *e) {
+    if (!e) return;
+    if (e->fd >= 0) close(e->fd);
+    if (e->tmp[0]) unlink(e->tmp);
+    EVP_MD_CTX_free(e->md);
+    free(e);
+}
+
+typedef struct {
+    struct timespec mtime;      // last used
+    uint64_t size;
+    char name[40];
+} centry;
+
+static int by_mtime(const void *a, const void *b) {
+    const centry *x = a, *y = b;
+    if (x->mtime.tv_sec != y->mtime.tv_sec) return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+    return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : x->mtime.tv_nsec > y->mtime.tv_nsec;
+}
+
+static int is_entry(const char *name) {
+    if (strlen(name) != 32) return 0;
+    for (int i = 0; i < 32; i++) if (!strchr("0123456789abcdef", name[i])) return 0;
+    return 1;
+}
+
+void pcache_trim() {
+    char lock[600];
+    if (!cdir[0] || !added) return;
+    snprintf(lock, sizeof(lock), "%s/.lock", cdir);
+    int lfd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    // whoever holds the lock is trimming already
+    if (lfd < 0 || flock(lfd, LOCK_EX | LOCK_NB) < 0) { if (lfd >= 0) close(lfd); return; }
+    DIR *d = opendir(cdir);
+    centry *ents = NULL;
+    size_t n = 0, cap = 0;
+    uint64_t total = 0;
+    time_t now = time(NULL);
+    struct dirent *de;
+    while (d && (de = readdir(d)) != NULL) {
+        struct stat st;
+        if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISREG(st.st_mode)) continue;
+        if (strncmp(de->d_name, TMP_PREFIX, strlen(TMP_PREFIX)) == 0) {
+            if (now - st.st_mtime > TMP_STALE_SEC) unlinkat(dirfd(d), de->d_name, 0);
+            continue;
+        }
+        if (!is_entry(de->d_name)) continue;
+        if (n == cap) {
+            centry *p = realloc(ents, (cap = cap ? cap * 2 : 256) * sizeof(*ents));
+            if (!p) break;
+            ents = p;
+        }
+        ents[n].mtime = st.st_mtim;
+        ents[n].size = st.st_size;
+        memcpy(ents[n].name, de->d_name, 33);
+        total += st.st_size;
+        n++;
+    }
+    if (d && total > climit) {
+        qsort(ents, n, sizeof(*ents), by_mtime);
+        for (size_t i = 0; i < n && total > climit; i++) {
+            if (unlinkat(dirfd(d), ents[i].name, 0) == 0) total -= ents[i].size;
+        }
+    }
+    if (d) closedir(d);
+    free(ents);
+    close(lfd);
+}
@@ -0,0 +1,42 @@
+// dfc_cache.h
+// On-disk piece cache for dfc get ("cache <dir> [<size>]" in dfc.conf).
+//
+// Pieces are kept by content: <dir>/<md5 hex> holds bytes that hash to that
+// MD5, so an entry can never be stale, only unused. A get learns the MD5 a
+// piece should have (from the manifest, or a STAT to a holder) and fetches
+// the body only if no entry has it. Several dfc processes may share one
+// directory: entries appear whole by rename(), a hit marks its entry used by
+// touching the mtime, and the size limit is enforced by evicting the least
+// recently used entries under an flock(), one process at a time. An entry
+// evicted while another process reads it stays readable until closed.
+
+#ifndef DFC_CACHE_H
+#define DFC_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct pcache_entry pcache_entry;
+
+// creates dir if need be; limit is the size it is trimmed to. 0 on success
+int pcache_init(const char *dir, uint64_t limit);
+int pcache_enabled();
+
+// open fd on the entry for md5 if it holds size bytes (and marks it used), else -1
+int pcache_open(const unsigned char *md5, uint64_t size);
+
+// removes an entry found damaged
+void pcache_drop(const unsigned char *md5);
+
+/* A new entry is written to a temp file, hashing as it goes, and is only
+   named by its MD5 at commit. reset starts it over (a fetch that restarted). */
+pcache_entry *pcache_create();
+int pcache_reset(pcache_entry *e);
+int pcache_write(pcache_entry *e, const void *p, size_t n);
+int pcache_commit(pcache_entry *e);     // frees e; 0 if the entry is in place
+void pcache_abort(pcache_entry *e);
+
+// evicts least recently used entries past the limit if this process added any
+void pcache_trim();
+
+#endif
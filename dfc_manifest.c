@@ -0,0 +1,87 @@
+// dfc_manifest.c
+// Manifest text form (see dfc_manifest.h).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dfc_manifest.h"
+
+size_t manifest_format(const manifest_t *m, char *buf, size_t cap) {
+    size_t n = snprintf(buf, cap, "dfs-manifest 1\nsize %llu\n", (unsigned long long)m->size);
+    if (m->ec_k && n < cap) {
+        n += snprintf(buf + n, cap - n, "ec %d %d %llu\n", m->ec_k, m->ec_m, (unsigned long long)m->shard_len);
+    }
+    for (int k = 0; k < m->npieces && n < cap; k++) {
+        const mpiece_t *p = &m->piece[k];
+        n += snprintf(buf + n, cap - n, "piece %d %llu %llu ", k + 1,
+                      (unsigned long long)p->off, (unsigned long long)p->len);
+        for (int i = 0; i < 16 && n < cap; i++) n += snprintf(buf + n, cap - n, "%02x", p->md5[i]);
+        for (int h = 0; h < p->nholders && n < cap; h++) {
+            n += snprintf(buf + n, cap - n, "%c%s", h ? ',' : ' ', p->holders[h]);
+        }
+        if (n < cap) n += snprintf(buf + n, cap - n, "\n");
+    }
+    return n < cap ? n : 0;
+}
+
+static int parse_hex(const char *s, unsigned char *out) {
+    if (strlen(s) != 32) return -1;
+    for (int i = 0; i < 16; i++) {
+        unsigned v;
+        if (sscanf(s + 2 * i, "%2x", &v) != 1) return -1;
+        out[i] = v;
+    }
+    return 0;
+}
+
+int manifest_parse(manifest_t *m, const char *buf, size_t len) {
+    char line[1024];
+    int version = 0, have_size = 0;
+    memset(m, 0, sizeof(*m));
+    while (len) {
+        const char *nl = memchr(buf, '\n', len);
+        size_t L = nl ? (size_t)(nl - buf) : len;
+        if (L >= sizeof(line)) return -1;
+        memcpy(line, buf, L);
+        line[L] = 0;
+        buf += nl ? L + 1 : L;
+        len -= nl ? L + 1 : L;
+
+        unsigned long long a, b;
+        int k;
+        char hex[40], holders[800];
+        if (sscanf(line, "dfs-manifest %d", &version) == 1) continue;
+        if (sscanf(line, "size %llu", &a) == 1) { m->size = a; have_size = 1; continue; }
+        if (sscanf(line, "ec %d %d %llu", &m->ec_k, &m->ec_m, &a) == 3) { m->shard_len = a; continue; }
+        if (sscanf(line, "piece %d %llu %llu %39s %799s", &k, &a, &b, hex, holders) != 5) continue;
+        if (k != m->npieces + 1 || k > MANIFEST_MAX_PIECES) return -1;
+        mpiece_t *p = &m->piece[k - 1];
+        p->off = a;
+        p->len = b;
+        if (parse_hex(hex, p->md5) < 0) return -1;
+        char *save;
+        for (char *s = strtok_r(holders, ",", &save); s && p->nholders < MANIFEST_MAX_HOLDERS; s = strtok_r(NULL, ",", &save)) {
+            snprintf(p->holders[p->nholders++], sizeof(p->holders[0]), "%s", s);
+        }
+        m->npieces = k;
+    }
+    if (version != 1 || !have_size || !m->npieces) return -1;
+    if (m->ec_k) {
+        if (m->ec_k < 1 || m->ec_m < 1 || m->ec_k + m->ec_m != m->npieces) return -1;
+        uint64_t total = 0;
+        for (int k = 0; k < m->npieces; k++) {
+            const mpiece_t *p = &m->piece[k];
+            if (k < m->ec_k ? p->off != k * m->shard_len || p->len > m->shard_len
+                            : p->off != 0 || p->len != m->shard_len) return -1;
+            if (k < m->ec_k) total += p->len;
+        }
+        return total == m->size ? 0 : -1;
+    }
+    // pieces must tile the file
+    uint64_t off = 0;
+    for (int k = 0; k < m->npieces; k++) {
+        if (m->piece[k].off != off) return -1;
+        off += m->piece[k].len;
+    }
+    return off == m->size ? 0 : -1;
+}
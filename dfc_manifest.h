@@ -0,0 +1,49 @@
+// dfc_manifest.h
+// Per-file manifest written by dfc put and read back by dfc get.
+//
+// Records the file size and, for each piece, its offset, length, MD5 and the
+// servers (by name from dfc.conf) that were sent a copy. It is stored as an
+// ordinary chunk "<file>.m" on every server, in a small text form:
+//
+//   dfs-manifest 1
+//   size <bytes>
+//   [ec <k> <m> <shard bytes>]
+//   piece <k> <offset> <length> <md5 hex> <server>[,<server>...]
+//
+// Replicated files have pieces that tile the file. Erasure-coded ones ("ec"
+// line) have k data shards, shard i holding the file bytes from i * shard
+// bytes (the last ones may be short or empty, and count as zero-padded),
+// followed by m parity shards of shard bytes each with offset 0.
+
+#ifndef DFC_MANIFEST_H
+#define DFC_MANIFEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MANIFEST_MAX_PIECES 32
+#define MANIFEST_MAX_HOLDERS 4
+#define MANIFEST_MAX_BYTES 16384    // largest manifest accepted from a server
+
+typedef struct {
+    uint64_t off, len;
+    unsigned char md5[16];
+    int nholders;
+    char holders[MANIFEST_MAX_HOLDERS][128];
+} mpiece_t;
+
+typedef struct {
+    uint64_t size;
+    int ec_k, ec_m;                 // 0 for replicated files
+    uint64_t shard_len;
+    int npieces;                    // pieces 1..npieces are piece[0..npieces-1]
+    mpiece_t piece[MANIFEST_MAX_PIECES];
+} manifest_t;
+
+// text form into buf; returns its length, or 0 if it does not fit
+size_t manifest_format(const manifest_t *m, char *buf, size_t cap);
+
+// 0 on success, -1 if buf is not a well-formed manifest
+int manifest_parse(manifest_t *m, const char *buf, size_t len);
+
+#endif
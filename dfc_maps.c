@@ -0,0 +1,157 @@
+// dfc_maps.c
+// Arena-backed open-addressing hash map (see dfc_maps.h).
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "dfc_maps.h"
+
+#define ARENA_BLOCK (256 * 1024)
+#define MIN_SLOTS 1024
+
+/* entry layout in the arena: header, value (valsz bytes), key, NUL.
+   next links entries in insertion order. */
+typedef struct entry {
+    struct entry *next;
+    uint32_t klen;
+} entry_t;
+
+typedef struct {
+    uint64_t hash;      // 0 marks an empty slot
+    entry_t *e;
+} slot_t;
+
+typedef struct block {
+    struct block *next;
+    size_t used, cap;
+    char data[];
+} block_t;
+
+struct fmap {
+    slot_t *slots;
+    size_t nslots;      // power of two
+    size_t count;
+    size_t valsz;       // rounded up to keep keys and headers aligned
+    block_t *blocks;
+    entry_t *first, *last;
+};
+
+// FNV-1a; 0 is reserved for empty slots
+static uint64_t hash_key(const char *k, size_t n) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)k[i];
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+static void *arena_alloc(fmap_t *m, size_t n) {
+    n = (n + 7) & ~(size_t)7;
+    block_t *b = m->blocks;
+    if (!b || b->cap - b->used < n) {
+        size_t cap = n > ARENA_BLOCK ? n : ARENA_BLOCK;
+        b = malloc(sizeof(block_t) + cap);
+        if (!b) return NULL;
+        b->next = m->blocks;
+        b->used = 0;
+        b->cap = cap;
+        m->blocks = b;
+    }
+    void *p = b->data + b->used;
+    b->used += n;
+    return p;
+}
+
+static void *entry_val(entry_t *e) { return e + 1; }
+
+static char *entry_key(const fmap_t *m, entry_t *e) { return (char *)(e + 1) + m->valsz; }
+
+fmap_t *fmap_new(size_t valsz) {
+    fmap_t *m = calloc(1, sizeof(*m));
+    if (!m) return NULL;
+    m->valsz = (valsz + 7) & ~(size_t)7;
+    m->nslots = MIN_SLOTS;
+    m->slots = calloc(m->nslots, sizeof(slot_t));
+    if (!m->slots) { free(m); return NULL; }
+    return m;
+}
+
+void fmap_free(fmap_t *m) {
+    if (!m) return;
+    while (m->blocks) {
+        block_t *n = m->blocks->next;
+        free(m->blocks);
+        m->blocks = n;
+    }
+    free(m->slots);
+    free(m);
+}
+
+static int grow(fmap_t *m) {
+    size_t n = m->nslots * 2;
+    slot_t *s = calloc(n, sizeof(slot_t));
+    if (!s) return -1;
+    for (size_t i = 0; i < m->nslots; i++) {
+        if (!m->slots[i].hash) continue;
+        size_t j = m->slots[i].hash & (n - 1);
+        while (s[j].hash) j = (j + 1) & (n - 1);
+        s[j] = m->slots[i];
+    }
+    free(m->slots);
+    m->slots = s;
+    m->nslots = n;
+    return 0;
+}
+
+// slot holding key, or the empty slot where it would go
+static slot_t *probe(fmap_t *m, const char *key, size_t klen, uint64_t h) {
+    size_t i = h & (m->nslots - 1);
+    for (;;) {
+        slot_t *s = &m->slots[i];
+        if (!s->hash) return s;
+        if (s->hash == h && s->e->klen == klen && memcmp(entry_key(m, s->e), key, klen) == 0) return s;
+        i = (i + 1) & (m->nslots - 1);
+    }
+}
+
+void *fmap_find(fmap_t *m, const char *key, size_t klen) {
+    slot_t *s = probe(m, key, klen, hash_key(key, klen));
+    return s->hash ? entry_val(s->e) : NULL;
+}
+
+void *fmap_get(fmap_t *m, const char *key, size_t klen) {
+    uint64_t h = hash_key(key, klen);
+    slot_t *s = probe(m, key, klen, h);
+    if (s->hash) return entry_val(s->e);
+    // keep the load factor under 3/4
+    if ((m->count + 1) * 4 > m->nslots * 3) {
+        if (grow(m) < 0) return NULL;
+        s = probe(m, key, klen, h);
+    }
+    entry_t *e = arena_alloc(m, sizeof(entry_t) + m->valsz + klen + 1);
+    if (!e) return NULL;
+    e->next = NULL;
+    e->klen = klen;
+    memset(entry_val(e), 0, m->valsz);
+    memcpy(entry_key(m, e), key, klen);
+    entry_key(m, e)[klen] = 0;
+    if (m->last) m->last->next = e; else m->first = e;
+    m->last = e;
+    s->hash = h;
+    s->e = e;
+    m->count++;
+    return entry_val(e);
+}
+
+size_t fmap_count(const fmap_t *m) {
+    return m->count;
+}
+
+void *fmap_next(fmap_t *m, void **it, const char **key) {
+    entry_t *e = *it ? ((entry_t *)*it)->next : m->first;
+    *it = e;
+    if (!e) return NULL;
+    *key = entry_key(m, e);
+    return entry_val(e);
+}
@@ -0,0 +1,33 @@
+// dfc_maps.h
+// String-keyed hash map for aggregating server listings in dfc.
+//
+// Open addressing with linear probing. Each slot holds the key's hash and a
+// pointer to its entry; entries (a fixed-size value followed by the key) are
+// carved out of an arena, so inserting never mallocs per key and the whole map
+// is released at once. Values start zeroed. Iteration visits entries in
+// insertion order.
+
+#ifndef DFC_MAPS_H
+#define DFC_MAPS_H
+
+#include <stddef.h>
+
+typedef struct fmap fmap_t;
+
+// valsz: bytes of value stored with each key
+fmap_t *fmap_new(size_t valsz);
+void fmap_free(fmap_t *m);
+
+// value for key[0..klen), inserting a zeroed one if absent; NULL on allocation failure
+void *fmap_get(fmap_t *m, const char *key, size_t klen);
+
+// value for key, or NULL if absent
+void *fmap_find(fmap_t *m, const char *key, size_t klen);
+
+size_t fmap_count(const fmap_t *m);
+
+/* iteration: set *it = NULL, then call until it returns NULL.
+   *key points at the NUL-terminated key, valid until fmap_free. */
+void *fmap_next(fmap_t *m, void **it, const char **key);
+
+#endif
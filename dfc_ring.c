@@ -0,0 +1,77 @@
+// dfc_ring.c
+// Consistent-hash ring (see dfc_ring.h).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <openssl/evp.h>
+#include "dfc_ring.h"
+
+typedef struct {
+    uint32_t pos;
+    int server;
+} point_t;
+
+struct ring {
+    int npoints;
+    int nservers;
+    point_t points[];
+};
+
+static uint32_t ring_hash(const char *s) {
+    unsigned char d[EVP_MAX_MD_SIZE];
+    unsigned int n;
+    if (!EVP_Digest(s, strlen(s), d, &n, EVP_md5(), NULL)) return 0;
+    return (uint32_t)d[0] << 24 | (uint32_t)d[1] << 16 | (uint32_t)d[2] << 8 | d[3];
+}
+
+// by position; servers break ties so every client builds the same ring
+static int point_cmp(const void *a, const void *b) {
+    const point_t *x = a, *y = b;
+    if (x->pos != y->pos) return x->pos < y->pos ? -1 : 1;
+    return x->server - y->server;
+}
+
+ring_t *ring_new(const char *const *names, const int *weights, int n) {
+    int total = 0;
+    for (int i = 0; i < n; i++) total += weights[i] * RING_VNODES;
+    ring_t *r = malloc(sizeof(*r) + (size_t)total * sizeof(point_t));
+    if (!r) return NULL;
+    r->npoints = 0;
+    r->nservers = n;
+    for (int i = 0; i < n; i++) {
+        for (int v = 0; v < weights[i] * RING_VNODES; v++) {
+            char label[200];
+            snprintf(label, sizeof(label), "%s#%d", names[i], v);
+            r->points[r->npoints].pos = ring_hash(label);
+            r->points[r->npoints++].server = i;
+        }
+    }
+    qsort(r->points, r->npoints, sizeof(point_t), point_cmp);
+    return r;
+}
+
+void ring_free(ring_t *r) {
+    free(r);
+}
+
+int ring_lookup(const ring_t *r, const char *key, int *out, int want) {
+    if (!r->npoints) return 0;
+    if (want > r->nservers) want = r->nservers;
+    uint32_t h = ring_hash(key);
+    // first point at or after h, wrapping past the top
+    int lo = 0, hi = r->npoints;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (r->points[mid].pos < h) lo = mid + 1;
+        else hi = mid;
+    }
+    int got = 0;
+    for (int i = 0; i < r->npoints && got < want; i++) {
+        int s = r->points[(lo + i) % r->npoints].server, seen = 0;
+        for (int j = 0; j < got; j++) if (out[j] == s) seen = 1;
+        if (!seen) out[got++] = s;
+    }
+    return got;
+}
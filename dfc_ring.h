@@ -0,0 +1,28 @@
+// dfc_ring.h
+// Consistent-hash ring for dfc's "ring on" placement.
+//
+// Every server owns weight * RING_VNODES points on a 32-bit circle, at the MD5
+// of "<server name>#<i>". A key hashes onto the circle and belongs to the
+// first distinct servers met walking clockwise from there. Points depend only
+// on server names and weights, so adding or removing a server moves just the
+// keys whose walk now meets (or no longer meets) its points: about 1/N of them.
+
+#ifndef DFC_RING_H
+#define DFC_RING_H
+
+#define RING_VNODES 128     // points per unit of weight
+#define RING_MAX_WEIGHT 64
+
+typedef struct ring ring_t;
+
+/* builds the ring for n servers; names[i] and weights[i] (1..RING_MAX_WEIGHT)
+   describe server i. NULL on allocation failure */
+ring_t *ring_new(const char *const *names, const int *weights, int n);
+void ring_free(ring_t *r);
+
+/* the servers that own key, first owner first: fills out[0..want) with
+   distinct server indexes and returns how many (fewer only if the ring has
+   fewer servers) */
+int ring_lookup(const ring_t *r, const char *key, int *out, int want);
+
+#endif
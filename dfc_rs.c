@@ -0,0 +1,206 @@
+// dfc_rs.c
+// Reed-Solomon erasure code (see dfc_rs.h).
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <immintrin.h>
+#include "dfc_rs.h"
+
+#define GF_POLY 0x11d       // x^8 + x^4 + x^3 + x^2 + 1
+#define RS_BLOCK 16384      // bytes of each shard worked on at a time, to stay in cache
+
+struct rs_code {
+    int k, m;
+    uint8_t enc[RS_MAX_SHARDS][RS_MAX_SHARDS];  // k+m rows of k: identity, then Cauchy
+};
+
+static uint8_t gf_exp[512], gf_log[256];
+static uint8_t gf_mul_tab[256][256];
+static pthread_once_t gf_once = PTHREAD_ONCE_INIT;
+
+static void gf_init() {
+    int x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = gf_exp[i + 255] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100) x ^= GF_POLY;
+    }
+    for (int a = 1; a < 256; a++) {
+        for (int b = 1; b < 256; b++) gf_mul_tab[a][b] = gf_exp[gf_log[a] + gf_log[b]];
+    }
+}
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) { return gf_mul_tab[a][b]; }
+
+static uint8_t gf_inv(uint8_t a) { return gf_exp[255 - gf_log[a]]; }
+
+/* region kernels: dst[i] ^= c * src[i] */
+
+static void mul_add_scalar(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n) {
+    const uint8_t *t = gf_mul_tab[c];
+    for (size_t i = 0; i < n; i++) dst[i] ^= t[src[i]];
+}
+
+static void nibble_tables(uint8_t c, uint8_t *lo, uint8_t *hi) {
+    for (int x = 0; x < 16; x++) {
+        lo[x] = gf_mul(c, x);
+        hi[x] = gf_mul(c, x << 4);
+    }
+}
+
+__attribute__((target("ssse3")))
+static void mul_add_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n) {
+    uint8_t lo[16], hi[16];
+    nibble_tables(c, lo, hi);
+    __m128i tlo = _mm_loadu_si128((const __m128i *)lo);
+    __m128i thi = _mm_loadu_si128((const __m128i *)hi);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i l = _mm_and_si128(s, mask);
+        __m128i h = _mm_and_si128(_mm_srli_epi16(s, 4), mask);
+        __m128i p = _mm_xor_si128(_mm_shuffle_epi8(tlo, l), _mm_shuffle_epi8(thi, h));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(_mm_loadu_si128((const __m128i *)(dst + i)), p));
+    }
+    mul_add_scalar(dst + i, src + i, c, n - i);
+}
+
+__attribute__((target("avx2")))
+static void mul_add_avx2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n) {
+    uint8_t lo[16], hi[16];
+    nibble_tables(c, lo, hi);
+    __m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+    __m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i l = _mm256_and_si256(s, mask);
+        __m256i h = _mm256_and_si256(_mm256_srli_epi16(s, 4), mask);
+        __m256i p = _mm256_xor_si256(_mm256_shuffle_epi8(tlo, l), _mm256_shuffle_epi8(thi, h));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(dst + i)), p));
+    }
+    mul_add_scalar(dst + i, src + i, c, n - i);
+}
+
+static const struct {
+    const char *name;
+    void (*fn)(uint8_t *, const uint8_t *, uint8_t, size_t);
+} kernels[] = {
+    { "avx2", mul_add_avx2 },
+    { "ssse3", mul_add_ssse3 },
+    { "scalar", mul_add_scalar },
+};
+
+static int kernel = -1;
+
+static int cpu_has(int i) {
+    __builtin_cpu_init();
+    if (i == 0) return __builtin_cpu_supports("avx2");
+    if (i == 1) return __builtin_cpu_supports("ssse3");
+    return 1;
+}
+
+static void rs_init() {
+    gf_init();
+    for (kernel = 0; !cpu_has(kernel); kernel++) ;
+}
+
+const char *rs_impl() {
+    pthread_once(&gf_once, rs_init);
+    return kernels[kernel].name;
+}
+
+int rs_set_impl(const char *name) {
+    pthread_once(&gf_once, rs_init);
+    for (int i = 0; i < (int)(sizeof(kernels) / sizeof(kernels[0])); i++) {
+        if (strcmp(kernels[i].name, name) == 0 && cpu_has(i)) { kernel = i; return 0; }
+    }
+    return -1;
+}
+
+static void mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n) {
+    if (c) kernels[kernel].fn(dst, src, c, n);
+}
+
+rs_code *rs_new(int k, int m) {
+    if (k < 1 || m < 1 || k + m > RS_MAX_SHARDS) return NULL;
+    pthread_once(&gf_once, rs_init);
+    rs_code *rs = calloc(1, sizeof(*rs));
+    if (!rs) return NULL;
+    rs->k = k;
+    rs->m = m;
+    for (int i = 0; i < k; i++) rs->enc[i][i] = 1;
+    // Cauchy rows: 1 / (x_j + y_i) with x_j = k + j and y_i = i, all distinct
+    for (int j = 0; j < m; j++) {
+        for (int i = 0; i < k; i++) rs->enc[k + j][i] = gf_inv((uint8_t)((k + j) ^ i));
+    }
+    return rs;
+}
+
+void rs_free(rs_code *rs) {
+    free(rs);
+}
+
+void rs_encode(const rs_code *rs, const unsigned char *const *data, unsigned char *const *parity, size_t len) {
+    for (size_t off = 0; off < len; off += RS_BLOCK) {
+        size_t n = len - off < RS_BLOCK ? len - off : RS_BLOCK;
+        for (int j = 0; j < rs->m; j++) {
+            memset(parity[j] + off, 0, n);
+            for (int i = 0; i < rs->k; i++) mul_add(parity[j] + off, data[i] + off, rs->enc[rs->k + j][i], n);
+        }
+    }
+}
+
+// Gauss-Jordan over GF(2^8); a is destroyed. -1 if singular
+static int invert(uint8_t a[][RS_MAX_SHARDS], uint8_t inv[][RS_MAX_SHARDS], int n) {
+    memset(inv, 0, sizeof(inv[0]) * n);
+    for (int i = 0; i < n; i++) inv[i][i] = 1;
+    for (int col = 0; col < n; col++) {
+        int p = col;
+        while (p < n && !a[p][col]) p++;
+        if (p == n) return -1;
+        if (p != col) {
+            uint8_t t[RS_MAX_SHARDS];
+            memcpy(t, a[p], sizeof(t)); memcpy(a[p], a[col], sizeof(t)); memcpy(a[col], t, sizeof(t));
+            memcpy(t, inv[p], sizeof(t)); memcpy(inv[p], inv[col], sizeof(t)); memcpy(inv[col], t, sizeof(t));
+        }
+        uint8_t s = gf_inv(a[col][col]);
+        for (int j = 0; j < n; j++) { a[col][j] = gf_mul(a[col][j], s); inv[col][j] = gf_mul(inv[col][j], s); }
+        for (int r = 0; r < n; r++) {
+            uint8_t f = a[r][col];
+            if (r == col || !f) continue;
+            for (int j = 0; j < n; j++) {
+                a[r][j] ^= gf_mul(f, a[col][j]);
+                inv[r][j] ^= gf_mul(f, inv[col][j]);
+            }
+        }
+    }
+    return 0;
+}
+
+int rs_reconstruct(const rs_code *rs, unsigned char *const *shards, const int *present, size_t len) {
+    int k = rs->k, n = rs->k + rs->m;
+    int rows[RS_MAX_SHARDS], nr = 0, data_missing = 0;
+    for (int i = 0; i < n && nr < k; i++) if (present[i]) rows[nr++] = i;
+    if (nr < k) return -1;
+    for (int i = 0; i < k; i++) if (!present[i]) data_missing = 1;
+    if (!data_missing) return 0;
+    // data = inverse of the present rows' matrix * present shards
+    uint8_t sub[RS_MAX_SHARDS][RS_MAX_SHARDS], inv[RS_MAX_SHARDS][RS_MAX_SHARDS];
+    for (int r = 0; r < k; r++) memcpy(sub[r], rs->enc[rows[r]], sizeof(sub[r]));
+    if (invert(sub, inv, k) < 0) return -1;
+    for (size_t off = 0; off < len; off += RS_BLOCK) {
+        size_t bn = len - off < RS_BLOCK ? len - off : RS_BLOCK;
+        for (int i = 0; i < k; i++) {
+            if (present[i]) continue;
+            memset(shards[i] + off, 0, bn);
+            for (int r = 0; r < k; r++) mul_add(shards[i] + off, shards[rows[r]] + off, inv[i][r], bn);
+        }
+    }
+    return 0;
+}
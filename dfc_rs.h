@@ -0,0 +1,39 @@
+// dfc_rs.h
+// Systematic Reed-Solomon erasure code over GF(2^8) for dfc's "ec" mode.
+//
+// k data shards plus m parity shards; any k of the k+m rebuild the rest. The
+// parity rows form a Cauchy matrix, so every k x k submatrix of the encoding
+// matrix is invertible. Region arithmetic is the split-nibble table method:
+// c*b = lo[b & 15] ^ hi[b >> 4], done 32 (AVX2) or 16 (SSSE3) bytes at a time
+// with a byte shuffle, picked at runtime for the CPU.
+
+#ifndef DFC_RS_H
+#define DFC_RS_H
+
+#include <stddef.h>
+
+#define RS_MAX_SHARDS 32
+
+typedef struct rs_code rs_code;
+
+// NULL if k < 1, m < 1 or k + m > RS_MAX_SHARDS
+rs_code *rs_new(int k, int m);
+void rs_free(rs_code *rs);
+
+// parity[j] = row j of the parity matrix applied to data[0..k), len bytes each
+void rs_encode(const rs_code *rs, const unsigned char *const *data, unsigned char *const *parity, size_t len);
+
+/* rebuilds the data shards missing from shards[0..k) (present[i] == 0) in
+   place from any k present shards of the k+m; buffers of present shards and
+   of missing data shards must be len bytes (others may be NULL). Missing
+   parity, if wanted, is rs_encode's job. returns 0, or -1 if fewer than k
+   shards are present. */
+int rs_reconstruct(const rs_code *rs, unsigned char *const *shards, const int *present, size_t len);
+
+// region kernel in use: "avx2", "ssse3" or "scalar"
+const char *rs_impl();
+
+// forces a kernel ("avx2", "ssse3", "scalar"); -1 if the CPU lacks it (benchmarks)
+int rs_set_impl(const char *name);
+
+#endif
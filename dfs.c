@@ -1,32 +1,151 @@
 // dfs.c
 // Minimal DFS server: listens on given port and stores/serves chunk files in given directory.
-// Usage: ./dfs <dirpath> <port>
+// Usage: ./dfs <dirpath> <port> [-f] [-t <threads>] [-c] [-m <cache bytes>[K|M|G]] [-d] [-s <ms>]
+//              [-S <stats file> [-i <seconds>]]
+//
+// Connections are served by an edge-triggered epoll loop that keeps a small
+// state machine per connection. -t N runs N such loops, each on its own thread
+// with its own SO_REUSEPORT listener. -f falls back to forking one process per
+// connection; the child drives the same state machine with poll().
+//
+// Chunk payloads do not pass through user space: GET uses sendfile() and PUT
+// splices socket -> pipe -> chunk file. -c copies through a buffer instead
+// (also the automatic fallback where the kernel refuses to splice, and the
+// path of forwarded PUTs, whose bytes go both to disk and to the next server).
+//
+// A PUT body goes to a temp file (preallocated with fallocate()) and is
+// renamed over the chunk only once all of it is in, so readers see the old
+// chunk or the new one and a PUT cut short changes nothing. -s makes PUTs
+// durable before they are answered: bodies finishing within <ms> of each
+// other are flushed together by one syncer thread (dfs_commit.h); -s 0 syncs
+// whatever is waiting at once. -f children sync each PUT themselves.
+//
+// Connections are persistent: a client may pipeline any number of commands on
+// one socket and replies come back in order. The server closes on EOF.
+// "PROTO 2" switches a session to the binary frames described in dfs_proto.h;
+// frame replies echo the request id.
+//
+// The store is scanned once at startup into an in-memory catalog (see
+// dfs_catalog.h) that PUTs keep current; LIST is served from it.
+//
+// Hot chunks are kept in RAM (dfs_cache.h, -m sets the budget, default 64M,
+// 0 disables) so repeated GETs never touch the filesystem; a PUT drops the
+// cached copy. The cache is shared by the epoll workers; -f children do not
+// live long enough to benefit and go straight to disk. kill -USR1 prints the
+// hit/miss counters.
+//
+// -d stores each distinct chunk body once (dfs_cas.h): names become hard links
+// to objects keyed by SHA-256, and HAVE lets a client skip sending a body the
+// server already holds. PUTs then take the buffer path, to hash the bytes.
+//
+// Chunks may arrive compressed (dfs_codec.h) and are kept that way; sessions
+// that did not ask for the codec are served the decompressed chunk. Compressed
+// chunks stay out of the -d content store and are not delta targets.
+//
+// Every command is counted, with its service time (dispatch until the reply
+// is queued, or a GET body handed to the kernel), in lock-free counters
+// shared by threads and -f children alike (dfs_stats.h). STATS returns them;
+// -S rewrites <stats file> with them as JSON every -i seconds (default 10).
 //
 // Supported commands over TCP (text lines ending in \n):
 // - PUT <chunkname> <len>\n<data>   -> stores chunk in <dirpath>/<chunkname>
-// - LIST\n  -> returns each chunk filename line then "END\n"
-// - GET <chunkname>\n -> returns "OK <len>\n" then data if present, or "ERR\n"
+// - PUT <chunkname> <len> FORWARD <host:port>[,<host:port>...]\n<data>
+//     -> stores the chunk and streams it on to the first server listed (which
+//        forwards it to the rest); "OK" only once every server has stored it
+// - PUT <chunkname> <len> CODEC <codec> <raw size> [FORWARD ...]\n<data>
+//     -> the same, for a body compressed with codec
+// - LIST [PREFIX <p>] [AFTER <name>] [LIMIT <n>] [SIZES]\n
+//     -> returns each chunk filename line (with its size if SIZES) in name
+//        order, then "END\n", or "END <name>\n" if LIMIT cut it short
+// - GET <chunkname>\n -> returns "OK <len>\n" then data if present, or "ERR\n";
+//     "OK <len> <codec> <raw size>\n" for a chunk kept compressed
+// - GET <chunkname> <offset> <len>\n -> "OK <n> SIZE <chunk size>\n" then the
+//     n (at most len) bytes of the chunk from offset on, always uncompressed
+// - PROTO <version> [CODECS <codec>,...]\n -> "OK <version spoken from now on>
+//     [CODECS <the ones this server knows too>]\n"
+// - HAVE <sha256 hex> [<chunkname>]\n -> "OK\n" if that content is stored (-d),
+//     in which case the chunk name, if given, now refers to it; else "ERR\n"
+// - SIGS <chunkname> <block size>\n -> "OK <len>\n" then the chunk's block
+//     signatures, or "ERR\n"
+// - PATCH <chunkname> <len> <new size> <md5 hex>\n<instructions>
+//     -> rebuilds the chunk from its old copy (dfs_delta.h); "OK\n" or "ERR\n"
+// - PUSH <chunkname> <host:port>[,<host:port>...]\n
+//     -> sends this server's copy, as stored, to the servers listed (a PUT
+//        forwarded down them); "OK\n" once every one has stored it
+// - DEL <chunkname>\n -> removes the chunk; "OK\n" or "ERR\n"
+// - STAT <chunkname>\n -> "OK <size> <mtime ns> <md5 hex>\n" (size and MD5 of the
+//     chunk as GET serves it, decompressed) without the data, or "ERR\n"
+// - STATS [JSON]\n -> "OK <len>\n" then per-command counts, errors, bytes and
+//     latency percentiles plus connection and disk gauges, as text or JSON
+// - MPUT <len>\n<records> -> stores each chunk in the records (dfs_proto.h);
+//     "OK <n>\n" then one byte per record, 1 if that chunk was stored
+// - MGET <len>\n<chunk names, one per line> -> "OK <len>\n" then one record
+//     per name: its data (decompressed), or an empty record if it is missing
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <sys/xattr.h>
+#include <sys/eventfd.h>
+#include <dirent.h>
+#include <stddef.h>
 #include <errno.h>
 #include <arpa/inet.h>
-#include <dirent.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include "dfs_proto.h"
+#include "dfs_catalog.h"
+#include "dfs_cache.h"
+#include "dfs_cas.h"
+#include "dfs_delta.h"
+#include "dfs_codec.h"
+#include "dfs_commit.h"
+#include "dfs_stats.h"
+#include <openssl/evp.h>
 
-#define BACKLOG 8
-#define BUF 8192
+#define BACKLOG 4096
+#define BUF 65536
+#define CMD_MAX 1024
+#define MAX_EVENTS 256
+#define MAX_WORKERS 64
+#define IDLE_TIMEOUT_MS 30000
+#define ZC_CHUNK (1 << 20)   // bytes moved per sendfile/splice call
+#define SCAN_THREADS_MAX 16  // stat threads for the startup catalog scan
+#define FWD_BUF (4 * BUF)    // PUT bytes received but not yet forwarded down the chain
+#define TMP_PREFIX ".dfs-tmp."  // PUT and PATCH bodies on their way in; swept at startup
+#define MD5_XATTR "user.dfs.md5"   // "<mtime ns> <size> <md5 hex>": the raw chunk's MD5, for STAT
 
 static char storedir[1024];
+static int port;
+static int fork_mode = 0;
+static int nworkers = 1;
+static int zerocopy = 1;
+static size_t cache_budget = 64 << 20;  // -m; 0 turns the chunk cache off
+static int catalog_ready = 0;   // fork mode: this child has rescanned the store
+static int dedup = 0;           // -d: content-addressed store
+static int sync_ms = -1;        // -s: PUTs are durable when answered, group-committed over this window
+static const char *stats_file;  // -S: where the counters are dumped every stats_every seconds
+static int stats_every = 10;    // -i
 
 static void usage() {
-    fprintf(stderr, "Usage: dfs <dirpath> <port>\n");
+    fprintf(stderr, "Usage: dfs <dirpath> <port> [-f] [-t <threads>] [-c] [-m <cache bytes>[K|M|G]] [-d] [-s <ms>]\n"
+                    "           [-S <stats file> [-i <seconds>]]\n");
     exit(1);
 }
 
@@ -37,131 +156,1872 @@ static int ensure_dir(const char *d) {
     return -1;
 }
 
-static int handle_client(int cfd) {
-    FILE *f = fdopen(cfd, "r+");
-    if (!f) { close(cfd); return -1; }
-    char line[1024];
-    while (fgets(line, sizeof(line), f)) {
-        // trim
-        char *p = line;
-        while (*p && (*p=='\r' || *p=='\n')) p++;
-        // parse
-        if (strncmp(line, "PUT ", 4) == 0) {
-            char name[512]; unsigned long len;
-            if (sscanf(line+4, "%511s %lu", name, &len) >= 1) {
-                // read len bytes from the socket
-                char path[1400];
-                snprintf(path, sizeof(path), "%s/%s", storedir, name);
-                FILE *wf = fopen(path, "wb");
-                if (!wf) {
-                    fprintf(f, "ERR\n");
-                    fflush(f);
-                    // consume len bytes regardless
-                    size_t toread = len;
-                    char tmp[1024];
-                    while (toread) {
-                        size_t r = fread(tmp,1, (toread>sizeof(tmp)?sizeof(tmp):toread), f);
-                        if (r==0) break;
-                        toread -= r;
-                    }
-                    continue;
-                }
-                size_t left = len;
-                while (left) {
-                    char buf[BUF];
-                    size_t want = left > sizeof(buf) ? sizeof(buf) : left;
-                    size_t r = fread(buf, 1, want, f);
-                    if (r==0) break;
-                    fwrite(buf,1,r,wf);
-                    left -= r;
-                }
-                fclose(wf);
-                fprintf(f, "OK\n");
-                fflush(f);
-            } else {
-                fprintf(f, "ERR\n"); fflush(f);
-            }
-        } else if (strncmp(line, "LIST", 4)==0) {
-            // enumerate files in storedir
-            DIR *d = opendir(storedir);
-            if (d) {
-                struct dirent *ent;
-                while ((ent = readdir(d)) != NULL) {
-                    if (ent->d_type == DT_REG || ent->d_type == DT_LNK || ent->d_type==DT_UNKNOWN) {
-                        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..")==0) continue;
-                        fprintf(f, "%s\n", ent->d_name);
-                    }
-                }
-                closedir(d);
-            }
-            fprintf(f, "END\n");
-            fflush(f);
-        } else if (strncmp(line, "GET ", 4) == 0) {
-            char name[512];
-            if (sscanf(line+4, "%511s", name) == 1) {
-                char path[1400];
-                snprintf(path, sizeof(path), "%s/%s", storedir, name);
-                FILE *rf = fopen(path, "rb");
-                if (!rf) {
-                    fprintf(f, "ERR\n"); fflush(f);
-                } else {
-                    // get size
-                    fseek(rf, 0, SEEK_END);
-                    long len = ftell(rf);
-                    fseek(rf, 0, SEEK_SET);
-                    fprintf(f, "OK %ld\n", len); fflush(f);
-                    char buf[BUF];
-                    while (1) {
-                        size_t r = fread(buf,1,sizeof(buf),rf);
-                        if (r==0) break;
-                        fwrite(buf,1,r,f);
-                        fflush(f);
-                    }
-                    fclose(rf);
-                }
-            } else {
-                fprintf(f, "ERR\n"); fflush(f);
+/* Per-connection state machine.
+   ST_CMD reads a command line, ST_PUT_BODY receives <len> bytes into the chunk
+   file, ST_GET_BODY streams the chunk out; each then returns to ST_CMD for the
+   next pipelined command. ST_DONE closes once replies drain.
+   A forwarded PUT also copies the body into a bounded buffer drained to the
+   next server's socket (reading from the client pauses while it is full), then
+   waits in ST_PUT_CHAIN for that server's reply before answering. The next
+   server's socket sits in the same epoll set as the client's, and stays open
+   for the session's next forwarded PUT.
+   PUSH sends a stored chunk down such a chain from ST_PUSH, reading it from
+   disk instead of the client.
+   With -s a received PUT (or rebuilt PATCH, or MPUT batch) waits in
+   ST_PUT_SYNC, out of the worker's hands, until the syncer has committed it
+   and queued the connection back.
+   conn_step() runs until a socket would block and reports what it waits for. */
+
+enum { ST_CMD, ST_PUT_BODY, ST_PUT_CHAIN, ST_PUT_SYNC, ST_PUSH, ST_GET_BODY, ST_DONE };
+enum { CONN_CLOSE, CONN_WANT_READ, CONN_WANT_WRITE, CONN_WANT_FWD, CONN_WANT_SYNC };
+
+struct worker;
+
+typedef struct conn {
+    int fd;
+    int state;
+    int file;           // chunk being written (PUT) or read (GET), -1 if none
+    char tmp[1100];     // PUT: the temp file being written, "" once renamed or without one
+    uint64_t putlen;    // PUT: body bytes the chunk must end up with
+    commit_item ci;     // -s: the PUT's place in the syncer's queue
+    int sync_done;      // -s: set by the worker once the syncer has handed the PUT back
+    struct worker *worker;  // epoll worker serving the connection, NULL in fork mode
+    struct conn *next;      // on a worker's list of committed PUTs, then of dead connections
+    struct conn *lru_prev, *lru_next;   // on its worker's list of live connections, most recently active first
+    uint64_t active_ms;     // when it last did anything (epoll mode)
+    int failed;         // PUT could not be stored: drain the body, reply ERR
+    int copy;           // zero-copy refused for this chunk, use the buffer path
+    cache_item *item;   // GET body served from the chunk cache instead of file
+    cas_put *cas;       // -d: PUT body being hashed into the content store
+    char *patch;        // PATCH, MPUT, MGET: payload received so far (c->off bytes)
+    int batch_op;       // OP_MPUT or OP_MGET if that is what patch holds, else 0
+    struct mput_rec *recs;  // MPUT: bodies written aside, until they are published
+    size_t nrecs;
+    uint64_t patch_size;            // size and MD5 the rebuilt chunk must have
+    unsigned char patch_md5[16];
+    EVP_MD_CTX *md;     // PUT: MD5 of a raw body taken in through the buffer, NULL if not
+    unsigned char md5[16];  // and the chunk's MD5 once known (PUT, PATCH), kept for STAT
+    int have_md5;
+    int codec;          // PUT: codec of the body (index in dfs_codecs), -1 if raw
+    uint64_t rawlen;    // and the chunk's size once decompressed
+    unsigned codecs;    // codecs the session reads (PROTO), as a mask
+    off_t off;          // position in file
+    size_t left;        // body bytes still to receive or send
+    char name[512];     // chunk being stored (PUT)
+    char in[CMD_MAX];   // command bytes, plus any body bytes that came with them
+    size_t inlen;
+    char *out;          // reply bytes not yet sent
+    size_t outlen, outoff, outcap;
+    int proto;          // 1 text lines, 2 binary frames
+    uint32_t reqid;     // id of the request being served (frames only)
+    int epfd;           // epoll set the connection is in, -1 in fork mode
+    int closed;         // freed at the end of the current epoll batch
+    int fwd;            // socket to the next server in a PUT chain, -1 if none
+    char fwd_to[256];   // its "host:port"
+    int forwarding;     // this PUT goes down the chain
+    int fwd_failed;     // the chain broke: reply ERR once the body is in
+    int fwd_events;     // POLLIN/POLLOUT conn_step waits for on fwd (fork mode)
+    char *fbuf;         // body bytes [foff, fend) not yet forwarded
+    size_t foff, fend;
+    char fin[64];       // the next server's reply line
+    size_t finlen;
+    int stat_slot;      // command being served (index in stat_names), -1 between commands
+    int stat_ok;        // how it was answered
+    uint64_t stat_t0, stat_in, stat_out;    // when it was dispatched, payload bytes each way
+} conn_t;
+
+// a parsed command, from a text line or a frame
+typedef struct {
+    int op;
+    char name[512];
+    char args[CMD_MAX];         // words after the name (or after the verb)
+    unsigned long long len;     // payload bytes that follow (PUT)
+} req_t;
+
+enum { OP_PROTO = 0x40 };       // text-only verb, never sent as a frame
+
+static const struct {
+    const char *verb;
+    int op;
+    int has_name;
+    int has_len;
+} verbs[] = {
+    { "PUT", OP_PUT, 1, 1 },
+    { "GET", OP_GET, 1, 0 },
+    { "LIST", OP_LIST, 0, 0 },
+    { "PROTO", OP_PROTO, 0, 0 },
+    { "HAVE", OP_HAVE, 1, 0 },  // the "name" is the content hash
+    { "SIGS", OP_SIGS, 1, 0 },
+    { "PATCH", OP_PATCH, 1, 1 },
+    { "PUSH", OP_PUSH, 1, 0 },
+    { "DEL", OP_DEL, 1, 0 },
+    { "STATS", OP_STATS, 0, 0 },
+    { "STAT", OP_STAT, 1, 0 },
+    { "MPUT", OP_MPUT, 0, 1 },
+    { "MGET", OP_MGET, 0, 1 },
+};
+
+#define NVERBS (sizeof(verbs) / sizeof(verbs[0]))
+
+// STATS counts per verb; slot 0 is unknown commands
+static const char *stat_names[NVERBS + 1] = { "other" };
+
+static conn_t *conn_new(int fd) {
+    conn_t *c = calloc(1, sizeof(*c));
+    if (!c) return NULL;
+    c->fd = fd;
+    c->file = -1;
+    c->state = ST_CMD;
+    c->proto = 1;
+    c->epfd = -1;
+    c->fwd = -1;
+    c->stat_slot = -1;
+    stats_conn(1);
+    return c;
+}
+
+static void fwd_close(conn_t *c) {
+    if (c->fwd >= 0) close(c->fwd);  // also leaves the epoll set
+    c->fwd = -1;
+    c->fwd_to[0] = 0;
+}
+
+static void mput_drop(conn_t *c);
+
+static void conn_free(conn_t *c) {
+    // a command cut off by the close counts as failed
+    if (c->stat_slot >= 0) stats_request(c->stat_slot, c->stat_t0, 0, c->stat_in, c->stat_out);
+    stats_conn(-1);
+    if (c->file >= 0) close(c->file);
+    if (c->tmp[0]) unlink(c->tmp);
+    cas_put_abort(c->cas);
+    EVP_MD_CTX_free(c->md);
+    free(c->patch);
+    mput_drop(c);
+    fwd_close(c);
+    free(c->fbuf);
+    cache_release(c->item);
+    close(c->fd);
+    free(c->out);
+    free(c);
+}
+
+static int out_reserve(conn_t *c, size_t n) {
+    if (c->outlen + n <= c->outcap) return 0;
+    size_t cap = c->outcap ? c->outcap : 256;
+    while (cap < c->outlen + n) cap *= 2;
+    char *p = realloc(c->out, cap);
+    if (!p) return -1;
+    c->out = p; c->outcap = cap;
+    return 0;
+}
+
+static int out_append(conn_t *c, const void *p, size_t n) {
+    if (out_reserve(c, n) < 0) return -1;
+    memcpy(c->out + c->outlen, p, n);
+    c->outlen += n;
+    return 0;
+}
+
+static int out_printf(conn_t *c, const char *fmt, ...) {
+    char tmp[CMD_MAX];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+    if (n < 0) return -1;
+    if ((size_t)n >= sizeof(tmp)) n = sizeof(tmp) - 1;
+    return out_append(c, tmp, n);
+}
+
+// returns 0 once everything is sent, 1 if the socket is full, -1 on error
+static int out_flush(conn_t *c) {
+    while (c->outoff < c->outlen) {
+        ssize_t w = send(c->fd, c->out + c->outoff, c->outlen - c->outoff, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            return -1;
+        }
+        c->outoff += w;
+    }
+    c->outlen = c->outoff = 0;
+    return 0;
+}
+
+static void chunk_path(char *path, size_t sz, const char *name) {
+    snprintf(path, sz, "%s/%s", storedir, name);
+}
+
+// chunk names come straight off the wire; keep them inside storedir
+static int valid_name(const char *name) {
+    if (!*name || strchr(name, '/')) return 0;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return 0;
+    return 1;
+}
+
+/* Replies (and forwarded PUTs) go out as a header then a sendfile()d or
+   spliced body; with Nagle the body would sit behind the peer's delayed ACK
+   of the header, ~40ms a request. */
+static void set_nodelay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/* Starts a reply: "OK[ info]\n" or "ERR[ info]\n" on text sessions, a reply
+   frame announcing bodylen payload bytes on binary ones. */
+static void reply(conn_t *c, int ok, uint64_t bodylen, const char *info) {
+    c->stat_ok = ok;
+    c->stat_out = bodylen;
+    if (c->proto < 2) {
+        out_printf(c, "%s%s%s\n", ok ? "OK" : "ERR", info ? " " : "", info ? info : "");
+        return;
+    }
+    size_t il = info ? strlen(info) : 0;
+    dfs_hdr h = { OP_REPLY, ok ? 0 : DFS_F_ERR, c->reqid, 0, il, bodylen };
+    unsigned char b[DFS_HDR_LEN];
+    dfs_hdr_pack(b, &h);
+    out_append(c, b, sizeof(b));
+    out_append(c, info, il);
+}
+
+// receive and drop len payload bytes, then reply ERR
+static void skip_body(conn_t *c, unsigned long long len) {
+    c->left = len;
+    c->failed = 1;
+    c->state = ST_PUT_BODY;
+}
+
+/* PUT chains. The next server's socket is connected without waiting (a
+   refused connection shows up as a failed send), and anything that goes wrong
+   with it only marks the chain broken: the body is still stored here. */
+
+// connects to "host:port", or keeps the session's idle socket to it if still good
+static int fwd_open(conn_t *c, const char *to) {
+    if (c->fwd >= 0 && strcmp(c->fwd_to, to) == 0) {
+        char b;
+        // open, with nothing unread
+        if (recv(c->fwd, &b, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    }
+    fwd_close(c);
+    char host[256];
+    snprintf(host, sizeof(host), "%s", to);
+    char *colon = strrchr(host, ':');
+    if (!colon) return -1;
+    *colon = 0;
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0) return -1;
+    int s = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s >= 0 && connect(s, res->ai_addr, res->ai_addrlen) < 0 && errno != EINPROGRESS) { close(s); s = -1; }
+    freeaddrinfo(res);
+    if (s < 0) return -1;
+    set_nodelay(s);
+    if (c->epfd >= 0) {
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = c };
+        if (epoll_ctl(c->epfd, EPOLL_CTL_ADD, s, &ev) < 0) { close(s); return -1; }
+    }
+    c->fwd = s;
+    snprintf(c->fwd_to, sizeof(c->fwd_to), "%s", to);
+    return 0;
+}
+
+static size_t fwd_room(conn_t *c) {
+    return FWD_BUF - (c->fend - c->foff);
+}
+
+// queues n bytes for the next server; the caller keeps within fwd_room()
+static void fwd_append(conn_t *c, const char *p, size_t n) {
+    if (c->fwd_failed) return;
+    if (c->fend + n > FWD_BUF) {
+        memmove(c->fbuf, c->fbuf + c->foff, c->fend - c->foff);
+        c->fend -= c->foff;
+        c->foff = 0;
+    }
+    memcpy(c->fbuf + c->fend, p, n);
+    c->fend += n;
+}
+
+// returns 0 once the buffer is drained (or the chain broke), 1 if the next server's socket is full
+static int fwd_flush(conn_t *c) {
+    while (!c->fwd_failed && c->foff < c->fend) {
+        ssize_t w = send(c->fwd, c->fbuf + c->foff, c->fend - c->foff, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 1;
+        if (w <= 0) { c->fwd_failed = 1; break; }
+        c->foff += w;
+    }
+    c->foff = c->fend = 0;
+    return 0;
+}
+
+// reads the next server's reply line; 1 once it is in (or the chain broke), 0 if it would block
+static int fwd_reply(conn_t *c) {
+    while (!c->fwd_failed) {
+        ssize_t r = recv(c->fwd, c->fin + c->finlen, sizeof(c->fin) - c->finlen, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (r <= 0) { c->fwd_failed = 1; break; }
+        c->finlen += r;
+        char *nl = memchr(c->fin, '\n', c->finlen);
+        if (nl) {
+            // anything after the line means the session is out of step
+            if (strncmp(c->fin, "OK", 2) != 0 || nl + 1 != c->fin + c->finlen) c->fwd_failed = 1;
+            break;
+        }
+        if (c->finlen == sizeof(c->fin)) { c->fwd_failed = 1; break; }
+    }
+    c->finlen = 0;
+    return 1;
+}
+
+/* "FORWARD <next>[,<more>...]": the body goes through the buffer path, led by
+   the same PUT for the next server naming only the servers after it */
+static void start_forward(conn_t *c, req_t *r, char *hops) {
+    char *more = strchr(hops, ',');
+    if (more) *more++ = 0;
+    c->forwarding = 1;
+    c->copy = 1;
+    char cmd[CMD_MAX], codec[64] = "";
+    if (c->codec >= 0) snprintf(codec, sizeof(codec), " CODEC %s %llu", dfs_codecs[c->codec].name, (unsigned long long)c->rawlen);
+    int n = snprintf(cmd, sizeof(cmd), "PUT %s %llu%s%s%s\n", r->name, r->len, codec, more ? " FORWARD " : "", more ? more : "");
+    if ((!c->fbuf && !(c->fbuf = malloc(FWD_BUF))) || n >= (int)sizeof(cmd) || fwd_open(c, hops) < 0) {
+        c->fwd_failed = 1;
+        return;
+    }
+    fwd_append(c, cmd, n);
+}
+
+// a name in the store no other connection or process is using, for a body on its way in
+static void tmp_chunk_path(char *buf, size_t n) {
+    static unsigned long seq;
+    snprintf(buf, n, "%s/" TMP_PREFIX "%ld.%lu", storedir, (long)getpid(), __atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED));
+}
+
+/* the codec a stored chunk is compressed with (-1 if raw, -2 if this server
+   does not know it) and its raw size, read through fd so that they describe
+   the bytes it reads */
+static int chunk_codec(int fd, uint64_t *raw) {
+    char v[64], name[32];
+    unsigned long long r;
+    ssize_t n = fgetxattr(fd, CODEC_XATTR, v, sizeof(v) - 1);
+    if (n <= 0) return -1;
+    v[n] = 0;
+    if (sscanf(v, "%31s %llu", name, &r) != 2) return -2;
+    *raw = r;
+    int i = codec_find(name);
+    return i < 0 ? -2 : i;
+}
+
+// marks a chunk being (re)written as compressed with codec, or as raw
+static int set_codec(int fd, int codec, uint64_t raw) {
+    if (codec < 0) return fremovexattr(fd, CODEC_XATTR) == 0 || errno == ENODATA || errno == ENOTSUP ? 0 : -1;
+    char v[64];
+    int n = snprintf(v, sizeof(v), "%s %llu", dfs_codecs[codec].name, (unsigned long long)raw);
+    return fsetxattr(fd, CODEC_XATTR, v, n, 0);
+}
+
+static void start_put(conn_t *c, req_t *r) {
+    const char *args = r->args;
+    char codec[32];
+    unsigned long long raw;
+    int n;
+    c->codec = -1;
+    if (sscanf(args, "CODEC %31s %llu%n", codec, &raw, &n) == 2) {
+        if ((c->codec = codec_find(codec)) < 0) { skip_body(c, r->len); return; }
+        c->rawlen = raw;
+        args += n;
+    }
+    c->left = r->len;
+    c->off = 0;
+    c->copy = !zerocopy;
+    c->failed = 1;
+    c->forwarding = c->fwd_failed = 0;
+    if (valid_name(r->name)) {
+        // either way the body is written aside and the name switched over once it is all in
+        if (dedup && c->codec < 0) {
+            // hashed on the way in
+            c->cas = cas_put_begin(&c->file);
+            c->copy = 1;
+        } else {
+            tmp_chunk_path(c->tmp, sizeof(c->tmp));
+            c->file = open(c->tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+            if (c->file < 0) c->tmp[0] = 0;
+        }
+        snprintf(c->name, sizeof(c->name), "%s", r->name);
+        c->failed = c->file < 0 || set_codec(c->file, c->codec, c->rawlen) < 0;
+        // the space is taken up front, so a full disk fails the PUT before the body is sent
+        if (!c->failed && r->len && fallocate(c->file, FALLOC_FL_KEEP_SIZE, 0, r->len) < 0 && errno == ENOSPC) c->failed = 1;
+        c->putlen = r->len;
+    }
+    char hops[CMD_MAX];
+    if (!c->failed && sscanf(args, " FORWARD %1023s", hops) == 1) start_forward(c, r, hops);
+    // a raw body read through the buffer is hashed for STAT on its way past; a spliced one is never seen
+    if (!c->failed && c->copy && c->codec < 0 && (c->md = EVP_MD_CTX_new()) && !EVP_DigestInit_ex(c->md, EVP_md5(), NULL)) {
+        EVP_MD_CTX_free(c->md);
+        c->md = NULL;
+    }
+    c->state = ST_PUT_BODY;
+}
+
+// body bytes that may be taken in now: a forwarded PUT is held to the room in its buffer
+static size_t put_room(conn_t *c) {
+    size_t room = c->forwarding && !c->fwd_failed ? fwd_room(c) : c->left;
+    return room < c->left ? room : c->left;
+}
+
+static void put_data(conn_t *c, const char *p, size_t n) {
+    if (c->forwarding) fwd_append(c, p, n);
+    c->left -= n;
+    if (c->failed) return;
+    if (c->patch) {
+        memcpy(c->patch + c->off, p, n);
+        c->off += n;
+        return;
+    }
+    if (c->cas) cas_put_update(c->cas, p, n);
+    if (c->md) EVP_DigestUpdate(c->md, p, n);
+    while (n) {
+        ssize_t w = pwrite(c->file, p, n, c->off);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            c->failed = 1;
+            return;
+        }
+        p += w; n -= w; c->off += w;
+    }
+}
+
+/* Each worker (or forked child) owns one pipe for PUT splicing. It is always
+   emptied into the chunk file before the worker moves on, so connections can
+   share it. */
+static __thread int zc_pipe[2] = { -1, -1 };
+
+static int *zc_get_pipe() {
+    if (zc_pipe[0] < 0) {
+        if (pipe2(zc_pipe, O_CLOEXEC) < 0) return NULL;
+        fcntl(zc_pipe[1], F_SETPIPE_SZ, ZC_CHUNK);  // best effort
+    }
+    return zc_pipe;
+}
+
+static void zc_discard(int pfd, size_t n) {
+    char tmp[4096];
+    while (n) {
+        ssize_t r = read(pfd, tmp, n < sizeof(tmp) ? n : sizeof(tmp));
+        if (r <= 0) break;
+        n -= r;
+    }
+}
+
+// socket -> pipe -> chunk file; returns >0 on progress, 0 would block, -1 peer gone
+static ssize_t put_splice(conn_t *c) {
+    int *p = zc_get_pipe();
+    if (!p) { c->copy = 1; return 1; }
+    size_t want = c->left < ZC_CHUNK ? c->left : ZC_CHUNK;
+    ssize_t n = splice(c->fd, NULL, p[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n == 0) return -1;
+    if (n < 0) {
+        if (errno == EINTR) return 1;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        if (errno == EINVAL || errno == ENOSYS) { c->copy = 1; return 1; }
+        return -1;
+    }
+    c->left -= n;
+    while (n > 0) {
+        ssize_t w = splice(p[0], NULL, c->file, &c->off, n, SPLICE_F_MOVE);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) {
+            // out of space or a filesystem that cannot splice: fail this PUT, keep the session
+            c->failed = 1;
+            zc_discard(p[0], n);
+            break;
+        }
+        n -= w;
+    }
+    return 1;
+}
+
+static int apply_patch(conn_t *c);
+static void finish_batch(conn_t *c);
+
+static conn_t *conn_of(commit_item *it) {
+    return (conn_t *)((char *)it - offsetof(conn_t, ci));
+}
+
+/* the MD5_XATTR value for a chunk whose raw bytes hash to md5; a chunk is
+   only ever replaced, never written in place, so a stamp (mtime, size) gone
+   stale means a new file */
+static int md5_stamp(char *v, size_t cap, const struct stat *st, const unsigned char *md5) {
+    int len = snprintf(v, cap, "%lld %llu ", (long long)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec,
+                       (unsigned long long)st->st_size);
+    for (int i = 0; i < 16; i++) len += snprintf(v + len, cap - len, "%02x", md5[i]);
+    return len;
+}
+
+// stamps a chunk just stored, best effort: without it STAT hashes the chunk later
+static void md5_keep(const char *path, const struct stat *st, const unsigned char *md5) {
+    char v[128];
+    setxattr(path, MD5_XATTR, v, md5_stamp(v, sizeof(v), st, md5), 0);
+}
+
+// puts a received body in place of the old chunk; 0 on success
+static int put_publish(commit_item *it) {
+    conn_t *c = conn_of(it);
+    char path[1600];
+    struct stat st;
+    int rc;
+    chunk_path(path, sizeof(path), c->name);
+    if (c->cas) {
+        rc = cas_put_commit(c->cas, path);
+        c->cas = NULL;
+    } else if ((rc = rename(c->tmp, path)) == 0) {
+        c->tmp[0] = 0;
+    }
+    // by name: a body the content store already held was dropped for the stored object
+    if (rc == 0 && stat(path, &st) == 0) {
+        catalog_put(c->name, st.st_size, (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec);
+        if (c->have_md5) md5_keep(path, &st, c->md5);
+    }
+    // the old chunk may be cached
+    cache_invalidate(c->name);
+    return rc;
+}
+
+// answers a PUT, dropping whatever of its body was not published
+static void put_done(conn_t *c, int ok) {
+    cas_put_abort(c->cas);
+    c->cas = NULL;
+    if (c->tmp[0]) { unlink(c->tmp); c->tmp[0] = 0; }
+    if (c->file >= 0) { close(c->file); c->file = -1; }
+    EVP_MD_CTX_free(c->md);
+    c->md = NULL;
+    c->have_md5 = 0;
+    reply(c, ok && !(c->forwarding && c->fwd_failed), 0, NULL);
+    if (c->fwd_failed) fwd_close(c);
+    c->forwarding = c->fwd_failed = 0;
+    c->state = ST_CMD;
+}
+
+static void put_committed(commit_item *it, int rc);
+
+static void finish_put(conn_t *c) {
+    if (c->batch_op) {
+        finish_batch(c);
+        return;
+    }
+    struct stat st;
+    if (c->patch) {
+        // the rebuilt chunk is then published like a PUT body
+        if (!c->failed && apply_patch(c) < 0) c->failed = 1;
+        memcpy(c->md5, c->patch_md5, 16);
+        c->have_md5 = 1;
+        free(c->patch);
+        c->patch = NULL;
+    } else if (!c->failed && (fstat(c->file, &st) < 0 || (uint64_t)st.st_size != c->putlen)) {
+        // a body cut short (or a failed write) never replaces the old chunk
+        c->failed = 1;
+    }
+    if (c->md) c->have_md5 = EVP_DigestFinal_ex(c->md, c->md5, NULL);
+    if (c->failed) {
+        put_done(c, 0);
+    } else if (sync_ms < 0) {
+        put_done(c, put_publish(&c->ci) == 0);
+    } else if (!c->worker) {
+        // a forked child serves no one else while it waits for the disk
+        put_done(c, fdatasync(c->file) == 0 && put_publish(&c->ci) == 0 && syncfs(c->file) == 0);
+    } else {
+        c->ci.publish = put_publish;
+        c->ci.done = put_committed;
+        c->sync_done = 0;
+        c->state = ST_PUT_SYNC;
+        commit_submit(&c->ci);
+    }
+}
+
+typedef struct {
+    conn_t *c;
+    int sizes;
+    char last[512];     // resume point if the listing is cut short
+} list_ctx;
+
+static int list_line(void *arg, const char *name, const cat_info *info) {
+    list_ctx *l = arg;
+    // a -f child's catalog is scanned from disk, PUTs in flight included
+    if (strncmp(name, TMP_PREFIX, strlen(TMP_PREFIX)) == 0) return 0;
+    if (l->sizes) out_printf(l->c, "%s %llu\n", name, (unsigned long long)info->size);
+    else out_printf(l->c, "%s\n", name);
+    snprintf(l->last, sizeof(l->last), "%s", name);
+    return 0;
+}
+
+/* LIST [PREFIX <p>] [AFTER <name>] [LIMIT <n>] [SIZES]
+   answers from the catalog in name order. Text sessions get one line per chunk
+   and "END", or "END <name>" when LIMIT cut the listing short (pass it back as
+   AFTER for the next page); frames carry the same lines as payload and the
+   resume name as reply info, so the header is patched once the listing is
+   complete. */
+static void start_list(conn_t *c, req_t *r) {
+    char prefix[512] = "", after[512] = "", word[16];
+    unsigned long limit = 0;
+    list_ctx l = { c, 0, "" };
+    const char *p = r->args;
+    int n;
+    while (sscanf(p, "%15s%n", word, &n) == 1) {
+        p += n;
+        if (strcmp(word, "PREFIX") == 0 && sscanf(p, " %511s%n", prefix, &n) == 1) p += n;
+        else if (strcmp(word, "AFTER") == 0 && sscanf(p, " %511s%n", after, &n) == 1) p += n;
+        else if (strcmp(word, "LIMIT") == 0 && sscanf(p, " %lu%n", &limit, &n) == 1) p += n;
+        else if (strcmp(word, "SIZES") == 0) l.sizes = 1;
+    }
+    if (fork_mode && !catalog_ready) {
+        // forked children cannot share one catalog; each builds its own on first use
+        catalog_load(storedir, 1);
+        catalog_ready = 1;
+    }
+    size_t hpos = c->outlen;
+    if (c->proto >= 2) reply(c, 1, 0, NULL);
+    size_t body = c->outlen;
+    int more;
+    catalog_list(prefix[0] ? prefix : NULL, after[0] ? after : NULL, limit, &more, list_line, &l);
+    const char *cursor = more ? l.last : "";
+    if (c->proto >= 2) {
+        size_t il = strlen(cursor);
+        // the reply info goes between header and lines
+        if (il && out_reserve(c, il) == 0) {
+            memmove(c->out + body + il, c->out + body, c->outlen - body);
+            memcpy(c->out + body, cursor, il);
+            c->outlen += il;
+            body += il;
+        } else {
+            il = 0;
+        }
+        dfs_hdr h = { OP_REPLY, 0, c->reqid, 0, il, c->outlen - body };
+        dfs_hdr_pack((unsigned char *)c->out + hpos, &h);
+    } else {
+        if (cursor[0]) out_printf(c, "END %s\n", cursor);
+        else out_printf(c, "END\n");
+    }
+    c->stat_out = c->outlen - body;
+    c->state = ST_CMD;
+}
+
+typedef struct {
+    conn_t *c;
+    uint64_t skip;  // decompressed bytes before the range asked for
+    size_t end;     // where the body may grow to in c->out
+} inflate_ctx;
+
+static int inflate_out(void *arg, const unsigned char *p, size_t n) {
+    inflate_ctx *x = arg;
+    size_t s = x->skip < n ? x->skip : n;
+    x->skip -= s; p += s; n -= s;
+    if (n > x->end - x->c->outlen) n = x->end - x->c->outlen;   // past the range: dropped
+    memcpy(x->c->out + x->c->outlen, p, n);
+    x->c->outlen += n;
+    return 0;
+}
+
+// decompresses a chunk (item, or len bytes of fd) through inflate_out; 0 on success
+static int inflate_chunk(const dfs_codec *cd, cache_item *item, int fd, size_t len, inflate_ctx *x) {
+    codec_stream *st = cd->dec_new();
+    int ok = st != NULL;
+    if (ok && item) {
+        const unsigned char *data = cache_data(item, &len);
+        ok = cd->dec_update(st, data, len, inflate_out, x) == 0;
+    } else if (ok) {
+        char buf[BUF];
+        for (off_t off = 0; ok && (size_t)off < len;) {
+            ssize_t n = pread(fd, buf, sizeof(buf), off);
+            ok = n > 0 && cd->dec_update(st, (unsigned char *)buf, n, inflate_out, x) == 0;
+            off += n;
+        }
+    }
+    if (st && cd->dec_end(st) < 0) ok = 0;
+    return ok ? 0 : -1;
+}
+
+/* answers a GET for a compressed chunk on a session that does not read its
+   codec, or for part of one: the chunk (in c->item or fd, len bytes) is
+   decompressed straight into the reply, keeping raw bytes [from, from + n) */
+static void get_inflate(conn_t *c, int fd, size_t len, int codec, uint64_t raw, int ranged, uint64_t from, uint64_t n) {
+    const dfs_codec *cd = &dfs_codecs[codec];
+    size_t hpos = c->outlen;
+    char info[64];
+    if (from > raw) from = raw;
+    if (n > raw - from) n = raw - from;
+    if (ranged) snprintf(info, sizeof(info), "%llu SIZE %llu", (unsigned long long)n, (unsigned long long)raw);
+    else snprintf(info, sizeof(info), "%llu", (unsigned long long)raw);
+    reply(c, 1, n, info);
+    inflate_ctx x = { c, from, c->outlen + n };
+    int ok = n <= SIZE_MAX - c->outlen && out_reserve(c, n) == 0 && inflate_chunk(cd, c->item, fd, len, &x) == 0;
+    if (!ok || c->outlen != x.end) {
+        c->outlen = hpos;
+        reply(c, 0, 0, NULL);
+    }
+}
+
+static void start_get(conn_t *c, req_t *r) {
+    c->state = ST_CMD;
+    if (!valid_name(r->name)) {
+        reply(c, 0, 0, NULL);
+        return;
+    }
+    char info[96], path[1600];
+    uint64_t epoch = 0, raw = 0;
+    unsigned long long from = 0, want = ULLONG_MAX;
+    int ranged = sscanf(r->args, "%llu %llu", &from, &want) == 2;
+    size_t len;
+    int fd = -1;
+    chunk_path(path, sizeof(path), r->name);
+    c->off = 0;
+    int codec;
+    // a hit keeps the codec it was read with: the name may be a newer chunk by now
+    c->item = cache_get(r->name, &epoch);
+    if (c->item) {
+        codec = cache_codec(c->item, &raw);
+    } else {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            if (fd >= 0) close(fd);
+            reply(c, 0, 0, NULL);
+            return;
+        }
+        len = st.st_size;
+        codec = chunk_codec(fd, &raw);
+        c->item = cache_enabled() ? cache_fill(r->name, fd, len, codec, raw, epoch) : NULL;
+    }
+    if (c->item) cache_data(c->item, &len);
+    if (codec == -2 || (codec >= 0 && (ranged || !(c->codecs & 1u << codec)))) {
+        if (codec == -2) reply(c, 0, 0, NULL);
+        else get_inflate(c, fd, len, codec, raw, ranged, from, ranged ? want : raw);
+        if (fd >= 0) close(fd);
+        cache_release(c->item);
+        c->item = NULL;
+        return;
+    }
+    if (ranged) {
+        // a range reaching past the end is cut short; one starting there is empty
+        size_t size = len;
+        c->off = from < size ? from : size;
+        len = want < size - c->off ? want : size - c->off;
+        snprintf(info, sizeof(info), "%zu SIZE %zu", len, size);
+    } else if (codec >= 0) {
+        snprintf(info, sizeof(info), "%zu %s %llu", len, dfs_codecs[codec].name, (unsigned long long)raw);
+    } else {
+        snprintf(info, sizeof(info), "%zu", len);
+    }
+    reply(c, 1, len, info);
+    c->left = len;
+    c->state = ST_GET_BODY;
+    if (c->item) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+    c->file = fd;
+    c->copy = !zerocopy;
+}
+
+// HAVE <hash> [<chunkname>]: only a -d store can answer yes
+static void start_have(conn_t *c, req_t *r) {
+    char name[512] = "", path[1600];
+    int ok = 0;
+    c->state = ST_CMD;
+    sscanf(r->args, "%511s", name);
+    if (dedup && (!name[0] || valid_name(name))) {
+        chunk_path(path, sizeof(path), name);
+        ok = cas_have(r->name, name[0] ? path : NULL) == 0;
+        struct stat st;
+        if (ok && name[0] && stat(path, &st) == 0) {
+            catalog_put(name, st.st_size, (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec);
+            cache_invalidate(name);
+        }
+    }
+    reply(c, ok, 0, NULL);
+}
+
+/* Delta uploads (dfs_delta.h). Both ends of a PATCH do all their disk work
+   in one go, like LIST: signatures are a read of the chunk, rebuilding is a
+   read of the old copy and a write of the new one. */
+
+// SIGS <chunkname> <block size>: one signature per full block
+static void start_sigs(conn_t *c, req_t *r) {
+    c->state = ST_CMD;
+    size_t bs = strtoul(r->args, NULL, 10);
+    char path[1600];
+    chunk_path(path, sizeof(path), r->name);
+    int fd = valid_name(r->name) && bs >= DELTA_MIN_BLOCK && bs <= DELTA_MAX_BLOCK ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    struct stat st;
+    uint64_t raw;
+    if (fd >= 0 && chunk_codec(fd, &raw) != -1) { close(fd); fd = -1; }    // signatures are of raw chunks
+    unsigned char *blk = fd >= 0 ? malloc(bs) : NULL;
+    EVP_MD_CTX *md = EVP_MD_CTX_new();
+    size_t n = blk && md && fstat(fd, &st) == 0 ? st.st_size / bs : 0, body = n * DELTA_SIG_LEN;
+    size_t hpos = c->outlen;
+    char info[32];
+    snprintf(info, sizeof(info), "%zu", body);
+    int ok = blk && md && body <= DELTA_MAX;
+    if (ok) {
+        reply(c, 1, body, info);
+        ok = out_reserve(c, body) == 0;
+    }
+    for (size_t i = 0; i < n && ok; i++) {
+        unsigned char d[EVP_MAX_MD_SIZE];
+        unsigned char *sig = (unsigned char *)c->out + c->outlen;
+        ok = pread(fd, blk, bs, (off_t)(i * bs)) == (ssize_t)bs && EVP_DigestInit_ex(md, EVP_md5(), NULL) &&
+             EVP_DigestUpdate(md, blk, bs) && EVP_DigestFinal_ex(md, d, NULL);
+        dfs_put32(sig, delta_weak(blk, bs));
+        memcpy(sig + 4, d, DELTA_STRONG_LEN);
+        c->outlen += DELTA_SIG_LEN;
+    }
+    if (!ok) {
+        c->outlen = hpos;
+        reply(c, 0, 0, NULL);
+    }
+    EVP_MD_CTX_free(md);
+    free(blk);
+    if (fd >= 0) close(fd);
+}
+
+// PATCH <chunkname> <len> <new size> <md5 hex>: the instructions are taken in like a PUT body
+static void start_patch(conn_t *c, req_t *r) {
+    char hex[40];
+    unsigned long long size;
+    int ok = valid_name(r->name) && r->len <= DELTA_MAX &&
+             sscanf(r->args, "%llu %39s", &size, hex) == 2 && strlen(hex) == 32;
+    for (int i = 0; i < 16 && ok; i++) {
+        unsigned v;
+        ok = sscanf(hex + 2 * i, "%2x", &v) == 1;
+        c->patch_md5[i] = v;
+    }
+    if (!ok || !(c->patch = malloc(r->len ? r->len : 1))) { skip_body(c, r->len); return; }
+    snprintf(c->name, sizeof(c->name), "%s", r->name);
+    c->patch_size = size;
+    c->left = r->len;
+    c->off = 0;
+    c->copy = 1;
+    c->failed = c->forwarding = 0;
+    c->state = ST_PUT_BODY;
+}
+
+// appends n bytes to the rebuilt chunk
+static int patch_emit(int out, off_t *pos, EVP_MD_CTX *md, cas_put *cas, const char *p, size_t n) {
+    EVP_DigestUpdate(md, p, n);
+    if (cas) cas_put_update(cas, p, n);
+    while (n) {
+        ssize_t w = pwrite(out, p, n, *pos);
+        if (w <= 0) return -1;
+        p += w; n -= w; *pos += w;
+    }
+    return 0;
+}
+
+/* rebuilds the chunk from the old copy and the instructions into a file
+   written aside (with -d, a content-store body), as a PUT body would be;
+   0 if its size and MD5 are right, for finish_put to put it in place */
+static int apply_patch(conn_t *c) {
+    char path[1600];
+    chunk_path(path, sizeof(path), c->name);
+    int old = open(path, O_RDONLY | O_CLOEXEC);
+    uint64_t raw;
+    if (old < 0) return -1;
+    if (chunk_codec(old, &raw) != -1) { close(old); return -1; }
+    if (dedup) {
+        c->cas = cas_put_begin(&c->file);
+    } else {
+        tmp_chunk_path(c->tmp, sizeof(c->tmp));
+        c->file = open(c->tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (c->file < 0) c->tmp[0] = 0;
+    }
+    EVP_MD_CTX *md = EVP_MD_CTX_new();
+    char *buf = malloc(BUF);
+    int rc = c->file >= 0 && md && buf && EVP_DigestInit_ex(md, EVP_md5(), NULL) ? 0 : -1;
+    const char *p = c->patch, *end = c->patch + c->off;
+    off_t pos = 0;
+    while (rc == 0 && p < end) {
+        char op = *p++;
+        if (op == DELTA_COPY && end - p >= 16) {
+            uint64_t from = dfs_get64((const unsigned char *)p), n = dfs_get64((const unsigned char *)p + 8);
+            p += 16;
+            while (n && rc == 0) {
+                ssize_t r = pread(old, buf, n < BUF ? n : BUF, (off_t)from);
+                if (r <= 0 || patch_emit(c->file, &pos, md, c->cas, buf, r) < 0) rc = -1;
+                else { from += r; n -= r; }
             }
+        } else if (op == DELTA_DATA && end - p >= 8 && dfs_get64((const unsigned char *)p) <= (uint64_t)(end - p - 8)) {
+            uint64_t n = dfs_get64((const unsigned char *)p);
+            rc = patch_emit(c->file, &pos, md, c->cas, p + 8, n);
+            p += 8 + n;
         } else {
-            // ignore/unknown
-            fprintf(f, "ERR\n"); fflush(f);
+            rc = -1;
         }
-        // we finish after single command (dfc closes or expects short-living connections)
-        break;
     }
-    fclose(f);
+    unsigned char d[EVP_MAX_MD_SIZE];
+    if (rc == 0 && ((uint64_t)pos != c->patch_size || !EVP_DigestFinal_ex(md, d, NULL) ||
+                    memcmp(d, c->patch_md5, 16) != 0)) rc = -1;
+    EVP_MD_CTX_free(md);
+    free(buf);
+    close(old);
+    return rc;
+}
+
+/* MPUT and MGET (dfs_proto.h) carry many small chunks per request. The
+   payload is taken in whole, like PATCH instructions, and served in one go
+   once it is in: a batch of small chunks is little disk work, and one reply
+   stands in for a round trip per chunk. */
+static void start_batch(conn_t *c, req_t *r) {
+    if (r->len > DFS_BATCH_MAX || !(c->patch = malloc(r->len ? r->len : 1))) { skip_body(c, r->len); return; }
+    c->batch_op = r->op;
+    c->left = r->len;
+    c->off = 0;
+    c->copy = 1;
+    c->failed = c->forwarding = 0;
+    c->state = ST_PUT_BODY;
+}
+
+typedef struct mput_rec {
+    char name[512];
+    char *tmp;          // body written here (malloc'd path), or
+    cas_put *cas;       // -d: into the content store
+    unsigned char md5[16];  // of the body, kept for STAT
+    int have_md5;
+    int ok;
+} mput_rec;
+
+// writes a record's body aside; 0 on success
+static int mput_write(mput_rec *m, const char *p, uint64_t n) {
+    char tmp[1100];
+    int fd;
+    m->have_md5 = EVP_Digest(p, n, m->md5, NULL, EVP_md5(), NULL);
+    if (dedup) {
+        if (!(m->cas = cas_put_begin(&fd))) return -1;
+        cas_put_update(m->cas, p, n);
+    } else {
+        tmp_chunk_path(tmp, sizeof(tmp));
+        if ((fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) < 0) return -1;
+        if (!(m->tmp = strdup(tmp))) { close(fd); unlink(tmp); return -1; }
+    }
+    int rc = 0;
+    for (off_t off = 0; n && rc == 0;) {
+        ssize_t w = pwrite(fd, p, n, off);
+        if (w <= 0) rc = -1;
+        else { p += w; n -= w; off += w; }
+    }
+    close(fd);
+    return rc;
+}
+
+// puts a written body in place of its chunk; 0 on success
+static int mput_publish(mput_rec *m) {
+    char path[1600];
+    struct stat st;
+    int rc;
+    chunk_path(path, sizeof(path), m->name);
+    if (m->cas) {
+        rc = cas_put_commit(m->cas, path);
+        m->cas = NULL;
+    } else if ((rc = rename(m->tmp, path)) == 0) {
+        free(m->tmp);
+        m->tmp = NULL;
+    }
+    if (rc == 0 && stat(path, &st) == 0) {
+        catalog_put(m->name, st.st_size, (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec);
+        if (m->have_md5) md5_keep(path, &st, m->md5);
+    }
+    cache_invalidate(m->name);
+    return rc;
+}
+
+// publishes every record written aside; a record that fails fails alone
+static int mput_publish_all(commit_item *it) {
+    conn_t *c = conn_of(it);
+    for (size_t i = 0; i < c->nrecs; i++) {
+        if (c->recs[i].ok) c->recs[i].ok = mput_publish(&c->recs[i]) == 0;
+    }
     return 0;
 }
 
-int main(int argc, char **argv) {
-    if (argc != 3) usage();
-    strncpy(storedir, argv[1], sizeof(storedir)-1);
-    int port = atoi(argv[2]);
-    if (ensure_dir(storedir) != 0) {
-        fprintf(stderr, "Cannot create or access directory %s\n", storedir);
+// drops whatever of an MPUT's bodies was not published
+static void mput_drop(conn_t *c) {
+    for (size_t i = 0; i < c->nrecs; i++) {
+        cas_put_abort(c->recs[i].cas);
+        if (c->recs[i].tmp) unlink(c->recs[i].tmp);
+        free(c->recs[i].tmp);
+    }
+    free(c->recs);
+    c->recs = NULL;
+    c->nrecs = 0;
+}
+
+// answers an MPUT: a status byte per record, or ERR if the batch failed as a whole
+static void mput_done(conn_t *c, int ok) {
+    char info[32];
+    snprintf(info, sizeof(info), "%zu", c->nrecs);
+    reply(c, ok, ok ? c->nrecs : 0, ok ? info : NULL);
+    for (size_t i = 0; i < c->nrecs && ok; i++) out_append(c, c->recs[i].ok ? "\1" : "\0", 1);
+    mput_drop(c);
+    c->batch_op = 0;
+    c->state = ST_CMD;
+}
+
+/* MPUT: every body is written aside before any is renamed into place, so
+   with -s the batch goes to the syncer as one item and shares its group
+   commit like a PUT. A malformed payload stores nothing. */
+static void finish_mput(conn_t *c) {
+    const unsigned char *p = (const unsigned char *)c->patch, *end = p + c->off;
+    size_t cap = 0;
+    int ok = !c->failed;
+    while (ok && p < end) {
+        size_t left = end - p, nl = left >= 2 ? dfs_get16(p) : 0;
+        if (!nl || nl >= sizeof(c->recs->name) || left < DFS_MPUT_REC_LEN(nl, 0) ||
+            dfs_get64(p + 2 + nl) > left - DFS_MPUT_REC_LEN(nl, 0)) { ok = 0; break; }
+        uint64_t len = dfs_get64(p + 2 + nl);
+        if (c->nrecs == cap) {
+            mput_rec *r = realloc(c->recs, (cap = cap ? cap * 2 : 64) * sizeof(*r));
+            if (!r) { ok = 0; break; }
+            c->recs = r;
+        }
+        mput_rec *m = &c->recs[c->nrecs++];
+        memcpy(m->name, p + 2, nl);
+        m->name[nl] = 0;
+        m->tmp = NULL;
+        m->cas = NULL;
+        m->have_md5 = 0;
+        m->ok = valid_name(m->name) && mput_write(m, (const char *)p + DFS_MPUT_REC_LEN(nl, 0), len) == 0;
+        p += DFS_MPUT_REC_LEN(nl, len);
+    }
+    free(c->patch);
+    c->patch = NULL;
+    if (!ok) {
+        mput_done(c, 0);
+    } else if (sync_ms < 0) {
+        mput_done(c, mput_publish_all(&c->ci) == 0);
+    } else if (!c->worker) {
+        int dfd = open(storedir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        mput_done(c, dfd >= 0 && syncfs(dfd) == 0 && mput_publish_all(&c->ci) == 0 && syncfs(dfd) == 0);
+        if (dfd >= 0) close(dfd);
+    } else {
+        c->ci.publish = mput_publish_all;
+        c->ci.done = put_committed;
+        c->sync_done = 0;
+        c->state = ST_PUT_SYNC;
+        commit_submit(&c->ci);
+    }
+}
+
+/* appends an MGET record for chunk name, with its data as GET would serve it
+   decompressed, if that fits in room; -1 (and nothing appended) if not */
+static int mget_append(conn_t *c, const char *name, uint64_t room) {
+    char path[1600];
+    uint64_t epoch = 0, raw = 0;
+    size_t len = 0;
+    int fd = -1;
+    if (!valid_name(name)) return -1;
+    chunk_path(path, sizeof(path), name);
+    int codec;
+    cache_item *item = cache_get(name, &epoch);
+    if (item) {
+        codec = cache_codec(item, &raw);
+    } else {
+        struct stat st;
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+        len = st.st_size;
+        codec = chunk_codec(fd, &raw);
+        item = cache_enabled() ? cache_fill(name, fd, len, codec, raw, epoch) : NULL;
+    }
+    const unsigned char *data = item ? cache_data(item, &len) : NULL;
+    uint64_t size = codec >= 0 ? raw : len;
+    size_t pos = c->outlen;
+    int ok = codec != -2 && DFS_MGET_REC_LEN(size) <= room && out_reserve(c, DFS_MGET_REC_LEN(size)) == 0;
+    if (ok) {
+        unsigned char *h = (unsigned char *)c->out + pos;
+        h[0] = 1;
+        dfs_put64(h + 1, size);
+        c->outlen += DFS_MGET_REC_LEN(0);
+    }
+    if (ok && codec >= 0) {
+        inflate_ctx x = { c, 0, c->outlen + size };
+        ok = inflate_chunk(&dfs_codecs[codec], item, fd, len, &x) == 0 && c->outlen == x.end;
+    } else if (ok && data) {
+        memcpy(c->out + c->outlen, data, len);
+        c->outlen += len;
+    } else if (ok) {
+        // a chunk that shrank under us reads short and fails its record
+        for (size_t got = 0; ok && got < len;) {
+            ssize_t r = pread(fd, c->out + c->outlen, len - got, (off_t)got);
+            if (r <= 0) ok = 0;
+            else { c->outlen += r; got += r; }
+        }
+    }
+    if (!ok) c->outlen = pos;
+    if (fd >= 0) close(fd);
+    cache_release(item);
+    return ok ? 0 : -1;
+}
+
+// MGET: a record per name, in the order asked, answered in one reply
+static int finish_mget(conn_t *c) {
+    const char *p = c->patch, *end = p + c->off;
+    static const unsigned char missing[DFS_MGET_REC_LEN(0)];
+    size_t hpos = c->outlen;
+    int ok = !c->failed;
+    while (ok && p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        size_t L = nl ? (size_t)(nl - p) : (size_t)(end - p);
+        char name[512] = "";
+        if (L < sizeof(name)) {
+            memcpy(name, p, L);
+            name[L] = 0;
+        }
+        p += L + (nl != NULL);
+        uint64_t used = c->outlen - hpos;
+        if (mget_append(c, name, DFS_BATCH_MAX > used ? DFS_BATCH_MAX - used : 0) < 0)
+            ok = out_append(c, missing, sizeof(missing)) == 0;
+    }
+    if (!ok) {
+        c->outlen = hpos;
+        return -1;
+    }
+    // the length is known only now: queue the reply header, then move it in front of the records
+    size_t blen = c->outlen - hpos;
+    char info[32], h[DFS_HDR_LEN + sizeof(info) + 8];
+    snprintf(info, sizeof(info), "%zu", blen);
+    reply(c, 1, blen, info);
+    size_t hl = c->outlen - hpos - blen;
+    memcpy(h, c->out + hpos + blen, hl);
+    memmove(c->out + hpos + hl, c->out + hpos, blen);
+    memcpy(c->out + hpos, h, hl);
+    return 0;
+}
+
+static void finish_batch(conn_t *c) {
+    if (c->batch_op == OP_MPUT) {
+        finish_mput(c);
+        return;
+    }
+    int rc = finish_mget(c);
+    free(c->patch);
+    c->patch = NULL;
+    c->batch_op = 0;
+    if (rc < 0) reply(c, 0, 0, NULL);
+    c->state = ST_CMD;
+}
+
+/* PUSH <chunk> <host:port>[,...]: the chunk goes out as kept (compressed or
+   not) in a forwarded PUT; the reply waits for the chain's */
+static void start_push(conn_t *c, req_t *r) {
+    char path[1600], hops[CMD_MAX];
+    struct stat st;
+    uint64_t raw = 0;
+    chunk_path(path, sizeof(path), r->name);
+    int fd = valid_name(r->name) && sscanf(r->args, "%1023s", hops) == 1 ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    c->codec = fd >= 0 ? chunk_codec(fd, &raw) : -2;
+    if (c->codec == -2 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        c->codec = -1;
+        reply(c, 0, 0, NULL);
+        return;
+    }
+    c->rawlen = raw;
+    r->len = st.st_size;
+    c->fwd_failed = 0;
+    start_forward(c, r, hops);
+    if (c->fwd_failed) {
+        close(fd);
+        fwd_close(c);
+        c->forwarding = c->fwd_failed = 0;
+        reply(c, 0, 0, NULL);
+        return;
+    }
+    c->file = fd;
+    c->off = 0;
+    c->left = st.st_size;
+    c->state = ST_PUSH;
+}
+
+// DEL <chunk>: with -d this drops one reference to the content
+static void start_del(conn_t *c, req_t *r) {
+    char path[1600];
+    chunk_path(path, sizeof(path), r->name);
+    int ok = valid_name(r->name) && unlink(path) == 0;
+    if (ok) catalog_remove(r->name);
+    cache_invalidate(r->name);
+    reply(c, ok, 0, NULL);
+}
+
+/* MD5 of the raw chunk, decompressed if need be, from its stamp (left when
+   it was stored, or by chunk_hash); -1 if there is none or it is stale */
+static int chunk_md5(int fd, const struct stat *st, unsigned char *md5) {
+    char v[128], hex[40];
+    long long mt = (int64_t)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec, xmt;
+    unsigned long long xsz;
+    ssize_t n = fgetxattr(fd, MD5_XATTR, v, sizeof(v) - 1);
+    if (n <= 0) return -1;
+    v[n] = 0;
+    if (sscanf(v, "%lld %llu %39s", &xmt, &xsz, hex) != 3 || xmt != mt ||
+        xsz != (unsigned long long)st->st_size || strlen(hex) != 32) return -1;
+    for (int i = 0; i < 16; i++) {
+        unsigned b;
+        if (sscanf(hex + 2 * i, "%2x", &b) != 1) return -1;
+        md5[i] = b;
+    }
+    return 0;
+}
+
+static int md5_update(void *arg, const unsigned char *p, size_t n) {
+    return EVP_DigestUpdate(arg, p, n) ? 0 : -1;
+}
+
+// reads the chunk through to its MD5 and stamps it; 0 on success
+static int chunk_hash(int fd, const struct stat *st, int codec, unsigned char *md5) {
+    char v[128];
+    EVP_MD_CTX *md = EVP_MD_CTX_new();
+    codec_stream *cs = codec >= 0 ? dfs_codecs[codec].dec_new() : NULL;
+    char *buf = malloc(BUF);
+    int ok = md && buf && (codec < 0 || cs) && EVP_DigestInit_ex(md, EVP_md5(), NULL);
+    for (off_t off = 0; ok && off < st->st_size;) {
+        ssize_t r = pread(fd, buf, BUF, off);
+        if (r <= 0) ok = 0;
+        else if (cs) ok = dfs_codecs[codec].dec_update(cs, (unsigned char *)buf, r, md5_update, md) == 0;
+        else ok = EVP_DigestUpdate(md, buf, r);
+        off += r;
+    }
+    if (cs && dfs_codecs[codec].dec_end(cs) < 0) ok = 0;
+    if (ok) ok = EVP_DigestFinal_ex(md, md5, NULL);
+    EVP_MD_CTX_free(md);
+    free(buf);
+    if (!ok) return -1;
+    fsetxattr(fd, MD5_XATTR, v, md5_stamp(v, sizeof(v), st, md5), 0);
+    return 0;
+}
+
+/* Chunks STAT found unstamped (a body spliced or sent compressed is not
+   hashed on its way in) are hashed by a thread of their own, started on first
+   use, so a worker never reads a whole chunk for a STAT. The queue is short;
+   a name that does not fit waits for the next STAT to ask again. */
+#define HASH_QUEUE 64
+static pthread_mutex_t hash_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hash_cv = PTHREAD_COND_INITIALIZER;
+static char hash_names[HASH_QUEUE][512];
+static int hash_head, hash_len, hash_started;
+
+static void *hash_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        char path[1600];
+        unsigned char md5[16];
+        struct stat st;
+        uint64_t raw;
+        pthread_mutex_lock(&hash_mu);
+        while (!hash_len) pthread_cond_wait(&hash_cv, &hash_mu);
+        chunk_path(path, sizeof(path), hash_names[hash_head]);
+        hash_head = (hash_head + 1) % HASH_QUEUE;
+        hash_len--;
+        pthread_mutex_unlock(&hash_mu);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        int codec = fd >= 0 ? chunk_codec(fd, &raw) : -2;
+        // asked for twice, or stored again since: already stamped
+        if (codec != -2 && fstat(fd, &st) == 0 && chunk_md5(fd, &st, md5) < 0) chunk_hash(fd, &st, codec, md5);
+        if (fd >= 0) close(fd);
+    }
+    return NULL;
+}
+
+static void hash_later(const char *name) {
+    pthread_t tid;
+    pthread_mutex_lock(&hash_mu);
+    if (!hash_started && pthread_create(&tid, NULL, hash_main, NULL) == 0) {
+        pthread_detach(tid);
+        hash_started = 1;
+    }
+    if (hash_started && hash_len < HASH_QUEUE) {
+        snprintf(hash_names[(hash_head + hash_len++) % HASH_QUEUE], sizeof(hash_names[0]), "%s", name);
+        pthread_cond_signal(&hash_cv);
+    }
+    pthread_mutex_unlock(&hash_mu);
+}
+
+/* STAT <chunk>: "OK <raw size> <mtime ns>[ <md5 hex>]" without sending the
+   chunk. The MD5 is left out while the chunk is unstamped; a forked child,
+   which has no one else to serve, hashes it there and then. */
+static void start_stat(conn_t *c, req_t *r) {
+    char path[1600], info[128];
+    struct stat st;
+    unsigned char md5[16];
+    uint64_t raw = 0;
+    c->state = ST_CMD;
+    chunk_path(path, sizeof(path), r->name);
+    int fd = valid_name(r->name) ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    int codec = fd >= 0 ? chunk_codec(fd, &raw) : -2;
+    if (codec == -2 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
+        reply(c, 0, 0, NULL);
+        return;
+    }
+    int known = chunk_md5(fd, &st, md5) == 0;
+    if (!known && !c->worker) known = chunk_hash(fd, &st, codec, md5) == 0;
+    else if (!known) hash_later(r->name);
+    close(fd);
+    int n = snprintf(info, sizeof(info), "%llu %lld", codec >= 0 ? (unsigned long long)raw : (unsigned long long)st.st_size,
+                     (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec);
+    if (known) {
+        n += snprintf(info + n, sizeof(info) - n, " ");
+        for (int i = 0; i < 16; i++) n += snprintf(info + n, sizeof(info) - n, "%02x", md5[i]);
+    }
+    reply(c, 1, 0, info);
+}
+
+static void start_proto(conn_t *c, req_t *r) {
+    int v = atoi(r->args);
+    if (v < 1) { reply(c, 0, 0, NULL); return; }
+    if (v > DFS_PROTO_VERSION) v = DFS_PROTO_VERSION;
+    char info[200], names[128];
+    c->codecs = sscanf(r->args, "%*d CODECS %127s", names) == 1 ? codec_mask(names) : 0;
+    codec_names(c->codecs, names, sizeof(names));
+    snprintf(info, sizeof(info), "%d%s%s", v, c->codecs ? " CODECS " : "", names);
+    reply(c, 1, 0, info);
+    c->proto = v;
+}
+
+// numbers STATS reports besides the per-command counters
+static int stats_gauges(stats_gauge *g, int max) {
+    int n = 0;
+    size_t count;
+    uint64_t bytes;
+    struct statvfs vfs;
+    // -f: only children that listed have a catalog, and only of that moment
+    if (!fork_mode || catalog_ready) {
+        catalog_totals(&count, &bytes);
+        g[n++] = (stats_gauge){ "chunks", count };
+        g[n++] = (stats_gauge){ "chunk_bytes", bytes };
+    }
+    if (statvfs(storedir, &vfs) == 0) {
+        g[n++] = (stats_gauge){ "disk_used_bytes", (uint64_t)(vfs.f_blocks - vfs.f_bfree) * vfs.f_frsize };
+        g[n++] = (stats_gauge){ "disk_free_bytes", (uint64_t)vfs.f_bavail * vfs.f_frsize };
+    }
+    if (!fork_mode) {
+        cache_stats_t cs;
+        cache_stats(&cs);
+        g[n++] = (stats_gauge){ "cache_hits", cs.hits };
+        g[n++] = (stats_gauge){ "cache_misses", cs.misses };
+        g[n++] = (stats_gauge){ "cache_bytes", cs.bytes };
+    }
+    if (!fork_mode && sync_ms >= 0) {
+        commit_stats_t ms;
+        commit_stats(&ms);
+        g[n++] = (stats_gauge){ "commit_groups", ms.groups };
+        g[n++] = (stats_gauge){ "commit_puts", ms.items };
+    }
+    return n < max ? n : max;
+}
+
+// STATS [JSON]: "OK <len>" and the report
+static void start_stats(conn_t *c, req_t *r) {
+    stats_gauge g[STATS_GAUGES_MAX];
+    char info[32];
+    size_t len;
+    char *s = stats_format(strncmp(r->args, "JSON", 4) == 0, g, stats_gauges(g, STATS_GAUGES_MAX), &len);
+    c->state = ST_CMD;
+    if (!s) { reply(c, 0, 0, NULL); return; }
+    snprintf(info, sizeof(info), "%zu", len);
+    reply(c, 1, len, info);
+    out_append(c, s, len);
+    free(s);
+}
+
+static void dispatch(conn_t *c, req_t *r) {
+    c->stat_slot = 0;
+    for (size_t i = 0; i < NVERBS; i++) if (verbs[i].op == r->op) c->stat_slot = i + 1;
+    c->stat_t0 = stats_now();
+    c->stat_ok = 1;
+    c->stat_in = r->len;
+    c->stat_out = 0;
+    switch (r->op) {
+    case OP_PUT: start_put(c, r); break;
+    case OP_GET: start_get(c, r); break;
+    case OP_LIST: start_list(c, r); break;
+    case OP_PROTO: start_proto(c, r); break;
+    case OP_HAVE: start_have(c, r); break;
+    case OP_SIGS: start_sigs(c, r); break;
+    case OP_PATCH: start_patch(c, r); break;
+    case OP_PUSH: start_push(c, r); break;
+    case OP_DEL: start_del(c, r); break;
+    case OP_STATS: start_stats(c, r); break;
+    case OP_STAT: start_stat(c, r); break;
+    case OP_MPUT:
+    case OP_MGET: start_batch(c, r); break;
+    default:
+        // ignore/unknown, including any payload it carries
+        skip_body(c, r->len);
+    }
+}
+
+// "VERB [name] [len] [words...]"; returns 1 parsed (op 0 if unknown), -1 malformed
+static int parse_text(char *line, req_t *r) {
+    char verb[16];
+    int n = 0;
+    size_t L = strlen(line);
+    while (L && line[L-1] == '\r') line[--L] = 0;
+    r->op = 0; r->name[0] = 0; r->args[0] = 0; r->len = 0;
+    if (sscanf(line, "%15s%n", verb, &n) != 1) return 1;  // blank line: unknown
+    const char *p = line + n;
+    for (size_t i = 0; i < sizeof(verbs)/sizeof(verbs[0]); i++) {
+        if (strcmp(verb, verbs[i].verb) != 0) continue;
+        r->op = verbs[i].op;
+        if (verbs[i].has_name) {
+            if (sscanf(p, " %511s%n", r->name, &n) != 1) return -1;
+            p += n;
+        }
+        if (verbs[i].has_len) {
+            if (sscanf(p, " %llu%n", &r->len, &n) != 1) return -1;
+            p += n;
+        }
+        while (*p == ' ') p++;
+        snprintf(r->args, sizeof(r->args), "%s", p);
+        break;
+    }
+    return 1;
+}
+
+/* pulls the next command out of the input buffer.
+   returns 1 with *r filled, 0 if more bytes are needed, -1 if the session
+   cannot continue (the reply, if any, is queued). */
+static int next_request(conn_t *c, req_t *r) {
+    if (c->proto >= 2) {
+        dfs_hdr h;
+        if (c->inlen < DFS_HDR_LEN) return 0;
+        if (dfs_hdr_unpack((unsigned char *)c->in, &h) < 0) return -1;
+        size_t need = DFS_HDR_LEN + h.namelen + h.arglen;
+        if (h.namelen >= sizeof(r->name) || h.arglen >= sizeof(r->args) || need > sizeof(c->in)) return -1;
+        if (c->inlen < need) return 0;
+        r->op = h.opcode;
+        memcpy(r->name, c->in + DFS_HDR_LEN, h.namelen);
+        r->name[h.namelen] = 0;
+        memcpy(r->args, c->in + DFS_HDR_LEN + h.namelen, h.arglen);
+        r->args[h.arglen] = 0;
+        r->len = h.paylen;
+        c->reqid = h.reqid;
+        memmove(c->in, c->in + need, c->inlen - need);
+        c->inlen -= need;
         return 1;
     }
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) { perror("socket"); return 1; }
+    char *nl = memchr(c->in, '\n', c->inlen);
+    if (!nl) {
+        if (c->inlen < sizeof(c->in)) return 0;
+        reply(c, 0, 0, NULL);
+        return -1;
+    }
+    *nl = 0;
+    size_t used = nl - c->in + 1;
+    int rc = parse_text(c->in, r);
+    memmove(c->in, c->in + used, c->inlen - used);
+    c->inlen -= used;
+    if (rc < 0) {
+        // a PUT without a length cannot be skipped, so the session is lost
+        if (r->op == OP_PUT) { reply(c, 0, 0, NULL); return -1; }
+        r->op = 0;  // answered ERR like an unknown command
+    }
+    return 1;
+}
+
+// recv() wrapper: >0 bytes, 0 would block, -1 peer gone or error
+static ssize_t conn_recv(conn_t *c, void *buf, size_t len) {
+    for (;;) {
+        ssize_t r = recv(c->fd, buf, len, 0);
+        if (r > 0) return r;
+        if (r == 0) return -1;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        return -1;
+    }
+}
+
+static int conn_step(conn_t *c) {
+    for (;;) {
+        // back in ST_CMD: the command is served once its reply is queued
+        if (c->stat_slot >= 0 && c->state == ST_CMD) {
+            stats_request(c->stat_slot, c->stat_t0, c->stat_ok, c->stat_in, c->stat_out);
+            c->stat_slot = -1;
+        }
+        if (c->outoff < c->outlen) {
+            int r = out_flush(c);
+            if (r < 0) return CONN_CLOSE;
+            if (r > 0) return CONN_WANT_WRITE;
+        }
+        switch (c->state) {
+        case ST_CMD: {
+            req_t r;
+            int got = next_request(c, &r);
+            if (got < 0) { c->state = ST_DONE; break; }
+            if (got == 0) {
+                ssize_t n = conn_recv(c, c->in + c->inlen, sizeof(c->in) - c->inlen);
+                if (n < 0) return CONN_CLOSE;
+                if (n == 0) return CONN_WANT_READ;
+                c->inlen += n;
+                break;
+            }
+            dispatch(c, &r);
+            break;
+        }
+        case ST_PUT_BODY: {
+            // the next server sets the pace once its buffer is full
+            if (c->forwarding && fwd_flush(c) > 0 && (c->left == 0 || fwd_room(c) == 0)) return CONN_WANT_FWD;
+            if (c->left == 0) {
+                if (c->forwarding) c->state = ST_PUT_CHAIN;
+                else finish_put(c);
+                break;
+            }
+            size_t room = put_room(c);
+            if (c->inlen) {
+                size_t n = c->inlen < room ? c->inlen : room;
+                put_data(c, c->in, n);
+                memmove(c->in, c->in + n, c->inlen - n);
+                c->inlen -= n;
+                break;
+            }
+            if (!c->copy && !c->failed) {
+                ssize_t r = put_splice(c);
+                if (r < 0) return CONN_CLOSE;
+                if (r == 0) return CONN_WANT_READ;
+                break;
+            }
+            char buf[BUF];
+            ssize_t r = conn_recv(c, buf, room < sizeof(buf) ? room : sizeof(buf));
+            if (r < 0) return CONN_CLOSE;
+            if (r == 0) return CONN_WANT_READ;
+            put_data(c, buf, r);
+            break;
+        }
+        case ST_PUT_CHAIN:
+            if (!fwd_reply(c)) return CONN_WANT_FWD;
+            finish_put(c);
+            break;
+        case ST_PUT_SYNC:
+            // socket events meanwhile are ignored; the worker's drain of its
+            // committed list is what moves the PUT on
+            if (!c->sync_done) return CONN_WANT_SYNC;
+            if (c->batch_op == OP_MPUT) mput_done(c, c->ci.rc == 0);
+            else put_done(c, c->ci.rc == 0);
+            break;
+        case ST_PUSH:
+            if (fwd_flush(c) > 0) return CONN_WANT_FWD;
+            if (c->left && !c->fwd_failed) {
+                char buf[BUF];
+                ssize_t r = pread(c->file, buf, c->left < sizeof(buf) ? c->left : sizeof(buf), c->off);
+                // a chunk that shrank under us reaches the next server cut short, which drops it
+                if (r <= 0) { c->fwd_failed = 1; break; }
+                fwd_append(c, buf, r);
+                c->off += r;
+                c->left -= r;
+                break;
+            }
+            if (!fwd_reply(c)) return CONN_WANT_FWD;
+            close(c->file);
+            c->file = -1;
+            reply(c, !c->fwd_failed, 0, NULL);
+            if (c->fwd_failed) fwd_close(c);
+            c->forwarding = c->fwd_failed = 0;
+            c->state = ST_CMD;
+            break;
+        case ST_GET_BODY: {
+            if (c->left == 0) {
+                if (c->file >= 0) { close(c->file); c->file = -1; }
+                cache_release(c->item); c->item = NULL;
+                c->state = ST_CMD;
+                break;
+            }
+            if (c->item) {
+                size_t len;
+                const unsigned char *data = cache_data(c->item, &len);
+                ssize_t r = send(c->fd, data + c->off, c->left, MSG_NOSIGNAL);
+                if (r > 0) { c->off += r; c->left -= r; break; }
+                if (r < 0 && errno == EINTR) break;
+                if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return CONN_WANT_WRITE;
+                return CONN_CLOSE;
+            }
+            if (!c->copy) {
+                ssize_t r = sendfile(c->fd, c->file, &c->off, c->left < ZC_CHUNK ? c->left : ZC_CHUNK);
+                if (r > 0) { c->left -= r; break; }
+                if (r < 0 && errno == EINTR) break;
+                if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return CONN_WANT_WRITE;
+                if (r < 0 && (errno == EINVAL || errno == ENOSYS)) { c->copy = 1; break; }
+                return CONN_CLOSE;  // chunk shrank under us; the length is already promised
+            }
+            size_t want = c->left < BUF ? c->left : BUF;
+            if (out_reserve(c, want) < 0) return CONN_CLOSE;
+            ssize_t r = pread(c->file, c->out, want, c->off);
+            if (r <= 0) return CONN_CLOSE;  // chunk shrank under us; the length is already promised
+            c->outlen = r;
+            c->off += r;
+            c->left -= r;
+            break;
+        }
+        case ST_DONE:
+            return CONN_CLOSE;
+        }
+    }
+}
+
+/* fork fallback: serve one connection in this process until it is done */
+static int handle_client(int cfd) {
+    fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL, 0) | O_NONBLOCK);
+    conn_t *c = conn_new(cfd);
+    if (!c) { close(cfd); return -1; }
+    int want;
+    while ((want = conn_step(c)) != CONN_CLOSE) {
+        // a forwarded PUT also waits on the next server: to drain its buffer, or for the reply
+        struct pollfd pfd[2] = {
+            { .fd = cfd, .events = want == CONN_WANT_WRITE ? POLLOUT : want == CONN_WANT_READ ? POLLIN : 0 },
+            { .fd = c->fwd, .events = c->fend > c->foff ? POLLOUT : c->state == ST_PUT_CHAIN || c->state == ST_PUSH ? POLLIN : 0 },
+        };
+        int r = poll(pfd, c->fwd >= 0 ? 2 : 1, IDLE_TIMEOUT_MS);
+        if (r == 0) break;
+        if (r < 0 && errno != EINTR) break;
+    }
+    conn_free(c);
+    return 0;
+}
+
+static int make_listener(int reuseport) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) { perror("socket"); return -1; }
     int opt=1; setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("SO_REUSEPORT"); close(sock); return -1;
+    }
     struct sockaddr_in sa;
     memset(&sa,0,sizeof(sa));
     sa.sin_family = AF_INET;
     sa.sin_addr.s_addr = INADDR_ANY;
     sa.sin_port = htons(port);
-    if (bind(sock, (struct sockaddr*)&sa, sizeof(sa)) < 0) { perror("bind"); return 1; }
-    if (listen(sock, BACKLOG) < 0) { perror("listen"); return 1; }
-    // simple single-process accept loop
+    if (bind(sock, (struct sockaddr*)&sa, sizeof(sa)) < 0) { perror("bind"); close(sock); return -1; }
+    if (listen(sock, BACKLOG) < 0) { perror("listen"); close(sock); return -1; }
+    return sock;
+}
+
+typedef struct worker {
+    int lfd;
+    int epfd;
+    pthread_t tid;
+    int efd;                // -s: eventfd the syncer rings when it hands PUTs back
+    pthread_mutex_t mu;
+    conn_t *committed;      // those PUTs, under mu
+    conn_t *lru, *lru_tail; // live connections, most recently active first
+} worker_t;
+
+/* Idle reaping: a worker keeps its connections in order of last activity,
+   sleeps no longer than it takes the oldest to reach IDLE_TIMEOUT_MS, and
+   then closes every connection that has been quiet that long, as the fork
+   fallback's poll() does. One waiting on the syncer is not idle. */
+
+static uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void lru_unlink(worker_t *w, conn_t *c) {
+    if (c->lru_prev) c->lru_prev->lru_next = c->lru_next; else if (w->lru == c) w->lru = c->lru_next;
+    if (c->lru_next) c->lru_next->lru_prev = c->lru_prev; else if (w->lru_tail == c) w->lru_tail = c->lru_prev;
+    c->lru_prev = c->lru_next = NULL;
+}
+
+static void conn_touch(worker_t *w, conn_t *c) {
+    lru_unlink(w, c);
+    c->active_ms = now_ms();
+    c->lru_next = w->lru;
+    if (w->lru) w->lru->lru_prev = c; else w->lru_tail = c;
+    w->lru = c;
+}
+
+// epoll_wait timeout: until the oldest connection is due, or forever with none
+static int reap_timeout(worker_t *w) {
+    if (!w->lru_tail) return -1;
+    uint64_t idle = now_ms() - w->lru_tail->active_ms;
+    return idle >= IDLE_TIMEOUT_MS ? 0 : (int)(IDLE_TIMEOUT_MS - idle) + 1;
+}
+
+static void reap_idle(worker_t *w) {
+    uint64_t now = now_ms();
+    while (w->lru_tail && now - w->lru_tail->active_ms >= IDLE_TIMEOUT_MS) {
+        conn_t *c = w->lru_tail;
+        if (c->state == ST_PUT_SYNC) { conn_touch(w, c); continue; }
+        lru_unlink(w, c);
+        conn_free(c);
+    }
+}
+
+// syncer thread: the PUT is committed (or failed); its worker answers it
+static void put_committed(commit_item *it, int rc) {
+    conn_t *c = conn_of(it);
+    worker_t *w = c->worker;
+    uint64_t one = 1;
+    it->rc = rc;
+    pthread_mutex_lock(&w->mu);
+    c->next = w->committed;
+    w->committed = c;
+    pthread_mutex_unlock(&w->mu);
+    if (write(w->efd, &one, sizeof(one)) < 0) perror("eventfd");
+}
+
+static void accept_all(worker_t *w) {
+    for (;;) {
+        int fd = accept4(w->lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            // EAGAIN: drained. EMFILE and friends: retry on the next connection.
+            return;
+        }
+        set_nodelay(fd);
+        conn_t *c = conn_new(fd);
+        if (!c) { close(fd); continue; }
+        c->epfd = w->epfd;
+        c->worker = w;
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = c };
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) { conn_free(c); continue; }
+        conn_touch(w, c);
+        // the command may already be waiting
+        if (conn_step(c) == CONN_CLOSE) { lru_unlink(w, c); conn_free(c); }
+    }
+}
+
+static void *worker_main(void *arg) {
+    worker_t *w = arg;
+    struct epoll_event evs[MAX_EVENTS];
+    for (;;) {
+        int n = epoll_wait(w->epfd, evs, MAX_EVENTS, reap_timeout(w));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        // a connection may have two events in one batch (its client and its next
+        // server in a PUT chain), so it is freed only once the batch is done
+        conn_t *dead = NULL;
+        for (int i = 0; i < n; i++) {
+            conn_t *c = evs[i].data.ptr;
+            if (!c) { accept_all(w); continue; }
+            if ((void *)c == (void *)w) {
+                // PUTs back from the syncer
+                uint64_t v;
+                if (read(w->efd, &v, sizeof(v)) < 0 && errno != EAGAIN) perror("eventfd");
+                pthread_mutex_lock(&w->mu);
+                conn_t *list = w->committed;
+                w->committed = NULL;
+                pthread_mutex_unlock(&w->mu);
+                while (list) {
+                    c = list;
+                    list = c->next;
+                    c->sync_done = 1;
+                    conn_touch(w, c);
+                    if (conn_step(c) == CONN_CLOSE) { c->closed = 1; c->next = dead; dead = c; }
+                }
+                continue;
+            }
+            if (c->closed) continue;
+            conn_touch(w, c);
+            if (conn_step(c) == CONN_CLOSE) { c->closed = 1; c->next = dead; dead = c; }
+        }
+        while (dead) {
+            conn_t *c = dead;
+            dead = c->next;
+            lru_unlink(w, c);
+            conn_free(c);
+        }
+        reap_idle(w);
+    }
+    return NULL;
+}
+
+static int worker_init(worker_t *w, int reuseport) {
+    w->lfd = make_listener(reuseport);
+    if (w->lfd < 0) return -1;
+    fcntl(w->lfd, F_SETFL, fcntl(w->lfd, F_GETFL, 0) | O_NONBLOCK);
+    w->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (w->epfd < 0) { perror("epoll_create1"); return -1; }
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = NULL };
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->lfd, &ev) < 0) { perror("epoll_ctl"); return -1; }
+    // the wake-up fd is told apart from connections by carrying the worker itself
+    pthread_mutex_init(&w->mu, NULL);
+    w->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event wake = { .events = EPOLLIN | EPOLLET, .data.ptr = w };
+    if (w->efd < 0 || epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->efd, &wake) < 0) { perror("eventfd"); return -1; }
+    return 0;
+}
+
+// kill -USR1 <pid> prints the chunk cache counters
+static void *stats_main(void *arg) {
+    sigset_t *set = arg;
+    int sig;
+    while (sigwait(set, &sig) == 0) {
+        cache_stats_t s;
+        cache_stats(&s);
+        unsigned long long total = s.hits + s.misses;
+        fprintf(stderr, "dfs: cache hits %llu misses %llu (%.1f%% hit) admitted %llu rejected %llu "
+                "evicted %llu invalidated %llu; %zu chunks, %zu of %zu bytes\n",
+                (unsigned long long)s.hits, (unsigned long long)s.misses,
+                total ? 100.0 * s.hits / total : 0.0,
+                (unsigned long long)s.admitted, (unsigned long long)s.rejected,
+                (unsigned long long)s.evicted, (unsigned long long)s.invalidated,
+                s.items, s.bytes, s.budget);
+        if (sync_ms >= 0) {
+            commit_stats_t cs;
+            commit_stats(&cs);
+            fprintf(stderr, "dfs: group commit: %llu PUTs in %llu groups (%.1f per group), %llu failed\n",
+                    cs.items, cs.groups, cs.groups ? (double)cs.items / cs.groups : 0.0, cs.failed);
+        }
+    }
+    return NULL;
+}
+
+static int serve_epoll() {
+    static worker_t workers[MAX_WORKERS];
+    static sigset_t usr1;
+    pthread_t stats_tid;
+    // blocked before any worker starts, so only the stats thread takes SIGUSR1
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+    if (pthread_create(&stats_tid, NULL, stats_main, &usr1) == 0) pthread_detach(stats_tid);
+    if (sync_ms >= 0 && commit_start(storedir, sync_ms) < 0) {
+        fprintf(stderr, "Cannot start the syncer for %s\n", storedir);
+        return 1;
+    }
+    cache_init(cache_budget);
+    // SO_REUSEPORT only when we need it, so a stale server on the port still makes bind fail
+    for (int i = 0; i < nworkers; i++) {
+        if (worker_init(&workers[i], nworkers > 1) < 0) return 1;
+    }
+    for (int i = 1; i < nworkers; i++) {
+        if (pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]) != 0) {
+            fprintf(stderr, "cannot start worker %d\n", i);
+            return 1;
+        }
+    }
+    worker_main(&workers[0]);
+    return 1;
+}
+
+static int serve_fork() {
+    int sock = make_listener(0);
+    if (sock < 0) return 1;
+    signal(SIGCHLD, SIG_IGN);  // children reap themselves
     while (1) {
         struct sockaddr_in cli; socklen_t clilen = sizeof(cli);
         int c = accept(sock, (struct sockaddr*)&cli, &clilen);
         if (c < 0) continue;
+        set_nodelay(c);
         // make a short-living handler - fork to support concurrency
         pid_t pid = fork();
         if (pid == 0) {
             close(sock);
             handle_client(c);
-            close(c);
             exit(0);
         } else if (pid > 0) {
             close(c);
@@ -169,9 +2029,120 @@ int main(int argc, char **argv) {
         } else {
             // fork failed, handle inline
             handle_client(c);
-            close(c);
         }
     }
     close(sock);
     return 0;
 }
+
+// "<n>[K|M|G]" -> bytes, (size_t)-1 if malformed
+static size_t parse_size(const char *v) {
+    char *end;
+    unsigned long long n = strtoull(v, &end, 10);
+    if (end == v) return (size_t)-1;
+    switch (*end) {
+    case 'k': case 'K': n <<= 10; break;
+    case 'm': case 'M': n <<= 20; break;
+    case 'g': case 'G': n <<= 30; break;
+    case 0: break;
+    default: return (size_t)-1;
+    }
+    return (size_t)n;
+}
+
+// builds the chunk catalog from disk, with up to one stat thread per CPU
+static int load_catalog() {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = ncpu < 1 ? 1 : ncpu > SCAN_THREADS_MAX ? SCAN_THREADS_MAX : (int)ncpu;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (catalog_load(storedir, threads) < 0) return -1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    size_t count;
+    uint64_t bytes;
+    catalog_totals(&count, &bytes);
+    fprintf(stderr, "dfs: cataloged %zu chunks (%llu bytes) in %.1f ms with %d threads\n",
+            count, (unsigned long long)bytes,
+            (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6, threads);
+    return 0;
+}
+
+// drops bodies a previous run was still receiving
+static void sweep_temps() {
+    DIR *d = opendir(storedir);
+    struct dirent *ent;
+    while (d && (ent = readdir(d)) != NULL) {
+        if (strncmp(ent->d_name, TMP_PREFIX, strlen(TMP_PREFIX)) == 0) unlinkat(dirfd(d), ent->d_name, 0);
+    }
+    if (d) closedir(d);
+}
+
+// lift the soft fd limit so one process can hold tens of thousands of connections
+static void raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "ft:cm:ds:S:i:")) != -1) {
+        switch (opt) {
+        case 'f': fork_mode = 1; break;
+        case 'c': zerocopy = 0; break;
+        case 'd': dedup = 1; break;
+        case 's':
+            sync_ms = atoi(optarg);
+            if (sync_ms < 0) usage();
+            break;
+        case 'S': stats_file = optarg; break;
+        case 'i':
+            stats_every = atoi(optarg);
+            if (stats_every < 1) usage();
+            break;
+        case 'm':
+            cache_budget = parse_size(optarg);
+            if (cache_budget == (size_t)-1) usage();
+            break;
+        case 't':
+            nworkers = atoi(optarg);
+            if (nworkers < 1 || nworkers > MAX_WORKERS) usage();
+            break;
+        default: usage();
+        }
+    }
+    if (argc - optind != 2) usage();
+    strncpy(storedir, argv[optind], sizeof(storedir)-1);
+    port = atoi(argv[optind+1]);
+    if (ensure_dir(storedir) != 0) {
+        fprintf(stderr, "Cannot create or access directory %s\n", storedir);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+    sweep_temps();
+    if (dedup) {
+        long n = cas_init(storedir);
+        if (n < 0) {
+            fprintf(stderr, "Cannot set up the content store in %s\n", storedir);
+            return 1;
+        }
+        fprintf(stderr, "dfs: content store ready, reclaimed %ld unreferenced objects\n", n);
+    }
+    if (!fork_mode && load_catalog() < 0) {
+        fprintf(stderr, "Cannot read directory %s\n", storedir);
+        return 1;
+    }
+    for (size_t i = 0; i < NVERBS; i++) stat_names[i + 1] = verbs[i].verb;
+    if (stats_init(stat_names, NVERBS + 1) < 0) {
+        fprintf(stderr, "Cannot map the stats region\n");
+        return 1;
+    }
+    if (stats_file && stats_dump_start(stats_file, stats_every, stats_gauges) < 0) {
+        fprintf(stderr, "Cannot start the stats dump to %s\n", stats_file);
+        return 1;
+    }
+    return fork_mode ? serve_fork() : serve_epoll();
+}
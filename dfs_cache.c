@@ -0,0 +1,311 @@
+// dfs_cache.c
+// Hot-chunk cache for dfs (see dfs_cache.h).
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "dfs_cache.h"
+
+#define PROTECTED_PCT 80        // share of the budget for chunks hit more than once
+#define MAX_ITEM_DIV 8          // largest cacheable chunk: budget / MAX_ITEM_DIV
+#define SKETCH_ROWS 4
+#define SKETCH_MAX 15           // counters saturate; all are halved every sample_size accesses
+
+enum { SEG_PROBATION, SEG_PROTECTED, SEG_NONE };
+
+struct cache_item {
+    struct cache_item *hnext;           // hash chain
+    struct cache_item *prev, *next;     // segment list, most recent first
+    int seg;                            // SEG_NONE once evicted or invalidated
+    int refs;                           // the cache's own reference plus one per transfer
+    uint64_t hash;
+    size_t len;
+    int codec;                          // the chunk's codec and raw size when read
+    uint64_t raw;
+    unsigned char *data;
+    char name[];
+};
+
+typedef struct {
+    cache_item *head, *tail;
+    size_t bytes;
+} segment_t;
+
+static pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+static size_t budget, max_item;
+static cache_item **table;
+static size_t nbuckets, nitems;
+static segment_t segs[2];
+static cache_stats_t st;
+
+/* per-name generations, bumped by cache_invalidate: a fill is discarded only
+   if its own name (or one sharing its slot) was rewritten meanwhile. Fixed in
+   size, so growing the hash table does not disturb them. */
+static uint64_t *gens;
+static size_t ngens;
+
+static uint8_t *sketch;         // SKETCH_ROWS rows of sketch_width counters
+static size_t sketch_width, sample_size, sample_count;
+
+static uint64_t hash_name(const char *s) {
+    uint64_t h = 1469598103934665603ULL;
+    while (*s) { h ^= (unsigned char)*s++; h *= 1099511628211ULL; }
+    return h;
+}
+
+void cache_init(size_t bytes) {
+    budget = bytes;
+    if (!budget) return;
+    max_item = budget / MAX_ITEM_DIV;
+    nbuckets = 1024;
+    table = calloc(nbuckets, sizeof(*table));
+    // roughly one counter per 4K of budget, so small chunks are still told apart
+    sketch_width = 1024;
+    while (sketch_width < (1u << 20) && sketch_width * 4096 < budget) sketch_width *= 2;
+    sketch = calloc(SKETCH_ROWS, sketch_width);
+    sample_size = sketch_width * 10;
+    ngens = sketch_width;
+    gens = calloc(ngens, sizeof(*gens));
+    if (!table || !sketch || !gens) { free(table); free(sketch); free(gens); budget = 0; }
+    st.budget = budget;
+}
+
+int cache_enabled() { return budget > 0; }
+
+/* TinyLFU frequency sketch */
+
+static size_t sketch_index(uint64_t h, int row) {
+    uint64_t x = h + (uint64_t)row * 0x9e3779b97f4a7c15ULL;
+    x ^= x >> 31; x *= 0xbf58476d1ce4e5b9ULL; x ^= x >> 29;
+    return row * sketch_width + (x & (sketch_width - 1));
+}
+
+static unsigned sketch_freq(uint64_t h) {
+    unsigned f = SKETCH_MAX;
+    for (int r = 0; r < SKETCH_ROWS; r++) {
+        unsigned v = sketch[sketch_index(h, r)];
+        if (v < f) f = v;
+    }
+    return f;
+}
+
+static void sketch_add(uint64_t h) {
+    for (int r = 0; r < SKETCH_ROWS; r++) {
+        uint8_t *v = &sketch[sketch_index(h, r)];
+        if (*v < SKETCH_MAX) (*v)++;
+    }
+    // age: halving keeps the sketch about recent popularity
+    if (++sample_count >= sample_size) {
+        for (size_t i = 0; i < SKETCH_ROWS * sketch_width; i++) sketch[i] >>= 1;
+        sample_count /= 2;
+    }
+}
+
+/* segment lists and hash table, all under mu */
+
+static void seg_unlink(cache_item *it) {
+    segment_t *s = &segs[it->seg];
+    if (it->prev) it->prev->next = it->next; else s->head = it->next;
+    if (it->next) it->next->prev = it->prev; else s->tail = it->prev;
+    s->bytes -= it->len;
+    it->prev = it->next = NULL;
+}
+
+static void seg_push(cache_item *it, int seg) {
+    segment_t *s = &segs[seg];
+    it->seg = seg;
+    it->prev = NULL;
+    it->next = s->head;
+    if (s->head) s->head->prev = it; else s->tail = it;
+    s->head = it;
+    s->bytes += it->len;
+}
+
+static cache_item *lookup(const char *name, uint64_t h) {
+    for (cache_item *it = table[h & (nbuckets - 1)]; it; it = it->hnext) {
+        if (it->hash == h && strcmp(it->name, name) == 0) return it;
+    }
+    return NULL;
+}
+
+static void item_unref(cache_item *it) {
+    if (__atomic_sub_fetch(&it->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(it->data);
+        free(it);
+    }
+}
+
+// takes it out of the table and its segment and drops the cache's reference
+static void remove_item(cache_item *it) {
+    cache_item **pp = &table[it->hash & (nbuckets - 1)];
+    while (*pp != it) pp = &(*pp)->hnext;
+    *pp = it->hnext;
+    seg_unlink(it);
+    it->seg = SEG_NONE;
+    nitems--;
+    item_unref(it);
+}
+
+static void grow_table() {
+    size_t n = nbuckets * 2;
+    cache_item **t = calloc(n, sizeof(*t));
+    if (!t) return;
+    for (size_t i = 0; i < nbuckets; i++) {
+        cache_item *it = table[i];
+        while (it) {
+            cache_item *next = it->hnext;
+            it->hnext = t[it->hash & (n - 1)];
+            t[it->hash & (n - 1)] = it;
+            it = next;
+        }
+    }
+    free(table);
+    table = t;
+    nbuckets = n;
+}
+
+// keeps the protected segment within its share by demoting its oldest items
+static void rebalance() {
+    size_t cap = budget / 100 * PROTECTED_PCT;
+    while (segs[SEG_PROTECTED].bytes > cap && segs[SEG_PROTECTED].tail) {
+        cache_item *it = segs[SEG_PROTECTED].tail;
+        seg_unlink(it);
+        seg_push(it, SEG_PROBATION);
+    }
+}
+
+cache_item *cache_get(const char *name, uint64_t *ep) {
+    if (!budget) return NULL;
+    uint64_t h = hash_name(name);
+    pthread_mutex_lock(&mu);
+    sketch_add(h);
+    cache_item *it = lookup(name, h);
+    if (it) {
+        st.hits++;
+        seg_unlink(it);
+        seg_push(it, SEG_PROTECTED);
+        rebalance();
+        __atomic_add_fetch(&it->refs, 1, __ATOMIC_RELAXED);
+    } else {
+        st.misses++;
+        *ep = gens[h & (ngens - 1)];
+    }
+    pthread_mutex_unlock(&mu);
+    return it;
+}
+
+/* whether a chunk of len bytes with frequency f gets in: free space admits
+   it outright, otherwise it has to be seen more often than every item it
+   would evict (oldest probation items first, then oldest protected ones) */
+static int admit(size_t len, unsigned f) {
+    size_t used = segs[0].bytes + segs[1].bytes;
+    if (used + len <= budget) return 1;
+    size_t need = used + len - budget, freed = 0;
+    for (int s = SEG_PROBATION; s <= SEG_PROTECTED && freed < need; s++) {
+        for (cache_item *v = segs[s].tail; v && freed < need; v = v->prev) {
+            if (sketch_freq(v->hash) >= f) return 0;
+            freed += v->len;
+        }
+    }
+    return freed >= need;
+}
+
+static void make_room(size_t len) {
+    for (int s = SEG_PROBATION; s <= SEG_PROTECTED; s++) {
+        while (segs[0].bytes + segs[1].bytes + len > budget && segs[s].tail) {
+            remove_item(segs[s].tail);
+            st.evicted++;
+        }
+    }
+}
+
+cache_item *cache_fill(const char *name, int fd, size_t len, int codec, uint64_t raw, uint64_t ep) {
+    if (!budget || len > max_item) return NULL;
+    uint64_t h = hash_name(name);
+    pthread_mutex_lock(&mu);
+    int ok = admit(len, sketch_freq(h));
+    if (!ok) st.rejected++;
+    pthread_mutex_unlock(&mu);
+    if (!ok) return NULL;
+
+    // read outside the lock
+    size_t nl = strlen(name);
+    cache_item *it = calloc(1, sizeof(*it) + nl + 1);
+    unsigned char *data = malloc(len ? len : 1);
+    if (!it || !data) { free(it); free(data); return NULL; }
+    size_t got = 0;
+    while (got < len) {
+        ssize_t r = pread(fd, data + got, len - got, got);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        got += r;
+    }
+    if (got < len) { free(it); free(data); return NULL; }
+    it->hash = h;
+    it->len = len;
+    it->codec = codec;
+    it->raw = raw;
+    it->data = data;
+    it->refs = 2;       // the cache's and the caller's
+    memcpy(it->name, name, nl + 1);
+
+    pthread_mutex_lock(&mu);
+    cache_item *cur = lookup(name, h);
+    int stale = gens[h & (ngens - 1)] != ep;
+    if (stale || cur) {
+        // rewritten while we read, or another thread got there first
+        if (cur && !stale) __atomic_add_fetch(&cur->refs, 1, __ATOMIC_RELAXED);
+        else cur = NULL;
+        pthread_mutex_unlock(&mu);
+        free(data);
+        free(it);
+        return cur;
+    }
+    make_room(len);
+    if (nitems >= nbuckets) grow_table();
+    it->hnext = table[h & (nbuckets - 1)];
+    table[h & (nbuckets - 1)] = it;
+    seg_push(it, SEG_PROBATION);
+    nitems++;
+    st.admitted++;
+    pthread_mutex_unlock(&mu);
+    return it;
+}
+
+const unsigned char *cache_data(const cache_item *it, size_t *len) {
+    *len = it->len;
+    return it->data;
+}
+
+int cache_codec(const cache_item *it, uint64_t *raw) {
+    *raw = it->raw;
+    return it->codec;
+}
+
+void cache_release(cache_item *it) {
+    if (it) item_unref(it);
+}
+
+void cache_invalidate(const char *name) {
+    if (!budget) return;
+    uint64_t h = hash_name(name);
+    pthread_mutex_lock(&mu);
+    gens[h & (ngens - 1)]++;
+    cache_item *it = lookup(name, h);
+    if (it) {
+        remove_item(it);
+        st.invalidated++;
+    }
+    pthread_mutex_unlock(&mu);
+}
+
+void cache_stats(cache_stats_t *s) {
+    pthread_mutex_lock(&mu);
+    *s = st;
+    s->items = nitems;
+    s->bytes = segs[0].bytes + segs[1].bytes;
+    pthread_mutex_unlock(&mu);
+}
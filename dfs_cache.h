@@ -0,0 +1,50 @@
+// dfs_cache.h
+// Hot-chunk cache for dfs: whole chunks kept in RAM under a byte budget.
+//
+// Segmented LRU (a probation segment for chunks seen once, a protected one for
+// chunks hit again) with a TinyLFU admission filter: a small count-min sketch
+// of recent GET frequencies decides whether a new chunk is worth more than the
+// ones it would push out, so a scan of cold chunks cannot flush the hot set.
+// Shared by all worker threads; items are reference counted so an evicted or
+// invalidated chunk stays valid for the transfers still sending it.
+
+#ifndef DFS_CACHE_H
+#define DFS_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct cache_item cache_item;
+
+typedef struct {
+    uint64_t hits, misses;
+    uint64_t admitted, rejected, evicted, invalidated;
+    size_t items, bytes, budget;
+} cache_stats_t;
+
+// budget in bytes; 0 leaves the cache disabled (every lookup misses)
+void cache_init(size_t budget);
+int cache_enabled();
+
+/* looks name up and counts the access. On a hit returns a referenced item;
+   on a miss returns NULL and sets *epoch (name's generation) for a following
+   cache_fill. */
+cache_item *cache_get(const char *name, uint64_t *epoch);
+
+/* offers a chunk that missed: if the admission policy takes it, reads len
+   bytes from fd and returns a referenced item. NULL means serve it from the
+   file. An invalidation of name since cache_get discards the copy; other
+   names being rewritten meanwhile do not. codec and raw describe the bytes
+   (as read through the same fd) and are kept with them. */
+cache_item *cache_fill(const char *name, int fd, size_t len, int codec, uint64_t raw, uint64_t epoch);
+
+const unsigned char *cache_data(const cache_item *it, size_t *len);
+int cache_codec(const cache_item *it, uint64_t *raw);   // as given to cache_fill
+void cache_release(cache_item *it);
+
+// drops name (called when a PUT rewrites it)
+void cache_invalidate(const char *name);
+
+void cache_stats(cache_stats_t *s);
+
+#endif
@@ -0,0 +1,136 @@
+// dfs_cas.c
+// Content-addressed chunk store for dfs (see dfs_cas.h).
+//
+// A body is written to a temp file in the object directory while it is
+// hashed, then linked in under its hash; if that object already exists the
+// temp file is dropped and a fresh link to the existing object takes its
+// place. The name is switched over with rename(), so readers see either the
+// old chunk or the new one.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+#include "dfs_cas.h"
+
+#define TMP_PREFIX "tmp."
+
+struct cas_put {
+    EVP_MD_CTX *md;
+    char tmp[1100];
+};
+
+static char casdir[1100];
+static unsigned long tmp_seq;
+
+static void object_path(char *buf, size_t sz, const char *hex) {
+    snprintf(buf, sz, "%s/%.2s/%s", casdir, hex, hex);
+}
+
+// a name in the object directory no other thread or process is using
+static void tmp_path(char *buf, size_t sz) {
+    snprintf(buf, sz, "%s/" TMP_PREFIX "%ld.%lu", casdir, (long)getpid(), __atomic_fetch_add(&tmp_seq, 1, __ATOMIC_RELAXED));
+}
+
+static int valid_hex(const char *hex) {
+    if (strlen(hex) != CAS_HEX_LEN) return 0;
+    for (const char *p = hex; *p; p++) if (!((*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'f'))) return 0;
+    return 1;
+}
+
+// points path at the object through a temp link (rename is a no-op if path already is one)
+static int link_name(const char *obj, const char *path) {
+    char tmp[1100];
+    tmp_path(tmp, sizeof(tmp));
+    if (link(obj, tmp) < 0) return -1;
+    int rc = rename(tmp, path);
+    unlink(tmp);
+    return rc;
+}
+
+long cas_init(const char *storedir) {
+    snprintf(casdir, sizeof(casdir), "%s/.cas", storedir);
+    if (mkdir(casdir, 0755) < 0 && errno != EEXIST) return -1;
+    DIR *d = opendir(casdir);
+    if (!d) return -1;
+    long reclaimed = 0;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        char path[1400];
+        snprintf(path, sizeof(path), "%s/%s", casdir, ent->d_name);
+        if (strncmp(ent->d_name, TMP_PREFIX, strlen(TMP_PREFIX)) == 0) { unlink(path); continue; }
+        if (strlen(ent->d_name) != 2 || ent->d_name[0] == '.') continue;
+        DIR *sub = opendir(path);
+        if (!sub) continue;
+        struct dirent *o;
+        while ((o = readdir(sub)) != NULL) {
+            struct stat st;
+            if (!valid_hex(o->d_name)) continue;
+            if (fstatat(dirfd(sub), o->d_name, &st, 0) == 0 && st.st_nlink == 1 &&
+                unlinkat(dirfd(sub), o->d_name, 0) == 0) reclaimed++;
+        }
+        closedir(sub);
+    }
+    closedir(d);
+    return reclaimed;
+}
+
+cas_put *cas_put_begin(int *fd) {
+    cas_put *p = calloc(1, sizeof(*p));
+    if (!p) return NULL;
+    tmp_path(p->tmp, sizeof(p->tmp));
+    p->md = EVP_MD_CTX_new();
+    if (!p->md || !EVP_DigestInit_ex(p->md, EVP_sha256(), NULL) ||
+        (*fd = open(p->tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) < 0) {
+        EVP_MD_CTX_free(p->md);
+        free(p);
+        return NULL;
+    }
+    return p;
+}
+
+void cas_put_update(cas_put *p, const void *buf, size_t n) {
+    EVP_DigestUpdate(p->md, buf, n);
+}
+
+int cas_put_commit(cas_put *p, const char *path) {
+    unsigned char d[32];
+    char hex[CAS_HEX_LEN + 1], obj[1400];
+    int rc = EVP_DigestFinal_ex(p->md, d, NULL) ? 0 : -1;
+    for (int i = 0; i < 32; i++) sprintf(hex + 2 * i, "%02x", d[i]);
+    object_path(obj, sizeof(obj), hex);
+    if (rc == 0) {
+        char dir[1200];
+        snprintf(dir, sizeof(dir), "%s/%.2s", casdir, hex);
+        if (mkdir(dir, 0755) < 0 && errno != EEXIST) rc = -1;
+    }
+    // new content becomes the object; known content only gains a name
+    if (rc == 0 && link(p->tmp, obj) < 0) rc = errno == EEXIST ? link_name(obj, path) : -1;
+    else if (rc == 0) rc = rename(p->tmp, path);
+    unlink(p->tmp);
+    EVP_MD_CTX_free(p->md);
+    free(p);
+    return rc;
+}
+
+void cas_put_abort(cas_put *p) {
+    if (!p) return;
+    unlink(p->tmp);
+    EVP_MD_CTX_free(p->md);
+    free(p);
+}
+
+int cas_have(const char *hex, const char *path) {
+    char obj[1400];
+    struct stat st;
+    if (!valid_hex(hex)) return -1;
+    object_path(obj, sizeof(obj), hex);
+    if (stat(obj, &st) < 0 || !S_ISREG(st.st_mode)) return -1;
+    return path ? link_name(obj, path) : 0;
+}
@@ -0,0 +1,42 @@
+// dfs_cas.h
+// Content-addressed chunk store for dfs -d.
+//
+// Chunk bodies are kept once per distinct content, as objects named by their
+// SHA-256 under <storedir>/.cas/<first two hex digits>/<64 hex digits>. A
+// chunk name is a hard link to its object, so the link count is the reference
+// count, GET and LIST see ordinary files, and replacing or losing a name drops
+// a reference without any bookkeeping of our own. Objects no name refers to
+// any more (link count 1) are reclaimed when the server starts.
+
+#ifndef DFS_CAS_H
+#define DFS_CAS_H
+
+#include <stddef.h>
+
+#define CAS_HEX_LEN 64
+
+typedef struct cas_put cas_put;
+
+/* makes the object directory and reclaims unreferenced objects and temp files
+   left by an earlier run; returns objects reclaimed, or -1 */
+long cas_init(const char *storedir);
+
+// starts storing a body: *fd is a temp file to write it to; NULL on failure
+cas_put *cas_put_begin(int *fd);
+
+// hashes the next n body bytes (in order, as they are written)
+void cas_put_update(cas_put *p, const void *buf, size_t n);
+
+/* files the body under its hash (or drops it if that content is already
+   stored) and points path at the object; frees p but does not close the fd.
+   0 on success */
+int cas_put_commit(cas_put *p, const char *path);
+
+// drops an unfinished body and frees p
+void cas_put_abort(cas_put *p);
+
+/* 0 if content with this hash (64 hex digits) is stored; with a path, also
+   points path at it */
+int cas_have(const char *hex, const char *path);
+
+#endif
@@ -0,0 +1,288 @@
+// dfs_catalog.c
+// Chunk catalog for dfs (see dfs_catalog.h).
+//
+// Entries are indexed twice: an open-addressing hash table for lookups and
+// updates, and a name-sorted array for prefix/cursor listing. New names go to
+// an unsorted "fresh" list and removed ones are only flagged; the next LIST
+// sorts the fresh names and merges them in, so a PUT never shifts the sorted
+// array.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "dfs_catalog.h"
+
+typedef struct centry {
+    cat_info info;
+    int dead;           // removed; dropped from the sorted array at the next merge
+    char name[];
+} centry;
+
+#define TOMB ((centry *)1)
+#define MAX_SCAN_THREADS 64
+
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+static centry **slots;          // hash index: NULL empty, TOMB deleted
+static size_t nslots, nused;    // nused counts tombstones too
+static size_t nlive;
+static uint64_t live_bytes;
+static centry **order;          // sorted by name, may hold dead entries
+static size_t norder, ndead;
+static centry **fresh;          // cataloged since the last merge, unsorted
+static size_t nfresh, freshcap;
+
+static uint64_t hash_name(const char *s) {
+    uint64_t h = 1469598103934665603ULL;
+    while (*s) { h ^= (unsigned char)*s++; h *= 1099511628211ULL; }
+    return h;
+}
+
+static size_t find_slot(const char *name, int *found) {
+    size_t i = hash_name(name) & (nslots - 1), tomb = (size_t)-1;
+    for (;;) {
+        centry *e = slots[i];
+        if (!e) { *found = 0; return tomb != (size_t)-1 ? tomb : i; }
+        if (e == TOMB) { if (tomb == (size_t)-1) tomb = i; }
+        else if (strcmp(e->name, name) == 0) { *found = 1; return i; }
+        i = (i + 1) & (nslots - 1);
+    }
+}
+
+static int rehash(size_t n) {
+    centry **s = calloc(n, sizeof(*s));
+    if (!s) return -1;
+    for (size_t i = 0; i < nslots; i++) {
+        centry *e = slots[i];
+        if (!e || e == TOMB) continue;
+        size_t j = hash_name(e->name) & (n - 1);
+        while (s[j]) j = (j + 1) & (n - 1);
+        s[j] = e;
+    }
+    free(slots);
+    slots = s;
+    nslots = n;
+    nused = nlive;
+    return 0;
+}
+
+static int by_name(const void *a, const void *b) {
+    return strcmp((*(centry *const *)a)->name, (*(centry *const *)b)->name);
+}
+
+// folds fresh names into the sorted array and drops dead entries
+static void merge() {
+    if (!nfresh && !ndead) return;
+    qsort(fresh, nfresh, sizeof(*fresh), by_name);
+    centry **m = malloc((norder + nfresh + 1) * sizeof(*m));
+    if (!m) return;
+    size_t i = 0, j = 0, n = 0;
+    while (i < norder || j < nfresh) {
+        centry *e;
+        if (j == nfresh || (i < norder && strcmp(order[i]->name, fresh[j]->name) < 0)) e = order[i++];
+        else e = fresh[j++];
+        if (e->dead) free(e);
+        else m[n++] = e;
+    }
+    free(order);
+    order = m;
+    norder = n;
+    nfresh = 0;
+    ndead = 0;
+}
+
+static void put_locked(const char *name, uint64_t size, int64_t mtime_ns) {
+    if ((nused + 1) * 4 > nslots * 3 && rehash(nslots ? nslots * 2 : 1024) < 0) return;
+    int found;
+    size_t i = find_slot(name, &found);
+    if (found) {
+        live_bytes -= slots[i]->info.size;
+        slots[i]->info.size = size;
+        slots[i]->info.mtime_ns = mtime_ns;
+        live_bytes += size;
+        return;
+    }
+    if (nfresh == freshcap) {
+        size_t cap = freshcap ? freshcap * 2 : 256;
+        centry **f = realloc(fresh, cap * sizeof(*f));
+        if (!f) return;
+        fresh = f;
+        freshcap = cap;
+    }
+    size_t L = strlen(name);
+    centry *e = malloc(sizeof(*e) + L + 1);
+    if (!e) return;
+    e->info.size = size;
+    e->info.mtime_ns = mtime_ns;
+    e->dead = 0;
+    memcpy(e->name, name, L + 1);
+    if (!slots[i]) nused++;
+    slots[i] = e;
+    fresh[nfresh++] = e;
+    nlive++;
+    live_bytes += size;
+}
+
+void catalog_put(const char *name, uint64_t size, int64_t mtime_ns) {
+    pthread_rwlock_wrlock(&lock);
+    put_locked(name, size, mtime_ns);
+    pthread_rwlock_unlock(&lock);
+}
+
+void catalog_remove(const char *name) {
+    pthread_rwlock_wrlock(&lock);
+    int found;
+    if (nslots) {
+        size_t i = find_slot(name, &found);
+        if (found) {
+            slots[i]->dead = 1;
+            live_bytes -= slots[i]->info.size;
+            slots[i] = TOMB;
+            nlive--;
+            ndead++;
+        }
+    }
+    pthread_rwlock_unlock(&lock);
+}
+
+int catalog_lookup(const char *name, cat_info *out) {
+    int found = 0;
+    pthread_rwlock_rdlock(&lock);
+    if (nslots) {
+        size_t i = find_slot(name, &found);
+        if (found) *out = slots[i]->info;
+    }
+    pthread_rwlock_unlock(&lock);
+    return found ? 0 : -1;
+}
+
+// first index in order whose name is >= key (> key if strict)
+static size_t lower_bound(const char *key, int strict) {
+    size_t lo = 0, hi = norder;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int c = strcmp(order[mid]->name, key);
+        if (c < 0 || (strict && c == 0)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+size_t catalog_list(const char *prefix, const char *after, size_t limit, int *more,
+                    int (*fn)(void *arg, const char *name, const cat_info *info), void *arg) {
+    size_t plen = prefix ? strlen(prefix) : 0;
+    size_t n = 0;
+    *more = 0;
+    pthread_rwlock_wrlock(&lock);
+    merge();
+    size_t i;
+    if (after && (!prefix || strcmp(after, prefix) >= 0)) i = lower_bound(after, 1);
+    else i = prefix ? lower_bound(prefix, 0) : 0;
+    for (; i < norder; i++) {
+        centry *e = order[i];
+        if (plen && strncmp(e->name, prefix, plen) != 0) break;
+        if (limit && n == limit) { *more = 1; break; }
+        n++;
+        if (fn(arg, e->name, &e->info)) break;
+    }
+    pthread_rwlock_unlock(&lock);
+    return n;
+}
+
+void catalog_totals(size_t *count, uint64_t *bytes) {
+    pthread_rwlock_rdlock(&lock);
+    *count = nlive;
+    *bytes = live_bytes;
+    pthread_rwlock_unlock(&lock);
+}
+
+/* Startup scan: names come from one readdir pass, then the stat calls (the
+   slow part on a cold cache) are split across threads. */
+
+typedef struct {
+    int dirfd;
+    char **names;
+    struct stat *st;
+    char *ok;
+    size_t from, to;
+} scan_part;
+
+static void *scan_worker(void *arg) {
+    scan_part *p = arg;
+    for (size_t i = p->from; i < p->to; i++) {
+        p->ok[i] = fstatat(p->dirfd, p->names[i], &p->st[i], 0) == 0 && S_ISREG(p->st[i].st_mode);
+    }
+    return NULL;
+}
+
+static void clear_locked() {
+    merge();
+    for (size_t i = 0; i < norder; i++) free(order[i]);
+    free(order); order = NULL; norder = 0;
+    free(slots); slots = NULL; nslots = nused = 0;
+    nlive = 0;
+    live_bytes = 0;
+}
+
+long catalog_load(const char *dir, int nthreads) {
+    DIR *d = opendir(dir);
+    if (!d) return -1;
+    size_t n = 0, cap = 1024;
+    char **names = malloc(cap * sizeof(*names));
+    struct dirent *ent;
+    while (names && (ent = readdir(d)) != NULL) {
+        if (ent->d_type != DT_REG && ent->d_type != DT_LNK && ent->d_type != DT_UNKNOWN) continue;
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+        if (n == cap) {
+            char **nn = realloc(names, (cap *= 2) * sizeof(*names));
+            if (!nn) break;
+            names = nn;
+        }
+        names[n++] = strdup(ent->d_name);
+    }
+    struct stat *st = malloc((n ? n : 1) * sizeof(*st));
+    char *ok = calloc(n ? n : 1, 1);
+    if (!names || !st || !ok) {
+        closedir(d);
+        for (size_t i = 0; names && i < n; i++) free(names[i]);
+        free(names); free(st); free(ok);
+        return -1;
+    }
+    // no point in a thread for a handful of names
+    if ((size_t)nthreads > n / 256 + 1) nthreads = n / 256 + 1;
+    if (nthreads > MAX_SCAN_THREADS) nthreads = MAX_SCAN_THREADS;
+    if (nthreads < 1) nthreads = 1;
+    scan_part parts[MAX_SCAN_THREADS];
+    pthread_t th[MAX_SCAN_THREADS];
+    char started[MAX_SCAN_THREADS] = {0};
+    for (int t = 0; t < nthreads; t++) {
+        parts[t] = (scan_part){ dirfd(d), names, st, ok, n * t / nthreads, n * (t + 1) / nthreads };
+        if (t > 0) started[t] = pthread_create(&th[t], NULL, scan_worker, &parts[t]) == 0;
+    }
+    scan_worker(&parts[0]);
+    for (int t = 1; t < nthreads; t++) {
+        if (started[t]) pthread_join(th[t], NULL);
+        else scan_worker(&parts[t]);
+    }
+    closedir(d);
+
+    pthread_rwlock_wrlock(&lock);
+    clear_locked();
+    long count = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (ok[i]) {
+            put_locked(names[i], st[i].st_size, (int64_t)st[i].st_mtim.tv_sec * 1000000000LL + st[i].st_mtim.tv_nsec);
+            count++;
+        }
+        free(names[i]);
+    }
+    merge();
+    pthread_rwlock_unlock(&lock);
+    free(names); free(st); free(ok);
+    return count;
+}
@@ -0,0 +1,38 @@
+// dfs_catalog.h
+// In-memory catalog of the chunks in a dfs store: name, size, mtime.
+//
+// Built once at startup by scanning the store (stat calls spread over worker
+// threads) and kept current by the server as PUTs complete, so LIST never has
+// to read the directory. Safe to use from several threads.
+
+#ifndef DFS_CATALOG_H
+#define DFS_CATALOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct {
+    uint64_t size;
+    int64_t mtime_ns;
+} cat_info;
+
+// scans dir with nthreads stat workers, replacing the current contents; returns chunks found or -1
+long catalog_load(const char *dir, int nthreads);
+
+void catalog_put(const char *name, uint64_t size, int64_t mtime_ns);
+void catalog_remove(const char *name);
+
+// 0 and *out filled if name is cataloged, -1 otherwise
+int catalog_lookup(const char *name, cat_info *out);
+
+/* calls fn for up to limit chunks (0 = no limit) whose names start with
+   prefix and sort after `after` (either may be NULL), in name order. fn may
+   return nonzero to stop. returns the number visited; *more is set when
+   further matches exist beyond the limit. */
+size_t catalog_list(const char *prefix, const char *after, size_t limit, int *more,
+                    int (*fn)(void *arg, const char *name, const cat_info *info), void *arg);
+
+// totals for reporting
+void catalog_totals(size_t *count, uint64_t *bytes);
+
+#endif
@@ -0,0 +1,111 @@
+// dfs_codec.c
+// Chunk compression codecs (see dfs_codec.h). A new codec is one more
+// dfs_codecs entry; its name is what goes on the wire and in the xattr.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "dfs_codec.h"
+
+#define ZLIB_OUT 65536      // decompressed bytes handed on per call
+#define ZLIB_SLICE (1u << 30)
+
+static unsigned char *zlib_compress(const unsigned char *p, size_t n, int level, size_t max, size_t *outlen) {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (deflateInit(&z, level < 0 ? Z_DEFAULT_COMPRESSION : level) != Z_OK) return NULL;
+    size_t cap = deflateBound(&z, n), have = 0;
+    if (cap > max) cap = max;
+    unsigned char *out = malloc(cap ? cap : 1);
+    int rc = out ? Z_OK : Z_MEM_ERROR;
+    size_t left = n;
+    z.next_in = (unsigned char *)p;
+    // avail_in/avail_out are 32-bit, so large chunks go through in slices
+    while (rc == Z_OK) {
+        uInt in = left > ZLIB_SLICE ? ZLIB_SLICE : left;
+        z.avail_in = in;
+        z.next_out = out + have;
+        z.avail_out = cap - have > ZLIB_SLICE ? ZLIB_SLICE : cap - have;
+        if (!z.avail_out) break;    // would not fit in max
+        rc = deflate(&z, in == left ? Z_FINISH : Z_NO_FLUSH);
+        left -= in - z.avail_in;
+        have = z.next_out - out;
+        if (rc == Z_BUF_ERROR) rc = Z_OK;
+    }
+    deflateEnd(&z);
+    if (rc != Z_STREAM_END) { free(out); return NULL; }
+    *outlen = have;
+    return out;
+}
+
+struct codec_stream {
+    z_stream z;
+    int done;
+};
+
+static codec_stream *zlib_dec_new(void) {
+    codec_stream *s = calloc(1, sizeof(*s));
+    if (s && inflateInit(&s->z) != Z_OK) { free(s); s = NULL; }
+    return s;
+}
+
+static int zlib_dec_update(codec_stream *s, const unsigned char *p, size_t n, codec_sink out, void *arg) {
+    unsigned char buf[ZLIB_OUT];
+    while (n) {
+        if (s->done) return -1;     // bytes past the end of the stream
+        size_t in = n > ZLIB_SLICE ? ZLIB_SLICE : n;
+        s->z.next_in = (unsigned char *)p;
+        s->z.avail_in = in;
+        do {
+            s->z.next_out = buf;
+            s->z.avail_out = sizeof(buf);
+            int rc = inflate(&s->z, Z_NO_FLUSH);
+            if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) return -1;
+            size_t got = sizeof(buf) - s->z.avail_out;
+            if (got && out(arg, buf, got)) return -1;
+            if (rc == Z_STREAM_END) { s->done = 1; break; }
+            if (rc == Z_BUF_ERROR && !got) break;
+        } while (s->z.avail_in || !s->z.avail_out);
+        if (s->done && s->z.avail_in) return -1;
+        p += in; n -= in;
+    }
+    return 0;
+}
+
+static int zlib_dec_end(codec_stream *s) {
+    if (!s) return -1;
+    int done = s->done;
+    inflateEnd(&s->z);
+    free(s);
+    return done ? 0 : -1;
+}
+
+const dfs_codec dfs_codecs[] = {
+    { "zlib", zlib_compress, zlib_dec_new, zlib_dec_update, zlib_dec_end },
+};
+const int dfs_ncodecs = sizeof(dfs_codecs) / sizeof(dfs_codecs[0]);
+
+int codec_find(const char *name) {
+    for (int i = 0; i < dfs_ncodecs; i++) if (strcmp(dfs_codecs[i].name, name) == 0) return i;
+    return -1;
+}
+
+void codec_names(unsigned mask, char *buf, size_t n) {
+    size_t len = 0;
+    if (n) buf[0] = 0;
+    for (int i = 0; i < dfs_ncodecs && len < n; i++) {
+        if (mask & (1u << i)) len += snprintf(buf + len, n - len, "%s%s", len ? "," : "", dfs_codecs[i].name);
+    }
+}
+
+unsigned codec_mask(const char *names) {
+    unsigned mask = 0;
+    char buf[256], *save, *tok;
+    snprintf(buf, sizeof(buf), "%s", names);
+    for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        int i = codec_find(tok);
+        if (i >= 0) mask |= 1u << i;
+    }
+    return mask;
+}
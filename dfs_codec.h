@@ -0,0 +1,49 @@
+// dfs_codec.h
+// Chunk compression codecs shared by dfs and dfc.
+//
+// A PUT may carry "CODEC <name> <raw size>" ahead of its other words, in
+// which case its body is the chunk compressed with that codec. dfs stores the
+// compressed bytes as they came and notes the codec and raw size in the
+// chunk's CODEC_XATTR. Sessions say which codecs they read in the PROTO
+// handshake ("PROTO <v> CODECS a,b", answered with the ones both ends know).
+// A GET of a compressed chunk on a session that reads its codec is answered
+// "OK <len> <codec> <raw size>" with the stored bytes; any other session gets
+// the raw chunk, decompressed by the server.
+
+#ifndef DFS_CODEC_H
+#define DFS_CODEC_H
+
+#include <stddef.h>
+
+#define CODEC_XATTR "user.dfs.codec"    // "<codec> <raw size>"
+
+typedef struct codec_stream codec_stream;
+
+// receives decompressed bytes; nonzero stops the stream
+typedef int (*codec_sink)(void *arg, const unsigned char *p, size_t n);
+
+typedef struct {
+    const char *name;
+    /* compresses n bytes at level (-1 for the codec's default) into a malloc'd
+       buffer of *outlen bytes; NULL if that would take more than max bytes */
+    unsigned char *(*compress)(const unsigned char *p, size_t n, int level, size_t max, size_t *outlen);
+    codec_stream *(*dec_new)(void);
+    // feeds n compressed bytes; -1 on corrupt input or if out refused its bytes
+    int (*dec_update)(codec_stream *s, const unsigned char *p, size_t n, codec_sink out, void *arg);
+    // frees the stream; 0 if the compressed data ended exactly where it should
+    int (*dec_end)(codec_stream *s);
+} dfs_codec;
+
+extern const dfs_codec dfs_codecs[];
+extern const int dfs_ncodecs;   // at most 32: sessions hold codecs as a bit mask
+
+// index of the codec called name in dfs_codecs, or -1
+int codec_find(const char *name);
+
+// comma-separated names of the codecs in mask
+void codec_names(unsigned mask, char *buf, size_t n);
+
+// mask of the known codecs among comma-separated names
+unsigned codec_mask(const char *names);
+
+#endif
@@ -0,0 +1,83 @@
+// dfs_commit.c
+// Group commit for durable PUTs (see dfs_commit.h).
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "dfs_commit.h"
+
+static pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cv = PTHREAD_COND_INITIALIZER;
+static commit_item *queue;      // newest first
+static commit_stats_t stats;
+static int dirfd_ = -1;
+static int window_ms;
+
+static void *commit_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&mu);
+        while (!queue) pthread_cond_wait(&cv, &mu);
+        pthread_mutex_unlock(&mu);
+        // the first body in sets the clock; whatever finishes meanwhile rides along
+        if (window_ms > 0) {
+            struct timespec ts = { window_ms / 1000, (long)(window_ms % 1000) * 1000000L };
+            nanosleep(&ts, NULL);
+        }
+        pthread_mutex_lock(&mu);
+        commit_item *batch = NULL, *it = queue;
+        queue = NULL;
+        pthread_mutex_unlock(&mu);
+        // oldest first
+        while (it) {
+            commit_item *next = it->next;
+            it->next = batch;
+            batch = it;
+            it = next;
+        }
+        int data = syncfs(dirfd_);
+        unsigned long long n = 0, failed = 0;
+        for (it = batch; it; it = it->next) it->rc = data == 0 ? it->publish(it) : -1;
+        int names = syncfs(dirfd_);
+        for (it = batch; it; ) {
+            commit_item *next = it->next;
+            int rc = it->rc == 0 && names == 0 ? 0 : -1;
+            n++;
+            failed += rc < 0;
+            it->done(it, rc);
+            it = next;
+        }
+        pthread_mutex_lock(&mu);
+        stats.groups++;
+        stats.items += n;
+        stats.failed += failed;
+        pthread_mutex_unlock(&mu);
+    }
+    return NULL;
+}
+
+int commit_start(const char *dir, int window) {
+    pthread_t tid;
+    window_ms = window;
+    dirfd_ = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd_ < 0 || pthread_create(&tid, NULL, commit_main, NULL) != 0) return -1;
+    pthread_detach(tid);
+    return 0;
+}
+
+void commit_submit(commit_item *it) {
+    pthread_mutex_lock(&mu);
+    it->next = queue;
+    queue = it;
+    pthread_cond_signal(&cv);
+    pthread_mutex_unlock(&mu);
+}
+
+void commit_stats(commit_stats_t *s) {
+    pthread_mutex_lock(&mu);
+    *s = stats;
+    pthread_mutex_unlock(&mu);
+}
@@ -0,0 +1,37 @@
+// dfs_commit.h
+// Group commit for durable PUTs (dfs -s <ms>).
+//
+// A finished PUT body is handed to one syncer thread instead of being
+// fsync()ed by the worker that received it. The syncer waits up to the
+// window for more bodies to join, then makes the whole group durable with a
+// single syncfs(), publishes each chunk (renames it into place), and syncs
+// once more so the new names are durable too, before any PUT in the group is
+// answered. Two flushes are shared by however many PUTs finished together.
+
+#ifndef DFS_COMMIT_H
+#define DFS_COMMIT_H
+
+typedef struct commit_item commit_item;
+
+struct commit_item {
+    // runs once the data is on disk: puts the chunk in place; 0 on success
+    int (*publish)(commit_item *it);
+    // runs last with the outcome (0: published and durable); the item is not touched after
+    void (*done)(commit_item *it, int rc);
+    commit_item *next;
+    int rc;
+};
+
+typedef struct {
+    unsigned long long groups, items, failed;
+} commit_stats_t;
+
+// starts the syncer for the filesystem holding dir; 0 on success
+int commit_start(const char *dir, int window_ms);
+
+// queues a finished body; publish and done run on the syncer thread
+void commit_submit(commit_item *it);
+
+void commit_stats(commit_stats_t *s);
+
+#endif
@@ -0,0 +1,48 @@
+// dfs_delta.h
+// Delta uploads shared by dfs and dfc (rsync-style).
+//
+// "SIGS <chunk> <block size>" returns a signature per full block of the
+// server's copy: the 32-bit rolling sum of the block, then the first 8 bytes
+// of its MD5 (DELTA_SIG_LEN bytes, network byte order). The client slides the
+// rolling sum over its new data to find blocks the server already has, and
+// sends "PATCH <chunk> <len> <new size> <md5 hex>" whose len-byte payload is a
+// list of instructions:
+//   'C' offset(8) length(8)   copy bytes of the old chunk
+//   'D' length(8) <bytes>     literal data
+// The server rebuilds the chunk, checks its size and MD5, and replaces the old
+// copy only if both match.
+
+#ifndef DFS_DELTA_H
+#define DFS_DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DELTA_SIG_LEN 12
+#define DELTA_STRONG_LEN 8
+#define DELTA_COPY 'C'
+#define DELTA_DATA 'D'
+#define DELTA_MIN_BLOCK 512
+#define DELTA_MAX_BLOCK (16 << 20)
+#define DELTA_MAX (64 << 20)    // largest PATCH payload a server takes
+
+/* rsync's weak sum of n bytes: a = sum of bytes, b = sum of (n - i) * byte i,
+   each mod 2^16, as a | b << 16 */
+static inline uint32_t delta_weak(const unsigned char *p, size_t n) {
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < n; i++) {
+        a += p[i];
+        b += (uint32_t)(n - i) * p[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+// the weak sum of the n bytes one further on: out leaves the window, in joins it
+static inline uint32_t delta_roll(uint32_t s, unsigned char out, unsigned char in, size_t n) {
+    uint32_t a = s & 0xffff, b = s >> 16;
+    a = (a - out + in) & 0xffff;
+    b = (b - (uint32_t)n * out + a) & 0xffff;
+    return a | b << 16;
+}
+
+#endif
@@ -0,0 +1,108 @@
+// dfs_proto.h
+// Binary framing shared by dfs and dfc (protocol version 2).
+//
+// A session starts in the text protocol. A client that sends "PROTO 2\n" and
+// gets "OK 2\n" back speaks frames from then on; older servers answer "ERR\n"
+// and the client stays with text lines.
+//
+// Every request and reply is a 20-byte header (network byte order)
+//   magic(1) version(1) opcode(1) flags(1) reqid(4) namelen(2) arglen(2) paylen(8)
+// followed by namelen bytes of chunk name, arglen bytes of argument text (the
+// words that follow the name in the text command) and paylen bytes of payload.
+// Replies use opcode OP_REPLY, echo the request id, carry the words after
+// "OK"/"ERR" as argument text and the body (GET data, LIST lines) as payload.
+
+#ifndef DFS_PROTO_H
+#define DFS_PROTO_H
+
+#include <stdint.h>
+
+#define DFS_MAGIC 0xDF
+#define DFS_PROTO_VERSION 2
+#define DFS_HDR_LEN 20
+
+enum {
+    OP_PUT = 1,
+    OP_GET = 2,
+    OP_LIST = 3,
+    OP_HAVE = 4,
+    OP_SIGS = 5,
+    OP_PATCH = 6,
+    OP_PUSH = 7,
+    OP_DEL = 8,
+    OP_STATS = 9,
+    OP_STAT = 10,
+    OP_MPUT = 11,
+    OP_MGET = 12,
+    OP_REPLY = 0x80
+};
+
+/* MPUT and MGET move many small chunks in one request. An MPUT payload is a
+   run of records
+     namelen(2) name len(8) body
+   and its reply body has one byte per record, 1 if that chunk was stored.
+   An MGET payload is chunk names, one per line; its reply body has a record
+   per name, in order,
+     status(1) len(8) body
+   with status 1 and the chunk's bytes (decompressed), or status 0 and no
+   body if the chunk could not be read or would take the reply past
+   DFS_BATCH_MAX. Neither payload may be larger than that either. */
+#define DFS_BATCH_MAX (64ULL << 20)
+#define DFS_MPUT_REC_LEN(namelen, len) (2 + (namelen) + 8 + (len))
+#define DFS_MGET_REC_LEN(len) (1 + 8 + (len))
+
+#define DFS_F_ERR 0x01      // reply: command failed
+
+typedef struct {
+    uint8_t opcode;
+    uint8_t flags;
+    uint32_t reqid;
+    uint16_t namelen;
+    uint16_t arglen;
+    uint64_t paylen;
+} dfs_hdr;
+
+static inline void dfs_put16(unsigned char *b, uint16_t v) { b[0] = v >> 8; b[1] = v; }
+
+static inline void dfs_put32(unsigned char *b, uint32_t v) {
+    dfs_put16(b, v >> 16); dfs_put16(b + 2, v);
+}
+
+static inline void dfs_put64(unsigned char *b, uint64_t v) {
+    dfs_put32(b, v >> 32); dfs_put32(b + 4, v);
+}
+
+static inline uint16_t dfs_get16(const unsigned char *b) { return (uint16_t)(b[0] << 8 | b[1]); }
+
+static inline uint32_t dfs_get32(const unsigned char *b) {
+    return (uint32_t)dfs_get16(b) << 16 | dfs_get16(b + 2);
+}
+
+static inline uint64_t dfs_get64(const unsigned char *b) {
+    return (uint64_t)dfs_get32(b) << 32 | dfs_get32(b + 4);
+}
+
+static inline void dfs_hdr_pack(unsigned char *b, const dfs_hdr *h) {
+    b[0] = DFS_MAGIC;
+    b[1] = DFS_PROTO_VERSION;
+    b[2] = h->opcode;
+    b[3] = h->flags;
+    dfs_put32(b + 4, h->reqid);
+    dfs_put16(b + 8, h->namelen);
+    dfs_put16(b + 10, h->arglen);
+    dfs_put64(b + 12, h->paylen);
+}
+
+// returns -1 if the bytes are not a version 2 frame header
+static inline int dfs_hdr_unpack(const unsigned char *b, dfs_hdr *h) {
+    if (b[0] != DFS_MAGIC || b[1] != DFS_PROTO_VERSION) return -1;
+    h->opcode = b[2];
+    h->flags = b[3];
+    h->reqid = dfs_get32(b + 4);
+    h->namelen = dfs_get16(b + 8);
+    h->arglen = dfs_get16(b + 10);
+    h->paylen = dfs_get64(b + 12);
+    return 0;
+}
+
+#endif
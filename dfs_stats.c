@@ -0,0 +1,217 @@
+// dfs_stats.c
+// Request counters and latency histograms (see dfs_stats.h).
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "dfs_stats.h"
+
+#define SUB_BITS 3
+#define SUB (1 << SUB_BITS)         // buckets per doubling
+#define BUCKETS (SUB * 34)          // up to ~9.5 hours, in microseconds
+#define SHARDS 8
+
+typedef struct {
+    uint64_t count, errors, bytes_in, bytes_out, total_us, max_us;
+    uint64_t hist[BUCKETS];
+} op_stats;
+
+typedef struct {
+    uint64_t start_ns;
+    uint64_t conns, conns_total;
+    unsigned next_shard;
+    op_stats ops[];                 // SHARDS * nslots, shard-major
+} region_t;
+
+static region_t *reg;
+static const char *const *slot_names;
+static int nslots;
+static __thread int shard = -1;     // a -f child inherits -1 and picks its own
+
+static int bucket_of(uint64_t us) {
+    if (us < SUB) return (int)us;
+    int e = 63 - __builtin_clzll(us);
+    int b = (e - SUB_BITS + 1) * SUB + (int)((us >> (e - SUB_BITS)) & (SUB - 1));
+    return b < BUCKETS ? b : BUCKETS - 1;
+}
+
+// smallest value that lands past bucket b
+static uint64_t bucket_top(int b) {
+    b++;
+    if (b < SUB) return b;
+    return (uint64_t)(SUB + b % SUB) << (b / SUB - 1);
+}
+
+uint64_t stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int stats_init(const char *const *names, int n) {
+    size_t sz = sizeof(region_t) + (size_t)SHARDS * n * sizeof(op_stats);
+    void *p = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return -1;
+    reg = p;
+    reg->start_ns = stats_now();
+    slot_names = names;
+    nslots = n;
+    return 0;
+}
+
+static op_stats *my_ops() {
+    if (shard < 0) shard = __atomic_fetch_add(&reg->next_shard, 1, __ATOMIC_RELAXED) % SHARDS;
+    return reg->ops + (size_t)shard * nslots;
+}
+
+#define ADD(field, v) __atomic_fetch_add(&(field), (v), __ATOMIC_RELAXED)
+
+void stats_request(int slot, uint64_t t0, int ok, uint64_t in, uint64_t out) {
+    if (!reg || slot < 0 || slot >= nslots) return;
+    uint64_t now = stats_now(), us = now > t0 ? (now - t0) / 1000 : 0;
+    op_stats *o = my_ops() + slot;
+    ADD(o->count, 1);
+    if (!ok) ADD(o->errors, 1);
+    if (in) ADD(o->bytes_in, in);
+    if (out) ADD(o->bytes_out, out);
+    ADD(o->total_us, us);
+    ADD(o->hist[bucket_of(us)], 1);
+    uint64_t m = __atomic_load_n(&o->max_us, __ATOMIC_RELAXED);
+    while (us > m && !__atomic_compare_exchange_n(&o->max_us, &m, us, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+void stats_conn(int delta) {
+    if (!reg) return;
+    ADD(reg->conns, (uint64_t)(int64_t)delta);
+    if (delta > 0) ADD(reg->conns_total, 1);
+}
+
+// slot summed over the shards
+static void snapshot(int slot, op_stats *s) {
+    memset(s, 0, sizeof(*s));
+    for (int i = 0; i < SHARDS; i++) {
+        const op_stats *o = reg->ops + (size_t)i * nslots + slot;
+        s->count += __atomic_load_n(&o->count, __ATOMIC_RELAXED);
+        s->errors += __atomic_load_n(&o->errors, __ATOMIC_RELAXED);
+        s->bytes_in += __atomic_load_n(&o->bytes_in, __ATOMIC_RELAXED);
+        s->bytes_out += __atomic_load_n(&o->bytes_out, __ATOMIC_RELAXED);
+        s->total_us += __atomic_load_n(&o->total_us, __ATOMIC_RELAXED);
+        uint64_t m = __atomic_load_n(&o->max_us, __ATOMIC_RELAXED);
+        if (m > s->max_us) s->max_us = m;
+        for (int b = 0; b < BUCKETS; b++) s->hist[b] += __atomic_load_n(&o->hist[b], __ATOMIC_RELAXED);
+    }
+}
+
+// upper edge of the bucket holding quantile q, never past the largest seen
+static uint64_t quantile(const op_stats *s, double q) {
+    uint64_t n = 0, total = 0;
+    for (int b = 0; b < BUCKETS; b++) total += s->hist[b];
+    if (!total) return 0;
+    uint64_t rank = (uint64_t)(q * total);
+    if (rank >= total) rank = total - 1;
+    for (int b = 0; b < BUCKETS; b++) {
+        n += s->hist[b];
+        if (n > rank) {
+            uint64_t top = bucket_top(b) - 1;
+            return top < s->max_us ? top : s->max_us;
+        }
+    }
+    return s->max_us;
+}
+
+char *stats_format(int json, const stats_gauge *g, int ng, size_t *len) {
+    char *buf = NULL;
+    FILE *f = open_memstream(&buf, len);
+    if (!f || !reg) { if (f) fclose(f); free(buf); return NULL; }
+    double up = (stats_now() - reg->start_ns) / 1e9;
+    uint64_t conns = __atomic_load_n(&reg->conns, __ATOMIC_RELAXED);
+    uint64_t conns_total = __atomic_load_n(&reg->conns_total, __ATOMIC_RELAXED);
+    op_stats *s = malloc(sizeof(*s));
+    if (!s) { fclose(f); free(buf); return NULL; }
+    if (json) {
+        fprintf(f, "{\"uptime_s\":%.3f,\"connections\":%llu,\"connections_total\":%llu",
+                up, (unsigned long long)conns, (unsigned long long)conns_total);
+        for (int i = 0; i < ng; i++) fprintf(f, ",\"%s\":%llu", g[i].name, (unsigned long long)g[i].v);
+        fprintf(f, ",\"ops\":{");
+        int first = 1;
+        for (int i = 0; i < nslots; i++) {
+            snapshot(i, s);
+            if (!s->count) continue;
+            fprintf(f, "%s\"%s\":{\"count\":%llu,\"errors\":%llu,\"bytes_in\":%llu,\"bytes_out\":%llu,"
+                    "\"mean_us\":%llu,\"p50_us\":%llu,\"p99_us\":%llu,\"p999_us\":%llu,\"max_us\":%llu,\"hist\":[",
+                    first ? "" : ",", slot_names[i], (unsigned long long)s->count, (unsigned long long)s->errors,
+                    (unsigned long long)s->bytes_in, (unsigned long long)s->bytes_out,
+                    (unsigned long long)(s->total_us / s->count), (unsigned long long)quantile(s, 0.5),
+                    (unsigned long long)quantile(s, 0.99), (unsigned long long)quantile(s, 0.999),
+                    (unsigned long long)s->max_us);
+            // nonzero buckets as [upper edge us, count]
+            int fb = 1;
+            for (int b = 0; b < BUCKETS; b++) {
+                if (!s->hist[b]) continue;
+                fprintf(f, "%s[%llu,%llu]", fb ? "" : ",", (unsigned long long)bucket_top(b),
+                        (unsigned long long)s->hist[b]);
+                fb = 0;
+            }
+            fprintf(f, "]}");
+            first = 0;
+        }
+        fprintf(f, "}}\n");
+    } else {
+        fprintf(f, "uptime_s %.3f\nconnections %llu\nconnections_total %llu\n",
+                up, (unsigned long long)conns, (unsigned long long)conns_total);
+        for (int i = 0; i < ng; i++) fprintf(f, "%s %llu\n", g[i].name, (unsigned long long)g[i].v);
+        fprintf(f, "%-6s %10s %8s %14s %14s %9s %9s %9s %9s %9s\n", "op", "count", "errors",
+                "bytes_in", "bytes_out", "mean_us", "p50_us", "p99_us", "p999_us", "max_us");
+        for (int i = 0; i < nslots; i++) {
+            snapshot(i, s);
+            if (!s->count) continue;
+            fprintf(f, "%-6s %10llu %8llu %14llu %14llu %9llu %9llu %9llu %9llu %9llu\n", slot_names[i],
+                    (unsigned long long)s->count, (unsigned long long)s->errors,
+                    (unsigned long long)s->bytes_in, (unsigned long long)s->bytes_out,
+                    (unsigned long long)(s->total_us / s->count), (unsigned long long)quantile(s, 0.5),
+                    (unsigned long long)quantile(s, 0.99), (unsigned long long)quantile(s, 0.999),
+                    (unsigned long long)s->max_us);
+        }
+    }
+    free(s);
+    if (fclose(f) != 0) { free(buf); return NULL; }
+    return buf;
+}
+
+static const char *dump_path;
+static int dump_interval;
+static int (*dump_gauges)(stats_gauge *g, int max);
+
+static void *dump_main(void *arg) {
+    (void)arg;
+    char tmp[1100];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", dump_path);
+    for (;;) {
+        sleep(dump_interval);
+        stats_gauge g[STATS_GAUGES_MAX];
+        int ng = dump_gauges ? dump_gauges(g, STATS_GAUGES_MAX) : 0;
+        size_t len;
+        char *s = stats_format(1, g, ng, &len);
+        FILE *f = s ? fopen(tmp, "w") : NULL;
+        int ok = f && fwrite(s, 1, len, f) == len;
+        if (f && fclose(f) != 0) ok = 0;
+        if (!ok || rename(tmp, dump_path) < 0) perror(dump_path);
+        free(s);
+    }
+    return NULL;
+}
+
+int stats_dump_start(const char *path, int interval, int (*fn)(stats_gauge *g, int max)) {
+    pthread_t tid;
+    dump_path = path;
+    dump_interval = interval;
+    dump_gauges = fn;
+    if (pthread_create(&tid, NULL, dump_main, NULL) != 0) return -1;
+    pthread_detach(tid);
+    return 0;
+}
@@ -0,0 +1,48 @@
+// dfs_stats.h
+// Request counters and latency histograms for dfs (the STATS command, -S).
+//
+// Per command: requests, errors, payload bytes in and out, and a log-linear
+// histogram of service time (8 buckets per doubling, so percentiles are
+// within ~12%). Everything lives in one anonymous MAP_SHARED region mapped
+// before any thread or -f child exists, so all of them count into the same
+// memory. Updates are relaxed atomic adds, no locks; the region is split into
+// shards (threads and children pick one each) so concurrent workers do not
+// fight over the same cache lines. Readers sum the shards, so a snapshot
+// taken under load may be a few requests out of step with itself.
+
+#ifndef DFS_STATS_H
+#define DFS_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// an extra "name value" line, for numbers the caller keeps itself
+typedef struct {
+    const char *name;
+    uint64_t v;
+} stats_gauge;
+
+#define STATS_GAUGES_MAX 16
+
+/* maps the region for nslots commands, named by names[0..nslots) (slot 0 is
+   for unknown commands). Call once, before starting threads or forking. */
+int stats_init(const char *const *names, int nslots);
+
+uint64_t stats_now();   // CLOCK_MONOTONIC, ns
+
+// one request of slot served, from t0 (stats_now()) until now
+void stats_request(int slot, uint64_t t0, int ok, uint64_t in, uint64_t out);
+
+// connections: +1 on accept, -1 on close
+void stats_conn(int delta);
+
+/* the counters and gauges as text ("name value" lines, then a table of the
+   commands seen) or as a JSON object; malloc()ed, NULL if out of memory */
+char *stats_format(int json, const stats_gauge *g, int ng, size_t *len);
+
+/* writes the JSON form to path every interval seconds (to a temp file renamed
+   over it, so readers never see half a dump) from a thread of its own. The
+   gauges come from fn, which fills up to STATS_GAUGES_MAX and returns how many. */
+int stats_dump_start(const char *path, int interval, int (*fn)(stats_gauge *g, int max));
+
+#endif
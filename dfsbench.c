@@ -0,0 +1,807 @@
+// dfsbench.c
+// Load generator for dfs: starts local servers on loopback and drives a mix
+// of PUT, GET and LIST against them from many connections at once.
+// Usage: ./dfsbench [options]   (./dfsbench -h lists them)
+//
+// Objects are keys "b<n>" of the key space, each stored on two servers (the
+// key's hash picks the first, the next one holds the copy), preloaded before
+// the timed run. A PUT sends both copies, a GET asks the first server and
+// falls back to the second, a LIST pages through one server's catalog. Keys
+// are drawn uniformly or from a Zipf distribution; object sizes are fixed or
+// log-uniform over a range.
+//
+// Every request is timed on its own; latencies go into log-linear histograms
+// (about 1.5% resolution) and are reported per operation as p50/p99/p999 and
+// max, with throughput, as a table or as JSON (-j). -K kills the first server
+// part way through: GETs from then on are reported apart as "get-degraded",
+// failover included.
+//
+// By default the bench speaks the dfs wire protocol itself (text lines or,
+// with -P 2, binary frames), so it measures the server. -C <dfc> runs whole
+// files through the dfc client instead, one dfc process per operation, so the
+// client's put/get/list paths are in the numbers too (process start included).
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include "dfs_proto.h"
+
+#define MAX_SERVERS 32
+#define MAX_THREADS 1024
+#define MAX_CONF 16
+#define RBUF 65536
+#define LIST_LIMIT 100          // names per LIST request
+#define IO_TIMEOUT_SEC 5
+#define START_TIMEOUT_MS 5000   // for a server to start listening
+#define DOWN_RETRY_SEC 1.0      // a server that refused a connection is left alone this long
+
+/* log-linear histogram of nanoseconds: values below H_SUB exactly, above
+   that H_SUB / 2 buckets per power of two */
+#define H_SUB 128
+#define H_BUCKETS (H_SUB + 40 * (H_SUB / 2))
+
+enum { K_PUT, K_GET, K_LIST, K_GET_DEGRADED, K_KINDS };
+static const char *kind_names[K_KINDS] = { "put", "get", "list", "get-degraded" };
+
+typedef struct {
+    uint64_t n, errors, bytes, max_ns;
+    uint64_t b[H_BUCKETS];
+} hist_t;
+
+typedef struct {
+    int fd;
+    uint32_t next_id;
+    size_t rpos, rlen;
+    char rbuf[RBUF];
+} bconn;
+
+typedef struct {
+    int id;
+    uint64_t rng;
+    bconn *conns[MAX_SERVERS];
+    double down_until[MAX_SERVERS];
+    hist_t h[K_KINDS];
+    uint64_t failovers;
+    char dir[600];          // dfc mode: where this thread's dfc runs
+    char *sink;             // GET bodies are read into this and dropped
+} worker_t;
+
+// options
+static int nservers = 4;
+static const char *dfs_bin = "./dfs";
+static char dfs_args[512] = "";
+static int nthreads = 16;
+static double duration = 10;
+static int mix[3] = { 20, 75, 5 };  // put:get:list weights
+static size_t size_min = 4096, size_max = 4096;
+static int nkeys = 1000;
+static double zipf_s = 0;           // 0: uniform
+static double kill_after = -1;
+static int proto = 1;
+static int json = 0;
+static int base_port = 25100;
+static const char *dfc_bin = NULL;
+static const char *conf_extra[MAX_CONF];
+static int nconf_extra = 0;
+
+static char workdir[256];
+static pid_t pids[MAX_SERVERS];
+static double *zipf_cdf;
+static char *payload;               // object bytes, size_max of them
+static volatile sig_atomic_t stop;
+static int killed;                  // set once -K has taken the first server down
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// xorshift64*
+static uint64_t rnd(worker_t *w) {
+    w->rng ^= w->rng >> 12;
+    w->rng ^= w->rng << 25;
+    w->rng ^= w->rng >> 27;
+    return w->rng * 2685821657736338717ULL;
+}
+
+static double rnd_unit(worker_t *w) {
+    return (rnd(w) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int hist_index(uint64_t v) {
+    if (v < H_SUB) return (int)v;
+    int e = 63 - __builtin_clzll(v) - 6;
+    int i = H_SUB + (e - 1) * (H_SUB / 2) + (int)((v >> e) - H_SUB / 2);
+    return i < H_BUCKETS ? i : H_BUCKETS - 1;
+}
+
+// middle of bucket i
+static double hist_value(int i) {
+    if (i < H_SUB) return i;
+    int e = (i - H_SUB) / (H_SUB / 2) + 1;
+    uint64_t m = (i - H_SUB) % (H_SUB / 2) + H_SUB / 2;
+    return (double)(m << e) + (double)(1ULL << e) / 2;
+}
+
+static void hist_add(hist_t *h, uint64_t ns, size_t bytes) {
+    h->n++;
+    h->bytes += bytes;
+    h->b[hist_index(ns)]++;
+    if (ns > h->max_ns) h->max_ns = ns;
+}
+
+static void hist_merge(hist_t *to, const hist_t *from) {
+    to->n += from->n;
+    to->errors += from->errors;
+    to->bytes += from->bytes;
+    if (from->max_ns > to->max_ns) to->max_ns = from->max_ns;
+    for (int i = 0; i < H_BUCKETS; i++) to->b[i] += from->b[i];
+}
+
+// the q-quantile in microseconds
+static double hist_quantile(const hist_t *h, double q) {
+    if (!h->n) return 0;
+    uint64_t want = (uint64_t)ceil(q * h->n), seen = 0;
+    if (!want) want = 1;
+    for (int i = 0; i < H_BUCKETS; i++) {
+        seen += h->b[i];
+        if (seen >= want) {
+            double v = hist_value(i);
+            return (v > h->max_ns ? h->max_ns : v) / 1e3;
+        }
+    }
+    return h->max_ns / 1e3;
+}
+
+/* Key choice and placement */
+
+static int pick_key(worker_t *w) {
+    if (!zipf_cdf) return (int)(rnd(w) % nkeys);
+    double u = rnd_unit(w);
+    int lo = 0, hi = nkeys - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < u) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static size_t pick_size(worker_t *w) {
+    if (size_min == size_max) return size_min;
+    double l = log((double)size_min), h = log((double)size_max);
+    size_t s = (size_t)exp(l + rnd_unit(w) * (h - l));
+    return s < size_min ? size_min : s > size_max ? size_max : s;
+}
+
+// FNV-1a of the key, for its first server
+static int key_home(int key) {
+    char name[32];
+    int n = snprintf(name, sizeof(name), "b%d", key);
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < n; i++) h = (h ^ (unsigned char)name[i]) * 16777619u;
+    return (int)(h % nservers);
+}
+
+/* Wire protocol */
+
+static int write_all(int fd, const void *p, size_t n) {
+    const char *c = p;
+    while (n) {
+        ssize_t w = send(fd, c, n, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        c += w; n -= w;
+    }
+    return 0;
+}
+
+static int writev_all(int fd, struct iovec *iov, int n) {
+    while (n) {
+        ssize_t w = writev(fd, iov, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        while (n && (size_t)w >= iov->iov_len) { w -= iov->iov_len; iov++; n--; }
+        if (n) { iov->iov_base = (char *)iov->iov_base + w; iov->iov_len -= w; }
+    }
+    return 0;
+}
+
+static ssize_t conn_read(bconn *c, void *buf, size_t n) {
+    if (c->rpos < c->rlen) {
+        size_t m = c->rlen - c->rpos < n ? c->rlen - c->rpos : n;
+        memcpy(buf, c->rbuf + c->rpos, m);
+        c->rpos += m;
+        return (ssize_t)m;
+    }
+    for (;;) {
+        ssize_t r = recv(c->fd, buf, n, 0);
+        if (r < 0 && errno == EINTR) continue;
+        return r;
+    }
+}
+
+static int conn_read_exact(bconn *c, void *buf, size_t n) {
+    char *p = buf;
+    while (n) {
+        ssize_t r = conn_read(c, p, n);
+        if (r <= 0) return -1;
+        p += r; n -= r;
+    }
+    return 0;
+}
+
+// one line without its newline; -1 on EOF or error
+static int read_line(bconn *c, char *buf, size_t max) {
+    size_t i = 0;
+    for (;;) {
+        if (c->rpos == c->rlen) {
+            ssize_t r = recv(c->fd, c->rbuf, RBUF, 0);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) return -1;
+            c->rpos = 0;
+            c->rlen = (size_t)r;
+        }
+        char ch = c->rbuf[c->rpos++];
+        if (ch == '\n') break;
+        if (i + 1 < max) buf[i++] = ch;
+    }
+    buf[i] = 0;
+    return (int)i;
+}
+
+// n body bytes into the worker's sink
+static int drain(bconn *c, worker_t *w, uint64_t n) {
+    while (n) {
+        ssize_t r = conn_read(c, w->sink, n < RBUF ? n : RBUF);
+        if (r <= 0) return -1;
+        n -= r;
+    }
+    return 0;
+}
+
+static void conn_drop(worker_t *w, int s) {
+    if (!w->conns[s]) return;
+    close(w->conns[s]->fd);
+    free(w->conns[s]);
+    w->conns[s] = NULL;
+}
+
+// the worker's session to server s, connecting (and agreeing on frames) if needed
+static bconn *conn_get(worker_t *w, int s) {
+    if (w->conns[s]) return w->conns[s];
+    if (now_sec() < w->down_until[s]) return NULL;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons(base_port + s) };
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        if (fd >= 0) close(fd);
+        w->down_until[s] = now_sec() + DOWN_RETRY_SEC;
+        return NULL;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct timeval tv = { IO_TIMEOUT_SEC, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    bconn *c = calloc(1, sizeof(*c));
+    if (!c) { close(fd); return NULL; }
+    c->fd = fd;
+    w->conns[s] = c;
+    if (proto >= 2) {
+        char line[128];
+        if (write_all(fd, "PROTO 2\n", 8) < 0 || read_line(c, line, sizeof(line)) < 0 || strncmp(line, "OK 2", 4) != 0) {
+            conn_drop(w, s);
+            return NULL;
+        }
+    }
+    return c;
+}
+
+// request header, in the session's protocol
+static size_t request(bconn *c, char *buf, size_t max, const char *verb, int op, const char *name,
+                      const char *args, uint64_t paylen) {
+    if (proto < 2) {
+        if (op == OP_PUT) return snprintf(buf, max, "%s %s %llu\n", verb, name, (unsigned long long)paylen);
+        return snprintf(buf, max, "%s%s%s%s%s\n", verb, *name ? " " : "", name, *args ? " " : "", args);
+    }
+    size_t nl = strlen(name), al = strlen(args);
+    dfs_hdr h = { op, 0, c->next_id++, nl, al, paylen };
+    dfs_hdr_pack((unsigned char *)buf, &h);
+    memcpy(buf + DFS_HDR_LEN, name, nl);
+    memcpy(buf + DFS_HDR_LEN + nl, args, al);
+    return DFS_HDR_LEN + nl + al;
+}
+
+/* status of a reply: 1 OK, 0 ERR, -1 broken session. *len gets the body
+   length (text GET: the number after OK) */
+static int reply(bconn *c, uint64_t *len) {
+    *len = 0;
+    if (proto >= 2) {
+        unsigned char b[DFS_HDR_LEN];
+        dfs_hdr h;
+        char info[256];
+        if (conn_read_exact(c, b, sizeof(b)) < 0 || dfs_hdr_unpack(b, &h) < 0 || h.arglen >= sizeof(info) ||
+            conn_read_exact(c, info, h.arglen) < 0) return -1;
+        *len = h.paylen;
+        return !(h.flags & DFS_F_ERR);
+    }
+    char line[256];
+    if (read_line(c, line, sizeof(line)) < 0) return -1;
+    if (strncmp(line, "OK", 2) != 0) return 0;
+    *len = strtoull(line + 2, NULL, 10);
+    return 1;
+}
+
+// both copies are sent before either reply is read; stored if either server has it
+static int wire_put(worker_t *w, int key, size_t size) {
+    char name[32], hdr[128];
+    snprintf(name, sizeof(name), "b%d", key);
+    int home = key_home(key), sent[2] = { -1, -1 }, stored = 0;
+    for (int r = 0; r < 2 && r < nservers; r++) {
+        int s = (home + r) % nservers;
+        bconn *c = conn_get(w, s);
+        if (!c) continue;
+        size_t n = request(c, hdr, sizeof(hdr), "PUT", OP_PUT, name, "", size);
+        struct iovec iov[2] = { { hdr, n }, { payload, size } };
+        if (writev_all(c->fd, iov, 2) < 0) { conn_drop(w, s); continue; }
+        sent[r] = s;
+    }
+    for (int r = 0; r < 2; r++) {
+        if (sent[r] < 0) continue;
+        uint64_t len;
+        int ok = reply(w->conns[sent[r]], &len);
+        if (ok < 0) conn_drop(w, sent[r]);
+        stored |= ok > 0;
+    }
+    return stored ? 0 : -1;
+}
+
+// bytes read, or -1; *failover set if the first server could not answer
+static long long wire_get(worker_t *w, int key, int *failover) {
+    char name[32], hdr[128];
+    snprintf(name, sizeof(name), "b%d", key);
+    int home = key_home(key);
+    *failover = 0;
+    for (int r = 0; r < 2 && r < nservers; r++) {
+        int s = (home + r) % nservers;
+        bconn *c = conn_get(w, s);
+        uint64_t len;
+        int ok = -1;
+        if (c) {
+            size_t n = request(c, hdr, sizeof(hdr), "GET", OP_GET, name, "", 0);
+            ok = write_all(c->fd, hdr, n) < 0 ? -1 : reply(c, &len);
+            if (ok > 0 && drain(c, w, len) < 0) ok = -1;
+            if (ok < 0) conn_drop(w, s);
+        }
+        if (ok > 0) return (long long)len;
+        *failover = 1;
+    }
+    return -1;
+}
+
+// one page of server s's catalog from key on; names read, or -1
+static long long list_page(worker_t *w, int s, int key) {
+    char args[64], hdr[128], line[600];
+    bconn *c = conn_get(w, s);
+    if (!c) return -1;
+    snprintf(args, sizeof(args), "AFTER b%d LIMIT %d", key, LIST_LIMIT);
+    size_t n = request(c, hdr, sizeof(hdr), "LIST", OP_LIST, "", args, 0);
+    long long names = 0;
+    if (write_all(c->fd, hdr, n) < 0) { conn_drop(w, s); return -1; }
+    if (proto >= 2) {
+        uint64_t len;
+        int ok = reply(c, &len);
+        if (ok < 0 || drain(c, w, len) < 0) { conn_drop(w, s); return -1; }
+        return ok ? (long long)len : -1;
+    }
+    for (;;) {
+        if (read_line(c, line, sizeof(line)) < 0) { conn_drop(w, s); return -1; }
+        if (strncmp(line, "END", 3) == 0 && (line[3] == 0 || line[3] == ' ')) return names;
+        names++;
+    }
+}
+
+// a page from a random server, or the next one if that is down
+static long long wire_list(worker_t *w) {
+    int s = (int)(rnd(w) % nservers), key = pick_key(w);
+    long long n = list_page(w, s, key);
+    if (n < 0 && nservers > 1) n = list_page(w, (s + 1) % nservers, key);
+    return n;
+}
+
+/* dfc mode: each operation is one dfc process, run in the worker's own
+   directory (its dfc.conf lists the servers); gets land in <dir>/get */
+
+static int run_dfc(const char *dir, const char *cmd, const char *arg, const char *out) {
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        int fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        int null = open("/dev/null", O_WRONLY);
+        if (chdir(dir) < 0 || fd < 0 || null < 0) _exit(127);
+        dup2(fd, 1);
+        dup2(null, 2);
+        execl(dfc_bin, dfc_bin, cmd, arg, (char *)NULL);
+        _exit(127);
+    }
+    int st;
+    while (waitpid(pid, &st, 0) < 0) if (errno != EINTR) return -1;
+    return WIFEXITED(st) && WEXITSTATUS(st) == 0 ? 0 : -1;
+}
+
+static off_t file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+// the object is written out before the clock starts
+static int dfc_put_prepare(worker_t *w, int key, size_t size) {
+    char path[700];
+    snprintf(path, sizeof(path), "%s/b%d", w->dir, key);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    int rc = write(fd, payload, size) == (ssize_t)size ? 0 : -1;
+    close(fd);
+    return rc;
+}
+
+static int dfc_put(worker_t *w, int key) {
+    char name[32], out[700], path[700];
+    snprintf(name, sizeof(name), "b%d", key);
+    snprintf(out, sizeof(out), "%s/out", w->dir);
+    snprintf(path, sizeof(path), "%s/%s", w->dir, name);
+    // dfc put says nothing unless it failed
+    int rc = run_dfc(w->dir, "put", name, out) == 0 && file_size(out) == 0 ? 0 : -1;
+    unlink(path);
+    return rc;
+}
+
+static long long dfc_get(worker_t *w, int key) {
+    char name[32], dir[700], out[700], path[800];
+    snprintf(name, sizeof(name), "b%d", key);
+    snprintf(dir, sizeof(dir), "%s/get", w->dir);
+    snprintf(out, sizeof(out), "%s/out", w->dir);
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    // the file only appears once every byte is in
+    if (run_dfc(dir, "get", name, out) < 0) return -1;
+    off_t n = file_size(path);
+    unlink(path);
+    return n;
+}
+
+static long long dfc_list(worker_t *w) {
+    char out[700];
+    snprintf(out, sizeof(out), "%s/out", w->dir);
+    if (run_dfc(w->dir, "list", NULL, out) < 0) return -1;
+    return file_size(out);
+}
+
+static int write_conf(const char *dir) {
+    char path[800];
+    snprintf(path, sizeof(path), "%s/dfc.conf", dir);
+    FILE *f = fopen(path, "w");
+    if (!f) return -1;
+    for (int s = 0; s < nservers; s++) fprintf(f, "server dfs%d 127.0.0.1:%d\n", s + 1, base_port + s);
+    for (int i = 0; i < nconf_extra; i++) fprintf(f, "%s\n", conf_extra[i]);
+    fprintf(f, "health off\n");
+    return fclose(f);
+}
+
+/* The run */
+
+static int do_put(worker_t *w, int key, size_t size) {
+    if (!dfc_bin) return wire_put(w, key, size);
+    return dfc_put(w, key);
+}
+
+static void *preload_main(void *arg) {
+    worker_t *w = arg;
+    for (int k = w->id; k < nkeys && !stop; k += nthreads) {
+        size_t size = pick_size(w);
+        if ((dfc_bin && dfc_put_prepare(w, k, size) < 0) || do_put(w, k, size) < 0) {
+            fprintf(stderr, "dfsbench: preloading b%d failed\n", k);
+            stop = 1;
+        }
+    }
+    return NULL;
+}
+
+static void *worker_main(void *arg) {
+    worker_t *w = arg;
+    double end = now_sec() + duration;
+    int total = mix[0] + mix[1] + mix[2];
+    while (!stop && now_sec() < end) {
+        int pick = (int)(rnd(w) % total), key = pick_key(w);
+        int kind = pick < mix[0] ? K_PUT : pick < mix[0] + mix[1] ? K_GET : K_LIST;
+        size_t size = kind == K_PUT ? pick_size(w) : 0;
+        if (kind == K_PUT && dfc_bin && dfc_put_prepare(w, key, size) < 0) continue;
+        if (kind == K_GET && __atomic_load_n(&killed, __ATOMIC_ACQUIRE)) kind = K_GET_DEGRADED;
+        uint64_t t0 = now_ns();
+        long long n;
+        int failover = 0;
+        if (kind == K_PUT) n = do_put(w, key, size) == 0 ? (long long)size : -1;
+        else if (kind == K_LIST) n = dfc_bin ? dfc_list(w) : wire_list(w);
+        else n = dfc_bin ? dfc_get(w, key) : wire_get(w, key, &failover);
+        uint64_t ns = now_ns() - t0;
+        if (n < 0) w->h[kind].errors++;
+        else hist_add(&w->h[kind], ns, kind == K_LIST ? 0 : (size_t)n);
+        w->failovers += failover;
+    }
+    return NULL;
+}
+
+static int start_servers() {
+    for (int s = 0; s < nservers; s++) {
+        char dir[400], port[16], log[420];
+        snprintf(dir, sizeof(dir), "%s/d%d", workdir, s + 1);
+        snprintf(port, sizeof(port), "%d", base_port + s);
+        snprintf(log, sizeof(log), "%s/dfs%d.log", workdir, s + 1);
+        char args[512], *argv[64];
+        int argc = 0;
+        snprintf(args, sizeof(args), "%s", dfs_args);
+        argv[argc++] = (char *)dfs_bin;
+        argv[argc++] = dir;
+        argv[argc++] = port;
+        for (char *tok = strtok(args, " "); tok && argc < 63; tok = strtok(NULL, " ")) argv[argc++] = tok;
+        argv[argc] = NULL;
+        pid_t pid = fork();
+        if (pid < 0) return -1;
+        if (pid == 0) {
+            int fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd >= 0) { dup2(fd, 1); dup2(fd, 2); }
+            execv(dfs_bin, argv);
+            _exit(127);
+        }
+        pids[s] = pid;
+    }
+    // ready once every port takes connections
+    for (int s = 0; s < nservers; s++) {
+        double until = now_sec() + START_TIMEOUT_MS / 1e3;
+        for (;;) {
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons(base_port + s) };
+            sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            int ok = fd >= 0 && connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0;
+            if (fd >= 0) close(fd);
+            if (ok) break;
+            if (now_sec() > until || waitpid(pids[s], NULL, WNOHANG) == pids[s]) {
+                fprintf(stderr, "dfsbench: server %d did not start (see %s/dfs%d.log)\n", s + 1, workdir, s + 1);
+                return -1;
+            }
+            usleep(10000);
+        }
+    }
+    return 0;
+}
+
+static void stop_servers() {
+    for (int s = 0; s < nservers; s++) if (pids[s] > 0) kill(pids[s], SIGTERM);
+    for (int s = 0; s < nservers; s++) if (pids[s] > 0) waitpid(pids[s], NULL, 0);
+}
+
+static int rm_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st; (void)flag; (void)ftw;
+    remove(path);
+    return 0;
+}
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+static void report(hist_t *h, double secs, uint64_t failovers) {
+    uint64_t ops = 0;
+    for (int k = 0; k < K_KINDS; k++) ops += h[k].n;
+    char dist[32];
+    if (zipf_cdf) snprintf(dist, sizeof(dist), "zipf:%g", zipf_s);
+    else snprintf(dist, sizeof(dist), "uniform");
+    if (json) {
+        printf("{\"backend\":\"%s\",\"servers\":%d,\"dfs_args\":\"%s\",\"protocol\":%d,\"connections\":%d,"
+               "\"seconds\":%.3f,\"mix\":{\"put\":%d,\"get\":%d,\"list\":%d},\"size_min\":%zu,\"size_max\":%zu,"
+               "\"keys\":%d,\"distribution\":\"%s\",\"kill_after\":%g,\"failovers\":%llu,\"ops\":{",
+               dfc_bin ? "dfc" : "wire", nservers, dfs_args, proto, nthreads, secs, mix[0], mix[1], mix[2],
+               size_min, size_max, nkeys, dist, kill_after, (unsigned long long)failovers);
+        int first = 1;
+        for (int k = 0; k < K_KINDS; k++) {
+            if (!h[k].n && !h[k].errors) continue;
+            printf("%s\"%s\":{\"count\":%llu,\"errors\":%llu,\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,"
+                   "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}",
+                   first ? "" : ",", kind_names[k], (unsigned long long)h[k].n, (unsigned long long)h[k].errors,
+                   h[k].n / secs, h[k].bytes / secs / (1 << 20), hist_quantile(&h[k], 0.5),
+                   hist_quantile(&h[k], 0.99), hist_quantile(&h[k], 0.999), h[k].max_ns / 1e3);
+            first = 0;
+        }
+        printf("},\"total_ops_per_sec\":%.1f}\n", ops / secs);
+        return;
+    }
+    printf("dfsbench: %s, %d servers (%s%s%s), %d connections, %.1f s\n", dfc_bin ? "dfc client" : "wire protocol",
+           nservers, dfs_bin, dfs_args[0] ? " " : "", dfs_args, nthreads, secs);
+    printf("mix put:get:list %d:%d:%d, objects %zu-%zu bytes, %d keys %s", mix[0], mix[1], mix[2],
+           size_min, size_max, nkeys, dist);
+    if (kill_after >= 0) printf(", server 1 killed at %.1f s (%llu failovers)", kill_after, (unsigned long long)failovers);
+    printf("\n%-13s %9s %7s %10s %9s %9s %9s %9s %9s\n", "op", "count", "errors", "ops/s", "MB/s",
+           "p50 us", "p99 us", "p999 us", "max us");
+    for (int k = 0; k < K_KINDS; k++) {
+        if (!h[k].n && !h[k].errors) continue;
+        printf("%-13s %9llu %7llu %10.1f %9.2f %9.1f %9.1f %9.1f %9.1f\n", kind_names[k],
+               (unsigned long long)h[k].n, (unsigned long long)h[k].errors, h[k].n / secs,
+               h[k].bytes / secs / (1 << 20), hist_quantile(&h[k], 0.5), hist_quantile(&h[k], 0.99),
+               hist_quantile(&h[k], 0.999), h[k].max_ns / 1e3);
+    }
+    printf("%-13s %9llu %7s %10.1f\n", "total", (unsigned long long)ops, "", ops / secs);
+}
+
+static void usage() {
+    fprintf(stderr,
+        "Usage: dfsbench [options]\n"
+        "  -n <servers>      local dfs servers to start (default 4, at most %d)\n"
+        "  -S <path>         dfs binary (default ./dfs)\n"
+        "  -a \"<args>\"       extra dfs arguments, e.g. \"-t 4 -s 2\"\n"
+        "  -c <connections>  client threads, one session per server each (default 16)\n"
+        "  -d <seconds>      length of the timed run (default 10)\n"
+        "  -m <put:get:list> operation mix as weights (default 20:75:5)\n"
+        "  -z <size>[-<max>] object size, or a log-uniform range, [K|M] (default 4K)\n"
+        "  -k <keys>         key space, preloaded before the run (default 1000)\n"
+        "  -D uniform|zipf[:<s>]  key distribution (zipf exponent default 0.99)\n"
+        "  -K <seconds>      kill server 1 this far into the run\n"
+        "  -P 1|2            text lines or binary frames (default 1)\n"
+        "  -C <dfc>          run whole files through this dfc binary instead\n"
+        "  -x \"<line>\"       extra dfc.conf line for -C (repeatable)\n"
+        "  -p <port>         first server port (default 25100)\n"
+        "  -j                JSON output\n", MAX_SERVERS);
+    exit(1);
+}
+
+// "64K", "8M", "1G" or plain bytes, *end past it; (size_t)-1 if it has no digits, as in dfs.c
+static size_t parse_size(const char *v, char **end) {
+    unsigned long long n = strtoull(v, end, 10);
+    if (*end == v) return (size_t)-1;
+    switch (**end) {
+    case 'k': case 'K': n <<= 10; (*end)++; break;
+    case 'm': case 'M': n <<= 20; (*end)++; break;
+    case 'g': case 'G': n <<= 30; (*end)++; break;
+    }
+    return (size_t)n;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    char *end;
+    while ((opt = getopt(argc, argv, "n:S:a:c:d:m:z:k:D:K:P:C:x:p:jh")) != -1) {
+        switch (opt) {
+        case 'n': nservers = atoi(optarg); break;
+        case 'S': dfs_bin = optarg; break;
+        case 'a': snprintf(dfs_args, sizeof(dfs_args), "%s", optarg); break;
+        case 'c': nthreads = atoi(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'm': if (sscanf(optarg, "%d:%d:%d", &mix[0], &mix[1], &mix[2]) != 3) usage(); break;
+        case 'z':
+            size_min = size_max = parse_size(optarg, &end);
+            if (*end == '-') size_max = parse_size(end + 1, &end);
+            if (*end || size_min == (size_t)-1 || size_max == (size_t)-1) usage();
+            break;
+        case 'k': nkeys = atoi(optarg); break;
+        case 'D':
+            if (strncmp(optarg, "zipf", 4) == 0) zipf_s = optarg[4] == ':' ? atof(optarg + 5) : 0.99;
+            else if (strcmp(optarg, "uniform") != 0) usage();
+            break;
+        case 'K': kill_after = atof(optarg); break;
+        case 'P': proto = atoi(optarg); break;
+        case 'C': dfc_bin = optarg; break;
+        case 'x': if (nconf_extra < MAX_CONF) conf_extra[nconf_extra++] = optarg; break;
+        case 'p': base_port = atoi(optarg); break;
+        case 'j': json = 1; break;
+        default: usage();
+        }
+    }
+    if (nservers < 1 || nservers > MAX_SERVERS || nthreads < 1 || nthreads > MAX_THREADS || duration <= 0 ||
+        nkeys < 1 || !size_max || size_min > size_max || mix[0] < 0 || mix[1] < 0 || mix[2] < 0 ||
+        mix[0] + mix[1] + mix[2] == 0 || (proto != 1 && proto != 2) || (kill_after >= 0 && kill_after >= duration))
+        usage();
+    if (zipf_s > 0) {
+        // cdf of P(rank i) ~ 1 / (i + 1)^s
+        zipf_cdf = malloc(nkeys * sizeof(double));
+        if (!zipf_cdf) return 1;
+        double sum = 0;
+        for (int i = 0; i < nkeys; i++) zipf_cdf[i] = sum += 1.0 / pow(i + 1, zipf_s);
+        for (int i = 0; i < nkeys; i++) zipf_cdf[i] /= sum;
+    }
+    // dfc runs from per-thread directories
+    static char dfc_path[PATH_MAX];
+    if (dfc_bin) {
+        if (!realpath(dfc_bin, dfc_path)) { perror(dfc_bin); return 1; }
+        dfc_bin = dfc_path;
+    }
+    payload = malloc(size_max);
+    if (!payload) { fprintf(stderr, "dfsbench: cannot allocate %zu byte objects\n", size_max); return 1; }
+    srand(1);
+    for (size_t i = 0; i < size_max; i++) payload[i] = (char)rand();
+
+    snprintf(workdir, sizeof(workdir), "/tmp/dfsbench.%d", (int)getpid());
+    if (mkdir(workdir, 0755) < 0) { perror(workdir); return 1; }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    static worker_t workers[MAX_THREADS];
+    pthread_t tids[MAX_THREADS];
+    int rc = 1;
+    if (start_servers() < 0) goto out;
+    for (int t = 0; t < nthreads; t++) {
+        worker_t *w = &workers[t];
+        w->id = t;
+        w->rng = 0x9E3779B97F4A7C15ULL * (t + 1);
+        if (!(w->sink = malloc(RBUF))) goto out;
+        if (dfc_bin) {
+            char get[700];
+            snprintf(w->dir, sizeof(w->dir), "%s/c%d", workdir, t);
+            snprintf(get, sizeof(get), "%s/get", w->dir);
+            if (mkdir(w->dir, 0755) < 0 || mkdir(get, 0755) < 0 || write_conf(w->dir) < 0 || write_conf(get) < 0) goto out;
+        }
+    }
+    if (!json) fprintf(stderr, "dfsbench: preloading %d keys\n", nkeys);
+    for (int t = 0; t < nthreads; t++) pthread_create(&tids[t], NULL, preload_main, &workers[t]);
+    for (int t = 0; t < nthreads; t++) pthread_join(tids[t], NULL);
+    if (stop) goto out;
+
+    double t0 = now_sec();
+    for (int t = 0; t < nthreads; t++) pthread_create(&tids[t], NULL, worker_main, &workers[t]);
+    if (kill_after >= 0) {
+        // whatever is in flight on server 1 fails over to the copy
+        while (!stop && now_sec() - t0 < kill_after) usleep(1000);
+        kill(pids[0], SIGKILL);
+        waitpid(pids[0], NULL, 0);
+        pids[0] = 0;
+        __atomic_store_n(&killed, 1, __ATOMIC_RELEASE);
+    }
+    for (int t = 0; t < nthreads; t++) pthread_join(tids[t], NULL);
+    double secs = now_sec() - t0;
+
+    hist_t *total = calloc(K_KINDS, sizeof(hist_t));
+    uint64_t failovers = 0;
+    if (!total) goto out;
+    for (int t = 0; t < nthreads; t++) {
+        for (int k = 0; k < K_KINDS; k++) hist_merge(&total[k], &workers[t].h[k]);
+        failovers += workers[t].failovers;
+    }
+    report(total, secs, failovers);
+    free(total);
+    rc = 0;
+out:
+    stop_servers();
+    for (int t = 0; t < nthreads; t++) {
+        for (int s = 0; s < nservers; s++) conn_drop(&workers[t], s);
+        free(workers[t].sink);
+    }
+    nftw(workdir, rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+    free(payload);
+    free(zipf_cdf);
+    return rc;
+}